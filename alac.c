@@ -52,8 +52,8 @@ static const int host_bigendian = 0;
                    v = (((v) & 0x00FF) << 0x08) | \
                        (((v) & 0xFF00) >> 0x08); } while (0)
 
-struct {signed int x:24;} se_struct_24;
-#define SignExtend24(val) (se_struct_24.x = val)
+// no shared scratch: decoders for several streams run at once
+#define SignExtend24(val) (((signed int)((unsigned int)(val) << 8)) >> 8)
 
 void allocate_buffers(alac_file *alac)
 {
@@ -1115,3 +1115,17 @@ alac_file *create_alac(int samplesize, int numchannels)
     return newfile;
 }
 
+void destroy_alac(alac_file *alac)
+{
+    free(alac->predicterror_buffer_a);
+    free(alac->predicterror_buffer_b);
+
+    free(alac->outputsamples_buffer_a);
+    free(alac->outputsamples_buffer_b);
+
+    free(alac->uncompressed_bytes_buffer_a);
+    free(alac->uncompressed_bytes_buffer_b);
+
+    free(alac);
+}
+
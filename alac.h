@@ -9,6 +9,7 @@ void decode_frame(alac_file *alac,
                   void *outbuffer, int *outputsize);
 void alac_set_info(alac_file *alac, char *inputbuffer);
 void allocate_buffers(alac_file *alac);
+void destroy_alac(alac_file *alac);
 
 struct alac_file
 {
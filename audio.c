@@ -0,0 +1,363 @@
+/*
+ * Output backend registry for HairTunes
+ * Copyright (c) ShairPort contributors 2012
+ * All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "audio.h"
+
+#define FRAME_SIZE      4       // bytes, S16 stereo
+#define CHUNK_FRAMES    1024    // taken off a queue at a time
+
+struct audio_output {
+    const audio_backend_t *backend;
+    void *h;
+    audio_output_t *next;
+
+    // a secondary output's queue, in frames
+    short *queue;
+    int size, rd, fill;
+    int rate;
+    unsigned long dropped;      // thrown away because the output fell behind
+    int failed, stop;
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+};
+
+static const audio_backend_t *backends[] = {
+    &audio_ao,
+#ifdef HAVE_ALSA
+    &audio_alsa,
+#endif
+    &audio_pipe,
+    &audio_file,
+#ifdef __linux__
+    &audio_shm,
+#endif
+    &audio_null,
+    NULL
+};
+
+const audio_backend_t *audio_backend(const char *name) {
+    int i;
+    for (i = 0; backends[i]; i++)
+        if (!strcasecmp(name, backends[i]->name))
+            return backends[i];
+    return NULL;
+}
+
+static size_t thread_stack = 0;
+
+void audio_thread_stack(size_t bytes) {
+    thread_stack = bytes;
+}
+
+int audio_thread_create(pthread_t *thread, void *(*func)(void *), void *arg) {
+    pthread_attr_t attr;
+    int err;
+
+    if (!thread_stack)
+        return pthread_create(thread, NULL, func, arg);
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, thread_stack);
+    err = pthread_create(thread, &attr, func, arg);
+    pthread_attr_destroy(&attr);
+    return err;
+}
+
+int audio_option(const char *name, const char *value) {
+    int i, taken = 0;
+    // no break: a tunable may mean something to more than one backend
+    for (i = 0; backends[i]; i++)
+        if (backends[i]->option && backends[i]->option(name, value))
+            taken = 1;
+    return taken;
+}
+
+audio_output_t *audio_open(const audio_backend_t *backend, audio_format_t *fmt) {
+    audio_output_t *out;
+    void *h = backend->open(fmt);
+
+    if (!h)
+        return NULL;
+    out = calloc(1, sizeof(audio_output_t));
+    out->backend = backend;
+    out->h = h;
+    return out;
+}
+
+// a secondary output's thread: play whatever turns up in the queue
+static void *queue_thread(void *arg) {
+    audio_output_t *q = arg;
+    short *chunk = malloc(CHUNK_FRAMES * FRAME_SIZE);
+    int n;
+
+    pthread_mutex_lock(&q->mutex);
+    while (!q->stop) {
+        if (!q->fill) {
+            pthread_cond_wait(&q->cond, &q->mutex);
+            continue;
+        }
+        n = q->size - q->rd;
+        if (n > q->fill)
+            n = q->fill;
+        if (n > CHUNK_FRAMES)
+            n = CHUNK_FRAMES;
+        memcpy(chunk, q->queue + 2*q->rd, n * FRAME_SIZE);
+        q->rd = (q->rd + n) % q->size;
+        q->fill -= n;
+        pthread_mutex_unlock(&q->mutex);
+
+        n = q->backend->play(q->h, chunk, n);
+
+        pthread_mutex_lock(&q->mutex);
+        if (n < 0) {
+            fprintf(stderr, "%s output failed; the others carry on\n", q->backend->name);
+            q->failed = 1;
+            q->fill = 0;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&q->mutex);
+
+    free(chunk);
+    return NULL;
+}
+
+// never blocks on the output behind it: if the queue is full, the oldest
+// audio in it goes
+static void queue_put(audio_output_t *q, const short *buf, int frames) {
+    int wr, n;
+
+    pthread_mutex_lock(&q->mutex);
+    if (q->failed) {
+        pthread_mutex_unlock(&q->mutex);
+        return;
+    }
+    if (frames > q->size) {
+        q->dropped += frames - q->size;
+        buf += 2*(frames - q->size);
+        frames = q->size;
+    }
+    if (q->fill + frames > q->size) {
+        n = q->fill + frames - q->size;
+        q->rd = (q->rd + n) % q->size;
+        q->fill -= n;
+        q->dropped += n;
+    }
+    while (frames > 0) {
+        wr = (q->rd + q->fill) % q->size;
+        n = q->size - wr;
+        if (n > frames)
+            n = frames;
+        memcpy(q->queue + 2*wr, buf, n * FRAME_SIZE);
+        q->fill += n;
+        buf += 2*n;
+        frames -= n;
+    }
+    pthread_cond_signal(&q->cond);
+    pthread_mutex_unlock(&q->mutex);
+}
+
+audio_output_t *audio_add(audio_output_t *out, const audio_backend_t *backend,
+                          audio_format_t *fmt, int queue_ms) {
+    audio_output_t *q, **tail;
+
+    fmt->follow = 1;
+    q = audio_open(backend, fmt);
+    if (!q)
+        return NULL;
+
+    q->rate = fmt->rate;
+    q->size = (long long)fmt->rate * (queue_ms > 0 ? queue_ms : 500) / 1000;
+    if (q->size < CHUNK_FRAMES)
+        q->size = CHUNK_FRAMES;
+    q->queue = malloc(q->size * FRAME_SIZE);
+    if (!q->queue)
+        goto fail;
+    pthread_mutex_init(&q->mutex, NULL);
+    pthread_cond_init(&q->cond, NULL);
+    if (audio_thread_create(&q->thread, queue_thread, q)) {
+        pthread_mutex_destroy(&q->mutex);
+        pthread_cond_destroy(&q->cond);
+        free(q->queue);
+        goto fail;
+    }
+
+    for (tail = &out->next; *tail; tail = &(*tail)->next)
+        ;
+    *tail = q;
+    return q;
+
+fail:
+    backend->close(q->h);
+    free(q);
+    return NULL;
+}
+
+int audio_play(audio_output_t *out, const short *buf, int frames) {
+    audio_output_t *q;
+
+    for (q = out->next; q; q = q->next)
+        queue_put(q, buf, frames);
+    return out->backend->play(out->h, buf, frames);
+}
+
+int audio_delay(audio_output_t *out) {
+    if (!out->backend->delay)
+        return -1;
+    return out->backend->delay(out->h);
+}
+
+// the secondary outputs are left alone: they have their queues to play
+// out, and a pause shouldn't wait on them
+int audio_pause(audio_output_t *out, int paused) {
+    if (!out->backend->pause)
+        return 0;
+    out->backend->pause(out->h, paused);
+    return 1;
+}
+
+void audio_close(audio_output_t *out) {
+    audio_output_t *q, *next;
+
+    for (q = out->next; q; q = next) {
+        next = q->next;
+        pthread_mutex_lock(&q->mutex);
+        q->stop = 1;
+        pthread_cond_signal(&q->cond);
+        pthread_mutex_unlock(&q->mutex);
+        pthread_join(q->thread, NULL);
+        q->next = NULL;
+        audio_close(q);
+    }
+    if (out->queue) {
+        pthread_mutex_destroy(&out->mutex);
+        pthread_cond_destroy(&out->cond);
+        free(out->queue);
+    }
+    out->backend->close(out->h);
+    free(out);
+}
+
+void audio_stats(audio_output_t *out, char *buf, int size) {
+    audio_output_t *q;
+    int n;
+
+    buf[0] = '\0';
+    if (!out)
+        return;
+    if (out->backend->stats)
+        out->backend->stats(out->h, buf, size);
+
+    // then each secondary, by name
+    for (q = out->next; q; q = q->next) {
+        n = strlen(buf);
+        pthread_mutex_lock(&q->mutex);
+        n += snprintf(buf + n, size - n, "%s%s: queue %dms drop %lu%s", n ? " " : "",
+                      q->backend->name, (int)((long long)q->fill * 1000 / q->rate),
+                      q->dropped, q->failed ? " failed" : "");
+        pthread_mutex_unlock(&q->mutex);
+        if (n < size - 1 && q->backend->stats) {
+            buf[n++] = ' ';
+            q->backend->stats(q->h, buf + n, size - n);
+        }
+        if (n >= size - 1)
+            break;
+    }
+}
+
+// Outputs with no clock of their own sleep to play at the nominal rate,
+// scaled by "speed"; 0 or less doesn't wait at all.
+static double pace_speed = 1.0;
+
+void audio_pace(audio_pacer_t *pc, int rate, int frames) {
+    struct timespec now;
+
+    if (pc->off)
+        return;
+    if (!pc->played)
+        clock_gettime(CLOCK_MONOTONIC, &pc->start);
+    pc->played += frames;
+    if (pace_speed <= 0)
+        return;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    long long wait = pc->played * 1e9 / (rate * pace_speed) -
+        ((now.tv_sec - pc->start.tv_sec) * 1000000000LL + (now.tv_nsec - pc->start.tv_nsec));
+    if (wait > 0) {
+        struct timespec ts;
+        ts.tv_sec = wait / 1000000000LL;
+        ts.tv_nsec = wait % 1000000000LL;
+        nanosleep(&ts, NULL);
+    }
+}
+
+// The null backend throws the audio away at the pace a real device would
+// take it.
+typedef struct {
+    int rate;
+    audio_pacer_t pacer;
+} null_out_t;
+
+static int null_option(const char *name, const char *value) {
+    if (!strcasecmp(name, "speed")) {
+        pace_speed = atof(value);
+        return 1;
+    }
+    return 0;
+}
+
+static void *null_open(audio_format_t *fmt) {
+    null_out_t *n = calloc(1, sizeof(null_out_t));
+    n->rate = fmt->rate;
+    n->pacer.off = fmt->follow;
+    return n;
+}
+
+static int null_play(void *h, const short *buf, int frames) {
+    null_out_t *n = h;
+    audio_pace(&n->pacer, n->rate, frames);
+    return 0;
+}
+
+static void null_close(void *h) {
+    free(h);
+}
+
+const audio_backend_t audio_null = {
+    .name = "null",
+    .shared = 1,
+    .option = null_option,
+    .open = null_open,
+    .play = null_play,
+    .close = null_close,
+};
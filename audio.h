@@ -0,0 +1,101 @@
+#ifndef _AUDIO_H_
+#define _AUDIO_H_
+
+#include <time.h>
+#include <stddef.h>
+#include <pthread.h>
+
+// Output backends. Every backend takes interleaved, native-endian 16-bit
+// PCM and is described by a table of operations; the tables are listed in
+// audio.c, so a new backend is one more file and one more line there.
+
+typedef struct {
+    int rate;
+    int channels;
+    int bits;
+    int follow;     // another output sets the pace; don't wait for the clock
+} audio_format_t;
+
+typedef struct {
+    const char *name;
+
+    // opens have nothing between them, so any number can play at once
+    int shared;
+
+    // a backend tunable ("alsa_period", "pipe", ...), given before open.
+    // returns 0 if the name isn't one of this backend's. may be NULL.
+    int (*option)(const char *name, const char *value);
+
+    // open for *fmt. a backend that can't take the format exactly writes
+    // back what it could do instead and returns NULL, as it does on any
+    // other failure.
+    void *(*open)(audio_format_t *fmt);
+
+    // blocks until all of 'frames' is accepted; < 0 if the output is lost
+    int (*play)(void *h, const short *buf, int frames);
+
+    // frames accepted but not yet heard, -1 if unknown. may be NULL.
+    int (*delay)(void *h);
+
+    // nothing more is coming for a while (paused), or it is again
+    // (!paused). lets a device that would otherwise run dry stop cleanly
+    // once it has played what it holds. may be NULL.
+    void (*pause)(void *h, int paused);
+
+    void (*close)(void *h);
+
+    // backend counters for the "stats" line, eg. "xrun 0". may be NULL.
+    void (*stats)(void *h, char *buf, int size);
+} audio_backend_t;
+
+// An open output. Secondary outputs hang off the first one and are fed
+// through a queue of their own by their own thread, so one that is slow
+// or fails costs the others nothing.
+typedef struct audio_output audio_output_t;
+
+// the backend called 'name', or NULL
+const audio_backend_t *audio_backend(const char *name);
+
+// offer an option to every backend; 0 if none took it
+int audio_option(const char *name, const char *value);
+
+// NULL on failure, with *fmt as the backend left it
+audio_output_t *audio_open(const audio_backend_t *backend, audio_format_t *fmt);
+int audio_play(audio_output_t *out, const short *buf, int frames);
+int audio_delay(audio_output_t *out);
+// 0 if the output can't stop, and has to be fed silence to keep going
+int audio_pause(audio_output_t *out, int paused);
+void audio_close(audio_output_t *out);
+void audio_stats(audio_output_t *out, char *buf, int size);
+
+// open another output that gets everything 'out' plays, behind a queue of
+// 'queue_ms'. NULL on failure, leaving 'out' as it was.
+audio_output_t *audio_add(audio_output_t *out, const audio_backend_t *backend,
+                          audio_format_t *fmt, int queue_ms);
+
+// for outputs without a clock: sleep so that 'frames' more take as long
+// as they would at 'rate'. zero the pacer to start, and set 'off' when
+// opened to follow another output.
+typedef struct {
+    struct timespec start;
+    long long played;
+    int off;
+} audio_pacer_t;
+
+void audio_pace(audio_pacer_t *pc, int rate, int frames);
+
+// threads the outputs start for themselves (queues, the file writer) get
+// 'bytes' of stack, or the default for 0. set when memory is locked, as
+// every stack is then pinned whole.
+void audio_thread_stack(size_t bytes);
+int audio_thread_create(pthread_t *thread, void *(*func)(void *), void *arg);
+
+extern const audio_backend_t audio_null, audio_pipe, audio_file, audio_ao;
+#ifdef HAVE_ALSA
+extern const audio_backend_t audio_alsa;
+#endif
+#ifdef __linux__
+extern const audio_backend_t audio_shm;
+#endif
+
+#endif
@@ -0,0 +1,284 @@
+/*
+ * ALSA output for HairTunes
+ * Copyright (c) ShairPort contributors 2012
+ * All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifdef HAVE_ALSA
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <alsa/asoundlib.h>
+
+#include "audio.h"
+
+// Direct ALSA output. Transfers go through the mmap area where the device
+// allows it, and writei otherwise; xruns and suspends are recovered in
+// place and counted.
+
+#define DEFAULT_PERIOD  1024
+#define DEFAULT_PERIODS 4
+
+#define FRAME_SIZE      4       // bytes, S16 stereo
+
+typedef struct {
+    snd_pcm_t *pcm;
+    int mmap;
+    snd_pcm_uframes_t period_size, buffer_size;
+    unsigned long xruns;
+} alsa_out_t;
+
+static char *alsa_device = "default";
+static int alsa_period = 0;     // frames, 0 for the default
+static int alsa_buffer = 0;
+static int alsa_mmap = 1;
+
+static int alsa_option(const char *name, const char *value) {
+    if (!strcasecmp(name, "alsa_device"))
+        alsa_device = strdup(value);
+    else if (!strcasecmp(name, "alsa_period"))
+        alsa_period = atoi(value);
+    else if (!strcasecmp(name, "alsa_buffer"))
+        alsa_buffer = atoi(value);
+    else if (!strcasecmp(name, "alsa_mmap"))
+        alsa_mmap = atoi(value);
+    else
+        return 0;
+    return 1;
+}
+
+static int set_hw_params(alsa_out_t *a, audio_format_t *fmt) {
+    snd_pcm_t *pcm = a->pcm;
+    snd_pcm_hw_params_t *hw;
+    unsigned int got_rate = fmt->rate;
+    int err;
+
+    snd_pcm_hw_params_alloca(&hw);
+    if ((err = snd_pcm_hw_params_any(pcm, hw)) < 0)
+        return err;
+
+    if (!a->mmap ||
+        snd_pcm_hw_params_set_access(pcm, hw, SND_PCM_ACCESS_MMAP_INTERLEAVED) < 0) {
+        a->mmap = 0;
+        if ((err = snd_pcm_hw_params_set_access(pcm, hw, SND_PCM_ACCESS_RW_INTERLEAVED)) < 0)
+            return err;
+    }
+    if ((err = snd_pcm_hw_params_set_format(pcm, hw, SND_PCM_FORMAT_S16)) < 0)
+        return err;
+    if ((err = snd_pcm_hw_params_set_channels(pcm, hw, 2)) < 0)
+        return err;
+    if ((err = snd_pcm_hw_params_set_rate_near(pcm, hw, &got_rate, NULL)) < 0)
+        return err;
+    if (got_rate != (unsigned int)fmt->rate) {
+        fprintf(stderr, "alsa: device can't play %d Hz (nearest %u)\n", fmt->rate, got_rate);
+        fmt->rate = got_rate;
+        return -EINVAL;
+    }
+
+    a->period_size = alsa_period > 0 ? alsa_period : DEFAULT_PERIOD;
+    a->buffer_size = alsa_buffer > 0 ? (snd_pcm_uframes_t)alsa_buffer : a->period_size * DEFAULT_PERIODS;
+    if ((err = snd_pcm_hw_params_set_period_size_near(pcm, hw, &a->period_size, NULL)) < 0)
+        return err;
+    if ((err = snd_pcm_hw_params_set_buffer_size_near(pcm, hw, &a->buffer_size)) < 0)
+        return err;
+
+    return snd_pcm_hw_params(pcm, hw);
+}
+
+static int set_sw_params(alsa_out_t *a) {
+    snd_pcm_sw_params_t *sw;
+    int err;
+
+    snd_pcm_sw_params_alloca(&sw);
+    if ((err = snd_pcm_sw_params_current(a->pcm, sw)) < 0)
+        return err;
+    // start once the buffer is full, and wake us a period at a time
+    if ((err = snd_pcm_sw_params_set_start_threshold(a->pcm, sw, a->buffer_size - a->period_size)) < 0)
+        return err;
+    if ((err = snd_pcm_sw_params_set_avail_min(a->pcm, sw, a->period_size)) < 0)
+        return err;
+    return snd_pcm_sw_params(a->pcm, sw);
+}
+
+static void *alsa_open(audio_format_t *fmt) {
+    alsa_out_t *a;
+    int err;
+
+    if (fmt->channels != 2 || fmt->bits != 16) {
+        fmt->channels = 2;
+        fmt->bits = 16;
+        return NULL;
+    }
+
+    a = calloc(1, sizeof(alsa_out_t));
+    if (!a)
+        return NULL;
+    if ((err = snd_pcm_open(&a->pcm, alsa_device, SND_PCM_STREAM_PLAYBACK, 0)) < 0) {
+        fprintf(stderr, "alsa: can't open %s: %s\n", alsa_device, snd_strerror(err));
+        free(a);
+        return NULL;
+    }
+    a->mmap = alsa_mmap;
+    if ((err = set_hw_params(a, fmt)) < 0 ||
+        (err = set_sw_params(a)) < 0) {
+        fprintf(stderr, "alsa: can't configure %s: %s\n", alsa_device, snd_strerror(err));
+        snd_pcm_close(a->pcm);
+        free(a);
+        return NULL;
+    }
+    fprintf(stderr, "alsa: %s, period %lu, buffer %lu frames, %s\n", alsa_device,
+            (unsigned long)a->period_size, (unsigned long)a->buffer_size,
+            a->mmap ? "mmap" : "writei");
+    return a;
+}
+
+// put the stream back on its feet after an error, without reopening
+static int recover(alsa_out_t *a, int err) {
+    if (err == -EPIPE)
+        a->xruns++;
+    err = snd_pcm_recover(a->pcm, err, 1);
+    if (err < 0)
+        fprintf(stderr, "alsa: can't recover: %s\n", snd_strerror(err));
+    return err;
+}
+
+static int mmap_write(alsa_out_t *a, const short *buf, int frames) {
+    snd_pcm_t *pcm = a->pcm;
+    const snd_pcm_channel_area_t *areas;
+    snd_pcm_uframes_t offset, n;
+    snd_pcm_sframes_t avail, done;
+    int err;
+
+    while (frames > 0) {
+        avail = snd_pcm_avail_update(pcm);
+        if (avail < 0) {
+            if (recover(a, avail) < 0)
+                return avail;
+            continue;
+        }
+        if (avail == 0) {
+            // a full buffer that hasn't started yet never drains by itself
+            if (snd_pcm_state(pcm) == SND_PCM_STATE_PREPARED) {
+                if ((err = snd_pcm_start(pcm)) < 0 && recover(a, err) < 0)
+                    return err;
+                continue;
+            }
+            err = snd_pcm_wait(pcm, 1000);
+            if (err < 0 && recover(a, err) < 0)
+                return err;
+            continue;
+        }
+
+        n = frames < avail ? frames : avail;
+        if ((err = snd_pcm_mmap_begin(pcm, &areas, &offset, &n)) < 0) {
+            if (recover(a, err) < 0)
+                return err;
+            continue;
+        }
+        // interleaved: one area describes both channels
+        memcpy((char *)areas[0].addr + areas[0].first/8 + offset * areas[0].step/8,
+               buf, n * FRAME_SIZE);
+        done = snd_pcm_mmap_commit(pcm, offset, n);
+        if (done < 0 || (snd_pcm_uframes_t)done != n) {
+            if (recover(a, done >= 0 ? -EPIPE : done) < 0)
+                return done;
+            continue;
+        }
+        buf += 2*n;
+        frames -= n;
+    }
+    return 0;
+}
+
+static int rw_write(alsa_out_t *a, const short *buf, int frames) {
+    snd_pcm_sframes_t done;
+
+    while (frames > 0) {
+        done = snd_pcm_writei(a->pcm, buf, frames);
+        if (done == -EAGAIN)
+            continue;
+        if (done < 0) {
+            if (recover(a, done) < 0)
+                return done;
+            continue;
+        }
+        buf += 2*done;
+        frames -= done;
+    }
+    return 0;
+}
+
+static int alsa_play(void *h, const short *buf, int frames) {
+    alsa_out_t *a = h;
+    return a->mmap ? mmap_write(a, buf, frames) : rw_write(a, buf, frames);
+}
+
+static int alsa_delay(void *h) {
+    alsa_out_t *a = h;
+    snd_pcm_sframes_t delay;
+
+    if (snd_pcm_delay(a->pcm, &delay) < 0)
+        return -1;
+    return delay;
+}
+
+static void alsa_pause(void *h, int paused) {
+    alsa_out_t *a = h;
+
+    // a hardware pause would hold the tail of the old audio for after,
+    // and dropping it cuts it off; draining plays it out and stops
+    // before the device runs dry, so there's no xrun either
+    if (paused)
+        snd_pcm_drain(a->pcm);
+    else
+        snd_pcm_prepare(a->pcm);
+}
+
+static void alsa_close(void *h) {
+    alsa_out_t *a = h;
+
+    snd_pcm_drain(a->pcm);
+    snd_pcm_close(a->pcm);
+    free(a);
+}
+
+static void alsa_stats(void *h, char *buf, int size) {
+    alsa_out_t *a = h;
+    snprintf(buf, size, "xrun %lu", a->xruns);
+}
+
+const audio_backend_t audio_alsa = {
+    .name = "alsa",
+    .option = alsa_option,
+    .open = alsa_open,
+    .play = alsa_play,
+    .delay = alsa_delay,
+    .pause = alsa_pause,
+    .close = alsa_close,
+    .stats = alsa_stats,
+};
+
+#endif
@@ -0,0 +1,109 @@
+/*
+ * libao output for HairTunes
+ * Copyright (c) ShairPort contributors 2012
+ * All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ao/ao.h>
+
+#include "audio.h"
+
+static char *libao_driver = NULL;
+static char *libao_devicename = NULL;
+static char *libao_deviceid = NULL; // ao_options expects "char*"
+
+static int ao_backend_option(const char *name, const char *value) {
+    if (!strcasecmp(name, "ao_driver"))
+        libao_driver = strdup(value);
+    else if (!strcasecmp(name, "ao_devicename"))
+        libao_devicename = strdup(value);
+    else if (!strcasecmp(name, "ao_deviceid"))
+        libao_deviceid = strdup(value);
+    else
+        return 0;
+    return 1;
+}
+
+static void *ao_backend_open(audio_format_t *format) {
+    static int initialized = 0;
+    if (!initialized) {
+        ao_initialize();
+        initialized = 1;
+    }
+
+    int driver;
+    if (libao_driver) {
+        // if a libao driver is specified on the command line, use that
+        driver = ao_driver_id(libao_driver);
+        if (driver == -1) {
+            fprintf(stderr, "ao: could not find driver %s\n", libao_driver);
+            return NULL;
+        }
+    } else {
+        // otherwise choose the default
+        driver = ao_default_driver_id();
+    }
+
+    ao_sample_format fmt;
+    memset(&fmt, 0, sizeof(fmt));
+
+    fmt.bits = format->bits;
+    fmt.rate = format->rate;
+    fmt.channels = format->channels;
+    fmt.byte_format = AO_FMT_NATIVE;
+
+    ao_option *ao_opts = NULL;
+    if(libao_deviceid) {
+        ao_append_option(&ao_opts, "id", libao_deviceid);
+    } else if(libao_devicename){
+        ao_append_option(&ao_opts, "dev", libao_devicename);
+        // Old libao versions (for example, 0.8.8) only support
+        // "dsp" instead of "dev".
+        ao_append_option(&ao_opts, "dsp", libao_devicename);
+    }
+
+    ao_device *dev = ao_open_live(driver, &fmt, ao_opts);
+    ao_free_options(ao_opts);
+    return dev;
+}
+
+static int ao_backend_play(void *h, const short *buf, int frames) {
+    // libao counts in bytes, and says 0 when the device is gone
+    return ao_play(h, (char *)buf, frames*4) ? 0 : -1;
+}
+
+static void ao_backend_close(void *h) {
+    ao_close(h);
+}
+
+const audio_backend_t audio_ao = {
+    .name = "ao",
+    .option = ao_backend_option,
+    .open = ao_backend_open,
+    .play = ao_backend_play,
+    .close = ao_backend_close,
+};
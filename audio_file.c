@@ -0,0 +1,400 @@
+/*
+ * WAV and CAF file output for HairTunes
+ * Copyright (c) ShairPort contributors 2012
+ * All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#define _FILE_OFFSET_BITS 64
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "audio.h"
+
+// Records to a WAV or CAF file.
+//
+// Audio is gathered into large page-aligned batches which a writer thread
+// of its own puts to disk, so a slow disk costs buffered batches rather
+// than holding up playback; if it falls behind by all of them, audio is
+// dropped and counted. The header is padded out to a page, so every batch
+// lands page-aligned, and rewritten with the real sizes after every batch:
+// a recording cut off by a crash is readable up to the last one. Space is
+// allocated well ahead of the writes and the file cut to length on close.
+
+#define FRAME_SIZE      4       // bytes, S16 stereo
+#define HEADER_SIZE     4096    // data starts here
+#define NBATCH          8
+#define PREALLOC        (64LL << 20)
+
+enum { FORMAT_WAV, FORMAT_CAF };
+
+typedef struct file_out {
+    int fd;
+    int format;
+    int rate;
+    audio_pacer_t pacer;
+
+    char *batch[NBATCH];
+    int batch_len[NBATCH];      // bytes
+    int batch_size;
+    int tail, count;            // batches queued for the writer
+    int stop, failed;
+    unsigned long dropped;      // frames lost to a disk that fell behind
+
+    long long data_bytes;       // on disk
+    long long alloc_end;
+
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+
+    char *name;
+    struct file_out *next;
+} file_out_t;
+
+static char *file_name = NULL;
+static char *file_format = NULL;    // wav or caf; from the name if not given
+static int file_batch = 256;        // KiB
+
+static int file_option(const char *name, const char *value) {
+    if (!strcasecmp(name, "file"))
+        file_name = strdup(value);
+    else if (!strcasecmp(name, "file_format"))
+        file_format = strdup(value);
+    else if (!strcasecmp(name, "file_batch"))
+        file_batch = atoi(value);
+    else
+        return 0;
+    return 1;
+}
+
+static void put_le(unsigned char *p, uint64_t v, int n) {
+    while (n--) {
+        *p++ = v;
+        v >>= 8;
+    }
+}
+
+static void put_be(unsigned char *p, uint64_t v, int n) {
+    while (n--)
+        p[n] = v, v >>= 8;
+}
+
+static int native_le(void) {
+    uint16_t one = 1;
+    return *(unsigned char *)&one;
+}
+
+// the whole padded header, with the sizes as they are now
+static void make_header(file_out_t *f, unsigned char *h) {
+    long long bytes = f->data_bytes;
+
+    memset(h, 0, HEADER_SIZE);
+    if (f->format == FORMAT_WAV) {
+        // sizes over 4G don't fit; the data runs to the end of the file
+        if (bytes > 0xffffffffLL - HEADER_SIZE)
+            bytes = 0xffffffffLL - HEADER_SIZE;
+        memcpy(h, "RIFF", 4);
+        put_le(h + 4, HEADER_SIZE - 8 + bytes, 4);
+        memcpy(h + 8, "WAVEfmt ", 8);
+        put_le(h + 16, 16, 4);
+        put_le(h + 20, 1, 2);                       // PCM
+        put_le(h + 22, 2, 2);
+        put_le(h + 24, f->rate, 4);
+        put_le(h + 28, f->rate * FRAME_SIZE, 4);
+        put_le(h + 32, FRAME_SIZE, 2);
+        put_le(h + 34, 16, 2);
+        memcpy(h + 36, "JUNK", 4);
+        put_le(h + 40, HEADER_SIZE - 52, 4);
+        memcpy(h + HEADER_SIZE - 8, "data", 4);
+        put_le(h + HEADER_SIZE - 4, bytes, 4);
+    } else {
+        union { double d; uint64_t u; } rate;
+        rate.d = f->rate;
+        memcpy(h, "caff", 4);
+        put_be(h + 4, 1, 2);
+        memcpy(h + 8, "desc", 4);
+        put_be(h + 12, 32, 8);
+        put_be(h + 20, rate.u, 8);
+        memcpy(h + 28, "lpcm", 4);
+        put_be(h + 32, native_le() ? 2 : 0, 4);     // kCAFLinearPCMFormatFlagIsLittleEndian
+        put_be(h + 36, FRAME_SIZE, 4);
+        put_be(h + 40, 1, 4);
+        put_be(h + 44, 2, 4);
+        put_be(h + 48, 16, 4);
+        memcpy(h + 52, "free", 4);
+        put_be(h + 56, HEADER_SIZE - 64 - 16, 8);
+        memcpy(h + HEADER_SIZE - 16, "data", 4);
+        put_be(h + HEADER_SIZE - 12, 4 + bytes, 8);   // edit count, then samples
+    }
+}
+
+static int write_at(int fd, const void *buf, size_t len, off_t at) {
+    ssize_t n;
+    while (len > 0) {
+        n = pwrite(fd, buf, len, at);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        buf = (const char *)buf + n;
+        len -= n;
+        at += n;
+    }
+    return 0;
+}
+
+static int write_batch(file_out_t *f, const char *buf, int len, unsigned char *header) {
+    off_t at = HEADER_SIZE + f->data_bytes;
+
+    if (at + len > f->alloc_end) {
+        // not every filesystem can; then the writes just grow the file
+        if (!posix_fallocate(f->fd, f->alloc_end, PREALLOC))
+            f->alloc_end += PREALLOC;
+        else
+            f->alloc_end = at + len;
+    }
+    if (write_at(f->fd, buf, len, at) < 0)
+        return -1;
+    f->data_bytes += len;
+
+    make_header(f, header);
+    return write_at(f->fd, header, HEADER_SIZE, 0);
+}
+
+static void *file_writer(void *arg) {
+    file_out_t *f = arg;
+    unsigned char *header = malloc(HEADER_SIZE);
+    int i, n;
+
+    pthread_mutex_lock(&f->mutex);
+    while (f->count || !f->stop) {
+        if (!f->count) {
+            pthread_cond_wait(&f->cond, &f->mutex);
+            continue;
+        }
+        i = f->tail;
+        pthread_mutex_unlock(&f->mutex);
+
+        n = f->failed ? 0 : write_batch(f, f->batch[i], f->batch_len[i], header);
+
+        pthread_mutex_lock(&f->mutex);
+        if (n < 0) {
+            perror("file: can't write recording");
+            f->failed = 1;
+        }
+        f->batch_len[i] = 0;
+        f->tail = (f->tail + 1) % NBATCH;
+        f->count--;
+    }
+    pthread_mutex_unlock(&f->mutex);
+
+    free(header);
+    return NULL;
+}
+
+static void finish(file_out_t *f) {
+    int i;
+
+    pthread_mutex_lock(&f->mutex);
+    if (f->stop) {
+        pthread_mutex_unlock(&f->mutex);
+        return;
+    }
+    // the batch being filled goes too
+    i = (f->tail + f->count) % NBATCH;
+    if (f->count < NBATCH && f->batch_len[i])
+        f->count++;
+    f->stop = 1;
+    pthread_cond_signal(&f->cond);
+    pthread_mutex_unlock(&f->mutex);
+    pthread_join(f->thread, NULL);
+
+    if (ftruncate(f->fd, HEADER_SIZE + f->data_bytes) < 0)
+        perror("file: can't trim recording");
+    fsync(f->fd);
+    close(f->fd);
+}
+
+// every recording open in this process. two sessions writing the same
+// file would truncate and interleave each other, so the second is refused.
+// hairtunes usually ends with exit() rather than closing its output, so
+// they are finished from here too.
+static file_out_t *open_files;
+static pthread_mutex_t open_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void file_exit(void) {
+    file_out_t *f;
+
+    pthread_mutex_lock(&open_mutex);
+    for (f = open_files; f; f = f->next)
+        finish(f);
+    pthread_mutex_unlock(&open_mutex);
+}
+
+static void *file_open(audio_format_t *fmt) {
+    static int registered = 0;
+    file_out_t *f;
+    int i, format;
+
+    if (!file_name) {
+        fprintf(stderr, "file: no file name given\n");
+        return NULL;
+    }
+    if (file_format)
+        format = strcasecmp(file_format, "caf") ? FORMAT_WAV : FORMAT_CAF;
+    else
+        format = strlen(file_name) > 4 &&
+            !strcasecmp(file_name + strlen(file_name) - 4, ".caf") ? FORMAT_CAF : FORMAT_WAV;
+    if (fmt->channels != 2 || fmt->bits != 16) {
+        fmt->channels = 2;
+        fmt->bits = 16;
+        return NULL;
+    }
+
+    pthread_mutex_lock(&open_mutex);
+    for (f = open_files; f; f = f->next) {
+        if (!strcmp(f->name, file_name)) {
+            fprintf(stderr, "file: %s is in use by another session\n", file_name);
+            pthread_mutex_unlock(&open_mutex);
+            return NULL;
+        }
+    }
+
+    f = calloc(1, sizeof(file_out_t));
+    f->fd = open(file_name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (f->fd < 0) {
+        perror("file: can't create recording");
+        pthread_mutex_unlock(&open_mutex);
+        free(f);
+        return NULL;
+    }
+    f->format = format;
+    f->rate = fmt->rate;
+    f->pacer.off = fmt->follow;
+
+    // whole pages, and whole frames
+    f->batch_size = (file_batch > 0 ? file_batch : 256) * 1024;
+    f->batch_size = (f->batch_size + HEADER_SIZE - 1) / HEADER_SIZE * HEADER_SIZE;
+    for (i=0; i<NBATCH; i++)
+        if (posix_memalign((void **)&f->batch[i], HEADER_SIZE, f->batch_size))
+            abort();
+
+    unsigned char *header = malloc(HEADER_SIZE);
+    make_header(f, header);
+    if (write_at(f->fd, header, HEADER_SIZE, 0) < 0)
+        perror("file: can't write header");
+    free(header);
+    f->alloc_end = HEADER_SIZE;
+
+    pthread_mutex_init(&f->mutex, NULL);
+    pthread_cond_init(&f->cond, NULL);
+    audio_thread_create(&f->thread, file_writer, f);
+
+    if (!registered) {
+        atexit(file_exit);
+        registered = 1;
+    }
+    f->name = strdup(file_name);
+    f->next = open_files;
+    open_files = f;
+    pthread_mutex_unlock(&open_mutex);
+    return f;
+}
+
+static int file_play(void *h, const short *buf, int frames) {
+    file_out_t *f = h;
+    const char *src = (const char *)buf;
+    int len = frames * FRAME_SIZE;
+    int i, n;
+
+    audio_pace(&f->pacer, f->rate, frames);
+
+    pthread_mutex_lock(&f->mutex);
+    while (len > 0 && !f->stop) {
+        if (f->count == NBATCH) {
+            // the disk is a whole queue behind
+            f->dropped += len / FRAME_SIZE;
+            break;
+        }
+        i = (f->tail + f->count) % NBATCH;
+        n = f->batch_size - f->batch_len[i];
+        if (n > len)
+            n = len;
+        memcpy(f->batch[i] + f->batch_len[i], src, n);
+        f->batch_len[i] += n;
+        src += n;
+        len -= n;
+        if (f->batch_len[i] == f->batch_size) {
+            f->count++;
+            pthread_cond_signal(&f->cond);
+        }
+    }
+    pthread_mutex_unlock(&f->mutex);
+    return 0;
+}
+
+static void file_close(void *h) {
+    file_out_t *f = h, **p;
+    int i;
+
+    pthread_mutex_lock(&open_mutex);
+    for (p = &open_files; *p != f; p = &(*p)->next)
+        ;
+    *p = f->next;
+    pthread_mutex_unlock(&open_mutex);
+
+    finish(f);
+    pthread_mutex_destroy(&f->mutex);
+    pthread_cond_destroy(&f->cond);
+    for (i=0; i<NBATCH; i++)
+        free(f->batch[i]);
+    free(f->name);
+    free(f);
+}
+
+static void file_stats(void *h, char *buf, int size) {
+    file_out_t *f = h;
+
+    pthread_mutex_lock(&f->mutex);
+    snprintf(buf, size, "filedrop %lu%s", f->dropped, f->failed ? " filefailed" : "");
+    pthread_mutex_unlock(&f->mutex);
+}
+
+const audio_backend_t audio_file = {
+    .name = "file",
+    .option = file_option,
+    .open = file_open,
+    .play = file_play,
+    .close = file_close,
+    .stats = file_stats,
+};
@@ -0,0 +1,263 @@
+/*
+ * FIFO output for HairTunes
+ * Copyright (c) ShairPort contributors 2012
+ * All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <poll.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "audio.h"
+
+// Raw PCM into a named pipe for another program to read.
+//
+// The player only ever copies into a bounded ring; a writer thread of our
+// own drains it into the FIFO, so a reader that is missing, slow or stuck
+// can't hold up playback. While nobody reads, audio is thrown away. When
+// the reader falls more than the ring behind, the oldest audio is dropped
+// to make room, which keeps its lag bounded rather than letting it grow.
+
+#define FRAME_SIZE      4       // bytes, S16 stereo
+#define CHUNK_FRAMES    1024    // moved out of the ring at a time
+#define RETRY_MS        100     // between looks for a reader
+
+typedef struct {
+    char *ring;
+    int size;                   // frames
+    int rd, fill;               // frames
+
+    int fd;
+    int rate;
+    audio_pacer_t pacer;        // the FIFO doesn't hold us back, so this does
+    int stop;
+    unsigned long dropped;      // frames thrown away for a lagging reader
+
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+} pipe_out_t;
+
+static char *pipe_name = NULL;
+static int pipe_buffer = 1000;  // ms
+
+static int pipe_option(const char *name, const char *value) {
+    if (!strcasecmp(name, "pipe"))
+        pipe_name = strdup(value);
+    else if (!strcasecmp(name, "pipe_buffer"))
+        pipe_buffer = atoi(value);
+    else
+        return 0;
+    return 1;
+}
+
+// wait up to 'ms' for room in the FIFO; 0 if the reader has gone
+static int wait_writable(int fd, int ms) {
+    struct pollfd pfd;
+    pfd.fd = fd;
+    pfd.events = POLLOUT;
+    if (poll(&pfd, 1, ms) < 0)
+        return errno == EINTR;
+    return !(pfd.revents & (POLLERR | POLLHUP));
+}
+
+static int write_all(pipe_out_t *p, const char *buf, int len) {
+    int n;
+    while (len > 0 && !p->stop) {
+        n = write(p->fd, buf, len);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN)
+                return -1;
+            if (!wait_writable(p->fd, RETRY_MS))
+                return -1;
+            continue;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static void *pipe_writer(void *arg) {
+    pipe_out_t *p = arg;
+    char *chunk = malloc(CHUNK_FRAMES * FRAME_SIZE);
+    int n;
+
+    pthread_mutex_lock(&p->mutex);
+    while (!p->stop) {
+        if (p->fd == -1) {
+            // without a reader, opening for write fails rather than blocks
+            p->fd = open(pipe_name, O_WRONLY | O_NONBLOCK);
+            if (p->fd == -1) {
+                p->rd = p->fill = 0;
+                struct timespec ts;
+                clock_gettime(CLOCK_REALTIME, &ts);
+                ts.tv_nsec += RETRY_MS * 1000000L;
+                if (ts.tv_nsec >= 1000000000L) {
+                    ts.tv_sec++;
+                    ts.tv_nsec -= 1000000000L;
+                }
+                pthread_cond_timedwait(&p->cond, &p->mutex, &ts);
+                continue;
+            }
+        }
+        if (!p->fill) {
+            pthread_cond_wait(&p->cond, &p->mutex);
+            continue;
+        }
+
+        n = p->size - p->rd;
+        if (n > p->fill)
+            n = p->fill;
+        if (n > CHUNK_FRAMES)
+            n = CHUNK_FRAMES;
+        memcpy(chunk, p->ring + p->rd * FRAME_SIZE, n * FRAME_SIZE);
+        p->rd = (p->rd + n) % p->size;
+        p->fill -= n;
+        pthread_mutex_unlock(&p->mutex);
+
+        n = write_all(p, chunk, n * FRAME_SIZE);
+
+        pthread_mutex_lock(&p->mutex);
+        if (n < 0) {
+            // the reader went away; look for the next one
+            close(p->fd);
+            p->fd = -1;
+        }
+    }
+    pthread_mutex_unlock(&p->mutex);
+
+    free(chunk);
+    return NULL;
+}
+
+static void *pipe_open(audio_format_t *fmt) {
+    pipe_out_t *p;
+
+    if (!pipe_name) {
+        fprintf(stderr, "pipe: no FIFO name given\n");
+        return NULL;
+    }
+    // make the FIFO, and take a vanished reader as a write error
+    mknod(pipe_name, S_IFIFO | 0644, 0);
+    signal(SIGPIPE, SIG_IGN);
+
+    p = calloc(1, sizeof(pipe_out_t));
+    p->rate = fmt->rate;
+    p->pacer.off = fmt->follow;
+    p->size = (long long)fmt->rate * (pipe_buffer > 0 ? pipe_buffer : 1000) / 1000;
+    if (p->size < CHUNK_FRAMES)
+        p->size = CHUNK_FRAMES;
+    p->ring = malloc(p->size * FRAME_SIZE);
+    p->fd = -1;
+    pthread_mutex_init(&p->mutex, NULL);
+    pthread_cond_init(&p->cond, NULL);
+    pthread_create(&p->thread, NULL, pipe_writer, p);
+    return p;
+}
+
+static int pipe_play(void *h, const short *buf, int frames) {
+    pipe_out_t *p = h;
+    const char *src = (const char *)buf;
+    int wr, n;
+
+    audio_pace(&p->pacer, p->rate, frames);
+
+    pthread_mutex_lock(&p->mutex);
+    if (p->fd == -1) {
+        // nobody listening
+        pthread_mutex_unlock(&p->mutex);
+        return 0;
+    }
+    if (frames > p->size) {
+        p->dropped += frames - p->size;
+        src += (frames - p->size) * FRAME_SIZE;
+        frames = p->size;
+    }
+    if (p->fill + frames > p->size) {
+        n = p->fill + frames - p->size;
+        p->rd = (p->rd + n) % p->size;
+        p->fill -= n;
+        p->dropped += n;
+    }
+    while (frames > 0) {
+        wr = (p->rd + p->fill) % p->size;
+        n = p->size - wr;
+        if (n > frames)
+            n = frames;
+        memcpy(p->ring + wr * FRAME_SIZE, src, n * FRAME_SIZE);
+        p->fill += n;
+        src += n * FRAME_SIZE;
+        frames -= n;
+    }
+    pthread_cond_signal(&p->cond);
+    pthread_mutex_unlock(&p->mutex);
+    return 0;
+}
+
+static void pipe_close(void *h) {
+    pipe_out_t *p = h;
+
+    pthread_mutex_lock(&p->mutex);
+    p->stop = 1;
+    pthread_cond_signal(&p->cond);
+    pthread_mutex_unlock(&p->mutex);
+    pthread_join(p->thread, NULL);
+
+    if (p->fd != -1)
+        close(p->fd);
+    pthread_mutex_destroy(&p->mutex);
+    pthread_cond_destroy(&p->cond);
+    free(p->ring);
+    free(p);
+}
+
+// how far behind the reader is, and what it has lost for it
+static void pipe_stats(void *h, char *buf, int size) {
+    pipe_out_t *p = h;
+
+    pthread_mutex_lock(&p->mutex);
+    snprintf(buf, size, "pipelag %dms pipedrop %lu",
+             (int)((long long)p->fill * 1000 / p->rate), p->dropped);
+    pthread_mutex_unlock(&p->mutex);
+}
+
+const audio_backend_t audio_pipe = {
+    .name = "pipe",
+    .option = pipe_option,
+    .open = pipe_open,
+    .play = pipe_play,
+    .close = pipe_close,
+    .stats = pipe_stats,
+};
@@ -0,0 +1,254 @@
+/*
+ * Shared-memory output for HairTunes
+ * Copyright (c) ShairPort contributors 2012
+ * All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifdef __linux__
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#include "audio.h"
+#include "audio_shm.h"
+
+// PCM into a ring in shared memory, which any number of local readers can
+// map and read in place. See audio_shm.h for the layout.
+
+#define FRAME_SIZE      4       // bytes, S16 stereo
+
+typedef struct shm_out {
+    struct shm_ring_header *hdr;
+    short *ring;
+    size_t map_size;
+    audio_pacer_t pacer;        // readers don't hold us back, so this does
+    char *name;
+    struct shm_out *next;
+} shm_out_t;
+
+static char *shm_name = "/hairtunes";
+static int shm_ms = 2000;       // ring length
+
+static int shm_option(const char *name, const char *value) {
+    if (!strcasecmp(name, "shm_name"))
+        shm_name = strdup(value);
+    else if (!strcasecmp(name, "shm_ms"))
+        shm_ms = atoi(value);
+    else
+        return 0;
+    return 1;
+}
+
+// the bump and the look at 'waiters' are both seq_cst, like the reader's
+// bump of 'waiters' before it waits: otherwise each side can miss the
+// other's store and the reader sleeps through the write
+static void wake_readers(struct shm_ring_header *hdr) {
+    __atomic_add_fetch(&hdr->futex, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&hdr->waiters, __ATOMIC_SEQ_CST))
+        syscall(SYS_futex, &hdr->futex, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+// every ring open in this process. a second session can't share one
+// with the first, so it is refused rather than clobbering the ring.
+// hairtunes usually ends with exit() rather than closing its output, so
+// this is also how readers get told the session is over.
+static shm_out_t *open_rings;
+static pthread_mutex_t open_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void shm_exit(void) {
+    shm_out_t *s;
+
+    pthread_mutex_lock(&open_mutex);
+    for (s = open_rings; s; s = s->next) {
+        __atomic_store_n(&s->hdr->state, SHM_RING_CLOSED, __ATOMIC_RELEASE);
+        wake_readers(s->hdr);
+    }
+    pthread_mutex_unlock(&open_mutex);
+}
+
+static void *shm_open_ring(audio_format_t *fmt) {
+    static int registered = 0;
+    struct shm_ring_header *hdr;
+    shm_out_t *s;
+    uint32_t generation = 0;
+    int frames, fd;
+    size_t size;
+    struct stat st;
+
+    if (fmt->channels != 2 || fmt->bits != 16) {
+        fmt->channels = 2;
+        fmt->bits = 16;
+        return NULL;
+    }
+    frames = (long long)fmt->rate * (shm_ms > 0 ? shm_ms : 2000) / 1000;
+    size = sizeof(struct shm_ring_header) + (size_t)frames * FRAME_SIZE;
+
+    pthread_mutex_lock(&open_mutex);
+    for (s = open_rings; s; s = s->next) {
+        if (!strcmp(s->name, shm_name)) {
+            fprintf(stderr, "shm: %s is in use by another session\n", shm_name);
+            goto fail;
+        }
+    }
+
+    fd = shm_open(shm_name, O_RDWR | O_CREAT, 0644);
+    if (fd < 0) {
+        perror("shm: can't create ring");
+        goto fail;
+    }
+    // grown but never shrunk: readers mapped from an earlier, larger
+    // session would fault on the pages cut off
+    if (fstat(fd, &st) < 0) {
+        perror("shm: can't size ring");
+        close(fd);
+        goto fail;
+    }
+    if ((size_t)st.st_size > size)
+        size = st.st_size;
+    else if (ftruncate(fd, size) < 0) {
+        perror("shm: can't size ring");
+        close(fd);
+        goto fail;
+    }
+    hdr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (hdr == MAP_FAILED) {
+        perror("shm: can't map ring");
+        goto fail;
+    }
+
+    s = calloc(1, sizeof(shm_out_t));
+    if (!s) {
+        munmap(hdr, size);
+        goto fail;
+    }
+
+    // readers may still be mapped from the last session; tell them it's new
+    if (hdr->magic == SHM_RING_MAGIC)
+        generation = hdr->generation;
+    hdr->magic = SHM_RING_MAGIC;
+    hdr->version = SHM_RING_VERSION;
+    hdr->header_size = sizeof(struct shm_ring_header);
+    hdr->rate = fmt->rate;
+    hdr->channels = fmt->channels;
+    hdr->bits = fmt->bits;
+    hdr->frames = frames;
+    hdr->blocks = 0;
+    memset(hdr->times, 0, sizeof(hdr->times));
+    __atomic_store_n(&hdr->write_pos, 0, __ATOMIC_RELEASE);
+    __atomic_store_n(&hdr->generation, generation + 1, __ATOMIC_RELEASE);
+    __atomic_store_n(&hdr->state, SHM_RING_OPEN, __ATOMIC_RELEASE);
+    wake_readers(hdr);
+
+    if (!registered) {
+        atexit(shm_exit);
+        registered = 1;
+    }
+
+    s->hdr = hdr;
+    s->ring = (short *)((char *)hdr + sizeof(struct shm_ring_header));
+    s->map_size = size;
+    s->pacer.off = fmt->follow;
+    s->name = strdup(shm_name);
+    s->next = open_rings;
+    open_rings = s;
+    pthread_mutex_unlock(&open_mutex);
+    return s;
+
+fail:
+    pthread_mutex_unlock(&open_mutex);
+    return NULL;
+}
+
+static int shm_play(void *h, const short *buf, int frames) {
+    shm_out_t *s = h;
+    struct shm_ring_header *hdr = s->hdr;
+    struct shm_ring_time *t;
+    struct timespec now;
+    uint64_t pos = hdr->write_pos;
+    int at, n;
+
+    audio_pace(&s->pacer, hdr->rate, frames);
+
+    // when the block was written. the odd seq has to be seen before the
+    // new pos and ns are: the fence keeps the stores after it behind it
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    t = &hdr->times[hdr->blocks % SHM_RING_TIMES];
+    __atomic_add_fetch(&t->seq, 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&t->pos, pos, __ATOMIC_RELAXED);
+    __atomic_store_n(&t->ns, now.tv_sec * 1000000000ULL + now.tv_nsec, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&t->seq, 1, __ATOMIC_RELEASE);
+    __atomic_store_n(&hdr->blocks, hdr->blocks + 1, __ATOMIC_RELEASE);
+
+    while (frames > 0) {
+        at = pos % hdr->frames;
+        n = hdr->frames - at;
+        if (n > frames)
+            n = frames;
+        memcpy(s->ring + 2*at, buf, n * FRAME_SIZE);
+        buf += 2*n;
+        frames -= n;
+        pos += n;
+    }
+    __atomic_store_n(&hdr->write_pos, pos, __ATOMIC_RELEASE);
+    wake_readers(hdr);
+    return 0;
+}
+
+static void shm_close(void *h) {
+    shm_out_t *s = h, **p;
+
+    pthread_mutex_lock(&open_mutex);
+    for (p = &open_rings; *p != s; p = &(*p)->next)
+        ;
+    *p = s->next;
+    pthread_mutex_unlock(&open_mutex);
+
+    // left in place for readers to keep mapped until the next session
+    __atomic_store_n(&s->hdr->state, SHM_RING_CLOSED, __ATOMIC_RELEASE);
+    wake_readers(s->hdr);
+    munmap(s->hdr, s->map_size);
+    free(s->name);
+    free(s);
+}
+
+const audio_backend_t audio_shm = {
+    .name = "shm",
+    .option = shm_option,
+    .open = shm_open_ring,
+    .play = shm_play,
+    .close = shm_close,
+};
+
+#endif
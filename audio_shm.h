@@ -0,0 +1,80 @@
+#ifndef _AUDIO_SHM_H_
+#define _AUDIO_SHM_H_
+
+// Layout of the shared-memory output ("output shm"), for programs that
+// read it. Linux only.
+//
+// hairtunes creates the POSIX shared memory object named by "shm_name"
+// (default /hairtunes) and keeps it after it exits, so readers can map it
+// once and stay mapped across sessions. One session writes it at a time;
+// while it plays, another that asks for the same name gets no shm output.
+// The object is a struct shm_ring_header followed by 'frames' frames of
+// interleaved native-endian S16 stereo. It grows when a session needs a
+// bigger ring but never shrinks, so a mapping stays valid; when a new
+// generation's header_size + 4 * frames is more than you have mapped,
+// map it again.
+//
+// write_pos counts frames since the session started; frame n lives at
+// ring index n % frames. To read from position 'pos':
+//
+//   1. w = atomic load-acquire of write_pos. pos == w means nothing new:
+//      bump 'waiters' with a seq_cst atomic add (the writer's check of it
+//      is seq_cst too, and a weaker bump can miss a wake), FUTEX_WAIT (not
+//      _PRIVATE) on 'futex' with the value seen before loading write_pos,
+//      drop 'waiters', and start over.
+//   2. if w - pos > frames the writer has lapped you; skip to w - frames.
+//   3. copy frames pos..w out of the ring.
+//   4. load write_pos again; whatever is now more than 'frames' behind it
+//      may have been overwritten while you copied, and must be discarded.
+//
+// When 'generation' changes, a new session has started: write_pos is back
+// at 0 and the format may be different. 'state' is SHM_RING_CLOSED between
+// sessions.
+//
+// times[] maps frame positions to the CLOCK_MONOTONIC time at which they
+// were written: entry i % SHM_RING_TIMES describes the i'th block written,
+// and holds the position of its first frame. Writes are paced to the
+// stream, but nothing is added for latency; a reader adds its own. Read an
+// entry as a seqlock: load-acquire 'seq', skip it if odd, copy pos and ns,
+// then an acquire fence (__atomic_thread_fence(__ATOMIC_ACQUIRE)) before
+// loading 'seq' again. The copy is good if both loads saw the same value.
+// Interpolate with the rate between entries.
+
+#include <stdint.h>
+
+#define SHM_RING_MAGIC      0x48545352  // "HTSR"
+#define SHM_RING_VERSION    1
+#define SHM_RING_TIMES      256
+
+#define SHM_RING_OPEN       1
+#define SHM_RING_CLOSED     2
+
+struct shm_ring_time {
+    uint32_t seq;
+    uint32_t pad;
+    uint64_t pos;               // frame position
+    uint64_t ns;                // CLOCK_MONOTONIC when it was written
+};
+
+struct shm_ring_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t header_size;       // the ring starts this far into the object
+    uint32_t generation;        // bumped for every session
+    uint32_t state;
+
+    uint32_t rate;
+    uint32_t channels;
+    uint32_t bits;
+    uint32_t frames;            // ring size
+
+    uint32_t futex;             // bumped and woken on every write
+    uint32_t waiters;           // readers in FUTEX_WAIT, so wakes can be skipped
+    uint32_t pad;
+
+    uint64_t write_pos;
+    uint64_t blocks;            // entries ever written to times[]
+    struct shm_ring_time times[SHM_RING_TIMES];
+};
+
+#endif
@@ -0,0 +1,279 @@
+/*
+ * Clock recovery for HairTunes
+ * Copyright (c) ShairPort contributors 2012
+ * All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <math.h>
+
+#include "clockrec.h"
+
+typedef struct {
+    double hist[2];
+    double a[2];
+    double b[3];
+} biquad_t;
+
+struct clockrec {
+    int type;
+    double fps;
+    double rate;
+
+    // legacy
+    double est_drift;       // local clock is slower by
+    biquad_t drift_lpf;
+    double est_err, last_err;
+    biquad_t err_lpf, err_deriv_lpf;
+    double desired_fill;
+    int fill_count;
+
+    // kalman: state is fill error e (frames) and drift d (frames gained
+    // per frame played, ie. the sender's clock offset), P its covariance
+    double e, d;
+    double P[2][2];
+    double target, settle_sum;
+    int settle;
+    double u;               // rate - 1 applied since the last update
+    double max_corr, slew;  // as fractions, and fraction per update
+};
+
+static const char *type_names[CLOCKREC_TYPES] = { "legacy", "kalman" };
+
+// The drift is modelled as a slow random walk and the fill measurement as
+// white noise; with the fill refined by packet arrival times the noise is
+// well under a frame. The first KALMAN_SETTLE frames after a reset set the
+// fill to hold.
+#define KALMAN_R        0.25        // fill measurement variance, frames^2
+#define KALMAN_QE       1e-8        // fill error process noise
+#define KALMAN_QD       1e-16       // drift random walk per frame (0.01ppm)^2
+#define KALMAN_P0       1e-8        // initial drift variance, (100ppm)^2
+#define KALMAN_SEEDED   2.5e-11     // when seeded, (5ppm)^2
+#define KALMAN_SETTLE   64
+#define KALMAN_TAU      5.0         // seconds to pull a fill error back in
+#define MAX_DRIFT       1e-3        // no real clock is further off than this
+#define LOCK_PPM        2.0
+#define LOCK_ERR        1.0
+
+#define DEFAULT_MAX_CORR    200.0   // ppm
+#define DEFAULT_SLEW        20.0    // ppm per second
+
+static void biquad_init(biquad_t *bq, double a[], double b[]) {
+    bq->hist[0] = bq->hist[1] = 0.0;
+    memcpy(bq->a, a, 2*sizeof(double));
+    memcpy(bq->b, b, 3*sizeof(double));
+}
+
+static void biquad_lpf(biquad_t *bq, double freq, double Q, double fps) {
+    double w0 = 2.0 * M_PI * freq / fps;
+    double alpha = sin(w0)/(2.0*Q);
+
+    double a_0 = 1.0 + alpha;
+    double b[3], a[2];
+    b[0] = (1.0-cos(w0))/(2.0*a_0);
+    b[1] = (1.0-cos(w0))/a_0;
+    b[2] = b[0];
+    a[0] = -2.0*cos(w0)/a_0;
+    a[1] = (1-alpha)/a_0;
+
+    biquad_init(bq, a, b);
+}
+
+static double biquad_filt(biquad_t *bq, double in) {
+    double w = in - bq->a[0]*bq->hist[0] - bq->a[1]*bq->hist[1];
+    double out = bq->b[1]*bq->hist[0] + bq->b[2]*bq->hist[1] + bq->b[0]*w;
+    bq->hist[1] = bq->hist[0];
+    bq->hist[0] = w;
+
+    return out;
+}
+
+static void legacy_reset(clockrec_t *cr) {
+    biquad_lpf(&cr->drift_lpf, 1.0/180.0, 0.3, cr->fps);
+    biquad_lpf(&cr->err_lpf, 1.0/10.0, 0.25, cr->fps);
+    biquad_lpf(&cr->err_deriv_lpf, 1.0/2.0, 0.2, cr->fps);
+    cr->fill_count = 0;
+    cr->rate = 1.0;
+    cr->est_err = cr->last_err = 0;
+    cr->desired_fill = cr->fill_count = 0;
+}
+
+static double legacy_update(clockrec_t *cr, double fill) {
+    if (cr->fill_count < 1000) {
+        cr->desired_fill += fill/1000.0;
+        cr->fill_count++;
+        return cr->rate;
+    }
+
+#define CONTROL_A   (1e-4)
+#define CONTROL_B   (1e-1)
+
+    double buf_delta = fill - cr->desired_fill;
+    cr->est_err = biquad_filt(&cr->err_lpf, buf_delta);
+    double err_deriv = biquad_filt(&cr->err_deriv_lpf, cr->est_err - cr->last_err);
+    double adj_error = CONTROL_A * cr->est_err;
+
+    cr->est_drift = biquad_filt(&cr->drift_lpf, CONTROL_B*(adj_error + err_deriv) + cr->est_drift);
+
+    cr->rate = 1.0 + adj_error + cr->est_drift;
+
+    cr->last_err = cr->est_err;
+    return cr->rate;
+}
+
+static void kalman_reset(clockrec_t *cr) {
+    cr->settle = 0;
+    cr->settle_sum = 0;
+    cr->e = 0;
+    cr->P[0][0] = KALMAN_R;
+    cr->P[0][1] = cr->P[1][0] = 0;
+    // the drift survives; resyncs don't change the clocks
+    cr->u = cr->d;
+    cr->rate = 1.0 + cr->u;
+}
+
+static double kalman_update(clockrec_t *cr, double fill) {
+    double (*P)[2] = cr->P;
+
+    if (cr->settle < KALMAN_SETTLE) {
+        cr->settle_sum += fill;
+        if (++cr->settle == KALMAN_SETTLE)
+            cr->target = cr->settle_sum / KALMAN_SETTLE;
+        return cr->rate;
+    }
+
+    // predict: the fill moves by the drift less what the rate took out
+    cr->e += cr->d - cr->u;
+    P[0][0] += 2*P[0][1] + P[1][1] + KALMAN_QE;
+    P[0][1] += P[1][1];
+    P[1][0] = P[0][1];
+    P[1][1] += KALMAN_QD;
+
+    // correct against the measured fill
+    double s = P[0][0] + KALMAN_R;
+    double k0 = P[0][0] / s, k1 = P[1][0] / s;
+    double innov = fill - cr->target - cr->e;
+    cr->e += k0 * innov;
+    cr->d += k1 * innov;
+    if (cr->d > MAX_DRIFT)
+        cr->d = MAX_DRIFT;
+    if (cr->d < -MAX_DRIFT)
+        cr->d = -MAX_DRIFT;
+    P[1][1] -= k1 * P[0][1];
+    P[0][0] -= k0 * P[0][0];
+    P[0][1] -= k0 * P[0][1];
+    P[1][0] = P[0][1];
+
+    // follow the drift, and pull the fill back to target at a bounded rate
+    double corr = cr->e / (KALMAN_TAU * cr->fps);
+    if (corr > cr->max_corr)
+        corr = cr->max_corr;
+    if (corr < -cr->max_corr)
+        corr = -cr->max_corr;
+    double step = cr->d + corr - cr->u;
+    if (step > cr->slew)
+        step = cr->slew;
+    if (step < -cr->slew)
+        step = -cr->slew;
+    cr->u += step;
+
+    cr->rate = 1.0 + cr->u;
+    return cr->rate;
+}
+
+clockrec_t *clockrec_new(int type, double frames_per_sec) {
+    clockrec_t *cr;
+
+    if (type < 0 || type >= CLOCKREC_TYPES)
+        return NULL;
+    cr = calloc(1, sizeof(clockrec_t));
+    if (!cr)
+        return NULL;
+    cr->type = type;
+    cr->fps = frames_per_sec;
+    cr->P[1][1] = KALMAN_P0;
+    clockrec_set_limits(cr, 0, 0);
+    clockrec_reset(cr);
+    return cr;
+}
+
+void clockrec_free(clockrec_t *cr) {
+    free(cr);
+}
+
+int clockrec_type(const char *name) {
+    int i;
+    for (i = 0; i < CLOCKREC_TYPES; i++)
+        if (!strcasecmp(name, type_names[i]))
+            return i;
+    return -1;
+}
+
+void clockrec_set_limits(clockrec_t *cr, double max_correction_ppm, double slew_ppm) {
+    if (max_correction_ppm <= 0)
+        max_correction_ppm = DEFAULT_MAX_CORR;
+    if (slew_ppm <= 0)
+        slew_ppm = DEFAULT_SLEW;
+    cr->max_corr = max_correction_ppm * 1e-6;
+    cr->slew = slew_ppm * 1e-6 / cr->fps;
+}
+
+void clockrec_reset(clockrec_t *cr) {
+    if (cr->type == CLOCKREC_LEGACY)
+        legacy_reset(cr);
+    else
+        kalman_reset(cr);
+}
+
+void clockrec_seed(clockrec_t *cr, double ppm) {
+    if (cr->type == CLOCKREC_LEGACY) {
+        cr->est_drift = ppm * 1e-6;
+    } else {
+        cr->d = cr->u = ppm * 1e-6;
+        cr->P[1][1] = KALMAN_SEEDED;
+        cr->P[0][1] = cr->P[1][0] = 0;
+    }
+    cr->rate = 1.0 + ppm * 1e-6;
+}
+
+double clockrec_update(clockrec_t *cr, double fill) {
+    if (cr->type == CLOCKREC_LEGACY)
+        return legacy_update(cr, fill);
+    return kalman_update(cr, fill);
+}
+
+void clockrec_get_state(clockrec_t *cr, clockrec_state_t *st) {
+    st->rate_ppm = (cr->rate - 1.0) * 1e6;
+    if (cr->type == CLOCKREC_LEGACY) {
+        st->ppm = cr->est_drift * 1e6;
+        st->err = cr->est_err;
+        st->locked = cr->fill_count >= 1000;
+    } else {
+        st->ppm = cr->d * 1e6;
+        st->err = cr->e;
+        st->locked = cr->settle >= KALMAN_SETTLE &&
+                     sqrt(cr->P[1][1]) * 1e6 < LOCK_PPM && fabs(cr->e) < LOCK_ERR;
+    }
+}
@@ -0,0 +1,47 @@
+#ifndef _CLOCKREC_H_
+#define _CLOCKREC_H_
+
+// Clock recovery: turns the jitter buffer fill, sampled once per frame
+// played, into the playback rate handed to the resampler.
+//
+// Rates are input samples consumed per output sample: above 1.0 the
+// buffer drains faster.
+
+enum {
+    CLOCKREC_LEGACY = 0,    // the original biquad loop
+    CLOCKREC_KALMAN,        // fill error and drift estimated together
+    CLOCKREC_TYPES
+};
+
+typedef struct clockrec clockrec_t;
+
+typedef struct {
+    double ppm;         // estimated sender clock offset, parts per million
+    double rate_ppm;    // current playback rate offset
+    double err;         // estimated fill error, frames
+    int locked;
+} clockrec_state_t;
+
+// frames_per_sec is how often clockrec_update will be called
+clockrec_t *clockrec_new(int type, double frames_per_sec);
+void clockrec_free(clockrec_t *cr);
+
+// returns the type for a name ("legacy", "kalman"), or -1
+int clockrec_type(const char *name);
+
+// largest correction on top of the drift estimate, and how fast the rate
+// may move, in ppm and ppm per second. 0 leaves the default.
+void clockrec_set_limits(clockrec_t *cr, double max_correction_ppm, double slew_ppm);
+
+// restart around a new fill level after a resync or underrun. the kalman
+// controller keeps what it knows about the drift.
+void clockrec_reset(clockrec_t *cr);
+
+// start from a known drift rather than none
+void clockrec_seed(clockrec_t *cr, double ppm);
+
+double clockrec_update(clockrec_t *cr, double fill);
+
+void clockrec_get_state(clockrec_t *cr, clockrec_state_t *st);
+
+#endif
@@ -0,0 +1,311 @@
+/*
+ * Output DSP for HairTunes
+ * Copyright (c) ShairPort contributors 2012
+ * All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <math.h>
+
+#include "dsp.h"
+
+// The two channels of a frame travel together in a 2-lane vector, so each
+// filter runs both channels for the price of one.
+//
+// EQ -> volume -> loudness -> limiter -> dithered back to 16 bits.
+//
+// Loudness is a low shelf and a high shelf whose gains grow with the
+// volume's attenuation; being after the volume, their boost can't push a
+// full-scale input into clipping until the volume is near the top, and
+// there the limiter has it.
+//
+// The limiter delays the audio by LOOKAHEAD_MS, so the gain can be on its
+// way down, in a straight line, before a peak gets to the output. It
+// comes back up exponentially once nothing over the threshold is left in
+// the delay.
+
+typedef float v2sf __attribute__((vector_size(8)));
+
+#define MAX_EQ          16
+
+#define LOUD_BASS_HZ    100
+#define LOUD_TREBLE_HZ  10000
+#define LOUD_BASS_MAX   12.0    // dB at full strength
+#define LOUD_TREBLE_MAX 6.0
+#define LOUD_STEP       0.5     // dB of attenuation between recalculations
+
+#define LOOKAHEAD_MS    2
+#define RELEASE_MS      100
+
+typedef struct {
+    float b0, b1, b2, a1, a2;
+    v2sf z1, z2;
+} biquad_t;
+
+enum { PEAK, LOWSHELF, HIGHSHELF, LOWPASS, HIGHPASS };
+
+struct dsp {
+    int rate;
+    int max_frames;
+    float *work;                // interleaved
+    float *gain;                // per frame, from the volume
+
+    biquad_t eq[MAX_EQ];
+    int neq;
+
+    double loudness;
+    double loud_atten;          // the attenuation the shelves are set for
+    biquad_t loud[2];
+
+    int limit;
+    float threshold;
+    v2sf *delay;
+    int lookahead, pos;
+    float lgain, ltarget, lstep, release;
+    int hold;
+};
+
+// RBJ's audio EQ cookbook
+static void biquad_set(biquad_t *bq, int type, double rate, double freq, double db, double q) {
+    double A = pow(10, db / 40);
+    double w0 = 2 * M_PI * freq / rate;
+    double cs = cos(w0), alpha = sin(w0) / (2 * q);
+    double sa = 2 * sqrt(A) * alpha;
+    double b0, b1, b2, a0, a1, a2;
+
+    switch (type) {
+    case PEAK:
+        b0 = 1 + alpha*A;   b1 = -2*cs;     b2 = 1 - alpha*A;
+        a0 = 1 + alpha/A;   a1 = -2*cs;     a2 = 1 - alpha/A;
+        break;
+    case LOWSHELF:
+        b0 = A*((A+1) - (A-1)*cs + sa);
+        b1 = 2*A*((A-1) - (A+1)*cs);
+        b2 = A*((A+1) - (A-1)*cs - sa);
+        a0 = (A+1) + (A-1)*cs + sa;
+        a1 = -2*((A-1) + (A+1)*cs);
+        a2 = (A+1) + (A-1)*cs - sa;
+        break;
+    case HIGHSHELF:
+        b0 = A*((A+1) + (A-1)*cs + sa);
+        b1 = -2*A*((A-1) + (A+1)*cs);
+        b2 = A*((A+1) + (A-1)*cs - sa);
+        a0 = (A+1) - (A-1)*cs + sa;
+        a1 = 2*((A-1) - (A+1)*cs);
+        a2 = (A+1) - (A-1)*cs - sa;
+        break;
+    case LOWPASS:
+        b0 = (1 - cs)/2;    b1 = 1 - cs;    b2 = (1 - cs)/2;
+        a0 = 1 + alpha;     a1 = -2*cs;     a2 = 1 - alpha;
+        break;
+    default:
+        b0 = (1 + cs)/2;    b1 = -(1 + cs); b2 = (1 + cs)/2;
+        a0 = 1 + alpha;     a1 = -2*cs;     a2 = 1 - alpha;
+        break;
+    }
+    // the state carries over, so a change of settings doesn't restart it
+    bq->b0 = b0/a0;
+    bq->b1 = b1/a0;
+    bq->b2 = b2/a0;
+    bq->a1 = a1/a0;
+    bq->a2 = a2/a0;
+}
+
+// transposed direct form II, in place
+static void biquad_run(biquad_t *bq, v2sf *x, int frames) {
+    v2sf b0 = { bq->b0, bq->b0 }, b1 = { bq->b1, bq->b1 }, b2 = { bq->b2, bq->b2 };
+    v2sf a1 = { bq->a1, bq->a1 }, a2 = { bq->a2, bq->a2 };
+    v2sf z1 = bq->z1, z2 = bq->z2, in, out;
+    int i;
+
+    for (i = 0; i < frames; i++) {
+        in = x[i];
+        out = b0*in + z1;
+        z1 = b1*in - a1*out + z2;
+        z2 = b2*in - a2*out;
+        x[i] = out;
+    }
+    bq->z1 = z1;
+    bq->z2 = z2;
+}
+
+dsp_t *dsp_new(int rate, int max_frames) {
+    dsp_t *d = calloc(1, sizeof(dsp_t));
+
+    d->rate = rate;
+    d->max_frames = max_frames;
+    d->work = malloc(2 * max_frames * sizeof(float));
+    d->gain = malloc(max_frames * sizeof(float));
+    d->loud_atten = -1;
+
+    d->lookahead = rate * LOOKAHEAD_MS / 1000;
+    if (d->lookahead < 1)
+        d->lookahead = 1;
+    d->delay = calloc(d->lookahead, sizeof(v2sf));
+    d->lgain = d->ltarget = 1;
+    d->release = 1 - exp(-1.0 / (rate * RELEASE_MS / 1000.0));
+    return d;
+}
+
+void dsp_free(dsp_t *d) {
+    free(d->work);
+    free(d->gain);
+    free(d->delay);
+    free(d);
+}
+
+int dsp_eq(dsp_t *d, const char *spec) {
+    char *list = strdup(spec), *p = list, *item;
+    char type[16];
+    double freq, db, q;
+    int n, t;
+
+    while ((item = strsep(&p, ","))) {
+        q = M_SQRT1_2;
+        n = sscanf(item, "%15[^:]:%lf:%lf:%lf", type, &freq, &db, &q);
+        if (n < 3 || d->neq == MAX_EQ || freq <= 0 || freq >= d->rate / 2 || q <= 0)
+            goto bad;
+        if (!strcasecmp(type, "peak"))
+            t = PEAK;
+        else if (!strcasecmp(type, "lowshelf"))
+            t = LOWSHELF;
+        else if (!strcasecmp(type, "highshelf"))
+            t = HIGHSHELF;
+        else if (!strcasecmp(type, "lowpass"))
+            t = LOWPASS;
+        else if (!strcasecmp(type, "highpass"))
+            t = HIGHPASS;
+        else
+            goto bad;
+        biquad_set(&d->eq[d->neq++], t, d->rate, freq, db, q);
+    }
+    free(list);
+    return 0;
+
+bad:
+    free(list);
+    return -1;
+}
+
+void dsp_loudness(dsp_t *d, double strength) {
+    d->loudness = strength < 0 ? 0 : strength > 1 ? 1 : strength;
+}
+
+void dsp_limiter(dsp_t *d, double threshold) {
+    d->limit = 1;
+    d->threshold = pow(10, threshold / 20);
+}
+
+// follow the volume, a step at a time so a ramp doesn't recalculate
+// the shelves on every block
+static void loudness_update(dsp_t *d, float gain) {
+    double atten = gain > 0 ? -20 * log10(gain) : 100;
+    double bass, treble;
+
+    atten = floor(atten / LOUD_STEP) * LOUD_STEP;
+    if (atten == d->loud_atten)
+        return;
+    d->loud_atten = atten;
+
+    // about half the attenuation back in the bass, a quarter in the treble
+    bass = fmin(atten * 0.5, LOUD_BASS_MAX) * d->loudness;
+    treble = fmin(atten * 0.25, LOUD_TREBLE_MAX) * d->loudness;
+    biquad_set(&d->loud[0], LOWSHELF, d->rate, LOUD_BASS_HZ, bass, M_SQRT1_2);
+    biquad_set(&d->loud[1], HIGHSHELF, d->rate, LOUD_TREBLE_HZ, treble, M_SQRT1_2);
+}
+
+static void limiter_run(dsp_t *d, v2sf *x, int frames) {
+    v2sf in, out;
+    float peak, want, step;
+    int i;
+
+    for (i = 0; i < frames; i++) {
+        in = x[i];
+        peak = fmaxf(fabsf(in[0]), fabsf(in[1]));
+        want = peak > d->threshold ? d->threshold / peak : 1;
+
+        if (want < d->ltarget) {
+            // be there by the time this frame is: at least this steep
+            d->ltarget = want;
+            step = (want - d->lgain) / d->lookahead;
+            if (step < d->lstep)
+                d->lstep = step;
+        }
+        // no coming back up while anything over the threshold is queued
+        if (want < 1)
+            d->hold = d->lookahead;
+        if (d->lgain > d->ltarget) {
+            d->lgain += d->lstep;
+            if (d->lgain <= d->ltarget) {
+                d->lgain = d->ltarget;
+                d->lstep = 0;
+            }
+        } else if (d->hold > 0) {
+            d->hold--;
+        } else {
+            d->lgain += (1 - d->lgain) * d->release;
+            d->ltarget = d->lgain;
+        }
+
+        out = d->delay[d->pos];
+        d->delay[d->pos] = in;
+        if (++d->pos == d->lookahead)
+            d->pos = 0;
+        x[i] = out * d->lgain;
+    }
+}
+
+void dsp_process(dsp_t *d, volume_t *vol, short *buf, int frames) {
+    v2sf *x = (v2sf *)d->work;
+    int i, j, n;
+
+    while (frames > 0) {
+        n = frames < d->max_frames ? frames : d->max_frames;
+
+        for (i = 0; i < 2*n; i++)
+            d->work[i] = buf[i] * (1.0f / 32768);
+
+        for (j = 0; j < d->neq; j++)
+            biquad_run(&d->eq[j], x, n);
+
+        volume_ramp(vol, d->gain, n);
+        for (i = 0; i < n; i++)
+            x[i] *= d->gain[i];
+
+        if (d->loudness > 0) {
+            loudness_update(d, d->gain[n-1]);
+            biquad_run(&d->loud[0], x, n);
+            biquad_run(&d->loud[1], x, n);
+        }
+
+        if (d->limit)
+            limiter_run(d, x, n);
+
+        volume_quantize(vol, d->work, buf, n);
+        buf += 2*n;
+        frames -= n;
+    }
+}
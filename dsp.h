@@ -0,0 +1,31 @@
+#ifndef _DSP_H_
+#define _DSP_H_
+
+#include "volume.h"
+
+// Optional processing between the resampler and the output, in float:
+// a parametric EQ, loudness compensation that follows the volume, and a
+// look-ahead limiter. Interleaved stereo 16-bit frames in and out; the
+// volume is applied inside the chain, in place of volume_apply.
+
+typedef struct dsp dsp_t;
+
+// max_frames is the largest block that will be passed in
+dsp_t *dsp_new(int rate, int max_frames);
+void dsp_free(dsp_t *d);
+
+// a comma-separated list of filters, each type:freq:gain:q, eg.
+// "lowshelf:80:4:0.7,peak:3000:-2:1.4". types are peak, lowshelf,
+// highshelf, lowpass and highpass (whose gain is ignored); q may be left
+// out. returns -1 if the list can't be understood.
+int dsp_eq(dsp_t *d, const char *spec);
+
+// 0 (off) to 1: how much bass and treble to add back as the volume drops
+void dsp_loudness(dsp_t *d, double strength);
+
+// limit peaks to 'threshold' dBFS, after the volume
+void dsp_limiter(dsp_t *d, double threshold);
+
+void dsp_process(dsp_t *d, volume_t *vol, short *buf, int frames);
+
+#endif
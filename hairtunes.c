@@ -24,13 +24,19 @@
  * OTHER DEALINGS IN THE SOFTWARE.
  */
 
+#define _GNU_SOURCE     // CPU affinity
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <sched.h>
+#include <malloc.h>
+#include <sys/mman.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/select.h>
+#include <sys/uio.h>
+#include <time.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <pthread.h>
@@ -41,7 +47,7 @@
 #include "hairtunes.h"
 #include <sys/signal.h>
 #include <fcntl.h>
-#include <ao/ao.h>
+#include <errno.h>
 
 #ifdef FANCY_RESAMPLING
 #include <samplerate.h>
@@ -51,6 +57,11 @@
 static int debug = 0;
 
 #include "alac.h"
+#include "resample.h"
+#include "clockrec.h"
+#include "volume.h"
+#include "dsp.h"
+#include "audio.h"
 
 // and how full it needs to be to begin (must be <BUFFER_FRAMES)
 #define START_FILL    282
@@ -59,69 +70,299 @@ static int debug = 0;
 
 typedef unsigned short seq_t;
 
-// global options (constant after init)
-static unsigned char aeskey[16], aesiv[16];
-static AES_KEY aes;
-static char *rtphost = 0;
-static int dataport = 0, controlport = 0, timingport = 0;
-static int fmtp[32];
-static int sampling_rate;
-static int frame_size;
-
-static int buffer_start_fill;
+// global options (constant once a session has started); every session
+// starts from these
+
+// RTP socket tuning (0 or -1 leaves the kernel default)
+static int rtp_rcvbuf = 0;          // SO_RCVBUF, bytes
+static int rtp_busy_poll = 0;       // SO_BUSY_POLL, microseconds
+static int rtp_priority = -1;       // SO_PRIORITY of resend requests
+static int rtp_dscp = -1;           // DSCP of resend requests
+
+// local RTP ports: either a fixed pair handed to us by the RTSP side,
+// or probed for within a range
+static int rtp_port = 0;
+static int rtp_port_low = 6000, rtp_port_high = 65535;
+static int rtp_portfd = -1;         // where to write struct hairtunes_ports
+
+// drift correction: resampler mode, and the average CPU time per frame
+// it may use before stepping down a quality level
+static int resample_mode = RESAMPLE_MEDIUM;
+static int resample_budget = 1000;  // microseconds, 0 for no limit
+
+// clock recovery controller, and its limits in ppm and ppm/s (0 for default)
+static int clock_type = CLOCKREC_KALMAN;
+static double clock_max_ppm = 0, clock_slew = 0;
+static double clock_seed_ppm;       // drift learned by an earlier session
+static int clock_seeded = 0;
+
+// real-time tuning: SCHED_FIFO priority for the audio thread (0 leaves it
+// alone), CPUs to pin the receive/decode and audio threads to ("2",
+// "0,2-3"), and whether to lock all memory and fault it in up front
+static int rt_priority = 0;
+static char *rtp_cpus = NULL, *audio_cpus = NULL;
+static int rt_mlock = 0;
+static pthread_once_t rt_mlock_once = PTHREAD_ONCE_INIT;
+
+// output DSP: EQ filter list, loudness strength (0-1), limiter threshold
+// in dBFS. any of them sets up the float chain.
+static char *dsp_eq_spec = NULL;
+static double dsp_loudness_strength = 0;
+static double dsp_limiter_db = 0;
+static int dsp_limit = 0;
+
+// rebuild missing frames from the audio before them instead of muting
+static int plc_enabled = 1;
+
+// packet capture, and replay of a capture in place of the network
+static char *capture_name = NULL;
+static char *replay_name = NULL;
+static double replay_speed = 1.0;   // 0 runs as fast as the pipeline allows
+
+// where the audio goes; libao, or the pipe if one is named, unless chosen.
+// the first output sets the pace, the rest are fed through queues.
+#define MAX_OUTPUTS 8
+static const audio_backend_t *output_backend[MAX_OUTPUTS];
+static int output_count = 0;
+static int output_queue = 500;      // ms of audio queued for the others
+static pthread_once_t output_once = PTHREAD_ONCE_INIT;
 
 static char *libao_driver = NULL;
 static char *libao_devicename = NULL;
 static char *libao_deviceid = NULL; // ao_options expects "char*"
 
-// FIFO name and file handle
+// FIFO name
 static char *pipename = NULL;
-static int pipe_handle = -1;
-
-#define FRAME_BYTES (4*frame_size)
-// maximal resampling shift - conservative
-#define OUTFRAME_BYTES (4*(frame_size+3))
-
-
-static alac_file *decoder_info;
 
 #ifdef FANCY_RESAMPLING
 static int fancy_resampling = 1;
-static SRC_STATE *src;
 #endif
 
-static int  init_rtp(void);
-static void init_buffer(void);
-static int  init_output(void);
-static void rtp_request_resend(seq_t first, seq_t last);
-static void ab_resync(void);
-
-// interthread variables
-// stdin->decoder
-static double volume = 1.0;
-static int fix_volume = 0x10000;
-static pthread_mutex_t vol_mutex = PTHREAD_MUTEX_INITIALIZER;
-
-
-
 typedef struct audio_buffer_entry {   // decoded audio packets
     int ready;
     signed short *data;
 } abuf_t;
-static abuf_t audio_buffer[BUFFER_FRAMES];
 #define BUFIDX(seqno) ((seq_t)(seqno) % BUFFER_FRAMES)
 
-// mutex-protected variables
-static seq_t ab_read, ab_write;
-static int ab_buffering = 1, ab_synced = 0;
-static pthread_mutex_t ab_mutex = PTHREAD_MUTEX_INITIALIZER;
-static pthread_cond_t ab_buffer_ready = PTHREAD_COND_INITIALIZER;
+// Everything belonging to one stream. The receive thread fills the buffer
+// and the audio thread empties it; what they share is under ab_mutex, and
+// the rest is each thread's own unless marked otherwise.
+struct hairtunes_session {
+    // stream parameters, constant once started
+    unsigned char aeskey[16], aesiv[16];
+    AES_KEY aes;
+    int controlport;
+    int fmtp[32];
+    int sampling_rate;
+    int frame_size;
+    int buffer_start_fill;
+    alac_file *decoder_info;
+
+    // mutex-protected variables
+    abuf_t audio_buffer[BUFFER_FRAMES];
+    seq_t ab_read, ab_write;
+    int ab_buffering, ab_synced;
+    struct timespec ab_write_time;  // when ab_write last moved
+    pthread_mutex_t ab_mutex;
+    pthread_cond_t ab_buffer_ready;
+    pthread_cond_t ab_space_ready;  // a frame was consumed
+    int stop;                       // also read without the lock
+
+    // receive side
+    int rtp_sockets[2];             // data, control
+    int rtp_wake[2];                // a byte here stops the receive thread
+#ifdef AF_INET6
+    struct sockaddr_in6 rtp_client;
+#else
+    struct sockaddr_in rtp_client;
+#endif
+    unsigned int rtp_drops[2];      // last SO_RXQ_OVFL count seen per socket
+    FILE *capture_file;
+    struct timespec capture_start;
+    FILE *replay_file;
+
+    pthread_t rtp_thread, audio_thread, replay_thread;
+    int rtp_running, audio_running, replay_running;
+
+    // clock recovery, updated by whoever takes frames off the buffer
+    clockrec_t *clockrec;
+    double bf_playback_rate;
+    double bf_drift_snapshot;
+    int bf_have_snapshot, bf_snapshot_count;
+
+    // audio thread
+    short fade_last[2];             // the last sample played
+    int fade_silent;                // and whether it was the end of the audio
+    int out_paused;                 // the output is stopped until the next frame
+    short *fade_buf;
+    short *plc_hist;                // last frame handed out
+    int plc_have_hist;
+    int plc_lost;                   // consecutive concealed frames
+    int plc_period, plc_pos;
+    signed short *outbuf;
+    resampler_t *resampler;
+    dsp_t *dsp;
+    audio_output_t *output;
+#ifdef FANCY_RESAMPLING
+    SRC_STATE *src;
+    float *frame, *outframe;
+    SRC_DATA srcdat;
+#endif
+
+    // stdin->decoder
+    volume_t *vol;                  // volume_set needs no lock
+
+    // counters reported by the "stats" command. bumped from the receive,
+    // audio and replay threads and read from any, so only through
+    // STAT_ADD and STAT; relaxed, as nothing else is ordered by them
+    struct {
+        unsigned long packets;
+        unsigned long resend_requests;
+        unsigned long late_packets;
+        unsigned long missing_frames;
+        unsigned long concealed_frames;
+        unsigned long underruns;
+        unsigned long overruns;
+        unsigned long socket_drops;     // overflowed the kernel receive queue
+    } stats;
+};
+
+#define FRAME_BYTES(s) (4*(s)->frame_size)
+// maximal resampling shift - conservative
+#define OUTFRAME_BYTES(s) (4*((s)->frame_size+3))
+
+static int  init_rtp(hairtunes_session_t *s, int port, struct hairtunes_ports *ports);
+static int  init_buffer(hairtunes_session_t *s);
+static int  init_output(hairtunes_session_t *s);
+static void rtp_request_resend(hairtunes_session_t *s, seq_t first, seq_t last);
+static void ab_resync(hairtunes_session_t *s);
+static void capture_open(hairtunes_session_t *s, char *fmtpstr);
+static char *replay_open(hairtunes_session_t *s);
+static void *replay_thread_func(void *arg);
+static void *rtp_thread_func(void *arg);
+static void *audio_thread_func(void *arg);
 
 static void die(char *why) {
     fprintf(stderr, "FATAL: %s\n", why);
     exit(1);
 }
 
+static int stopping(hairtunes_session_t *s) {
+    return __atomic_load_n(&s->stop, __ATOMIC_ACQUIRE);
+}
+
+#define STAT_ADD(s, counter, n)  __atomic_fetch_add(&(s)->stats.counter, (n), __ATOMIC_RELAXED)
+#define STAT(s, counter)         __atomic_load_n(&(s)->stats.counter, __ATOMIC_RELAXED)
+
+static void print_stats(hairtunes_session_t *s) {
+    clockrec_state_t cs;
+    char out_stats[128];
+    memset(&cs, 0, sizeof(cs));
+    if (s->clockrec)
+        clockrec_get_state(s->clockrec, &cs);
+    audio_stats(s->output, out_stats, sizeof(out_stats));
+
+    fprintf(stderr, "stats: packets %lu resend %lu late %lu missing %lu concealed %lu "
+            "underrun %lu overrun %lu sockdrop %lu "
+            "drift %.2fppm rate %.2fppm fillerr %.3f %s%s%s\n",
+            STAT(s, packets), STAT(s, resend_requests), STAT(s, late_packets),
+            STAT(s, missing_frames), STAT(s, concealed_frames), STAT(s, underruns),
+            STAT(s, overruns), STAT(s, socket_drops),
+            cs.ppm, cs.rate_ppm, cs.err, cs.locked ? "locked" : "unlocked",
+            out_stats[0] ? " " : "", out_stats);
+}
+
+int hairtunes_option(char *name, char *value) {
+    if (!value)
+        return 0;
+    if (!strcasecmp(name, "rcvbuf")) {
+        rtp_rcvbuf = atoi(value);
+    } else if (!strcasecmp(name, "busypoll")) {
+        rtp_busy_poll = atoi(value);
+    } else if (!strcasecmp(name, "priority")) {
+        rtp_priority = atoi(value);
+    } else if (!strcasecmp(name, "dscp")) {
+        rtp_dscp = atoi(value);
+    } else if (!strcasecmp(name, "resample")) {
+        resample_mode = resampler_mode(value);
+        if (resample_mode < 0)
+            die("unknown resample mode (stuff, fast, medium or best)");
+    } else if (!strcasecmp(name, "resample_budget")) {
+        resample_budget = atoi(value);
+    } else if (!strcasecmp(name, "clock")) {
+        clock_type = clockrec_type(value);
+        if (clock_type < 0)
+            die("unknown clock recovery (legacy or kalman)");
+    } else if (!strcasecmp(name, "clock_max_ppm")) {
+        clock_max_ppm = atof(value);
+    } else if (!strcasecmp(name, "drift")) {
+        clock_seed_ppm = atof(value);
+        clock_seeded = 1;
+    } else if (!strcasecmp(name, "clock_slew")) {
+        clock_slew = atof(value);
+    } else if (!strcasecmp(name, "plc")) {
+        plc_enabled = atoi(value);
+    } else if (!strcasecmp(name, "capture")) {
+        capture_name = value;
+    } else if (!strcasecmp(name, "replay")) {
+        replay_name = value;
+        if (!output_count)
+            output_backend[output_count++] = &audio_null;
+    } else if (!strcasecmp(name, "speed")) {
+        replay_speed = atof(value);
+        audio_option(name, value);      // the null output keeps the same pace
+    } else if (!strcasecmp(name, "output")) {
+        char *list = strdup(value), *item;
+        output_count = 0;
+        while ((item = strsep(&list, ","))) {
+#ifndef HAVE_ALSA
+            if (!strcasecmp(item, "alsa"))
+                die("built without ALSA support");
+#endif
+            if (output_count == MAX_OUTPUTS)
+                die("too many outputs");
+            output_backend[output_count] = audio_backend(item);
+            if (!output_backend[output_count++])
+                die("unknown output");
+        }
+    } else if (!strcasecmp(name, "rt_priority")) {
+        rt_priority = atoi(value);
+    } else if (!strcasecmp(name, "rtp_cpus")) {
+        rtp_cpus = value;
+    } else if (!strcasecmp(name, "audio_cpus")) {
+        audio_cpus = value;
+    } else if (!strcasecmp(name, "mlock")) {
+        rt_mlock = atoi(value);
+    } else if (!strcasecmp(name, "eq")) {
+        // check it now rather than failing every session
+        dsp_t *d = dsp_new(44100, 1);
+        int bad = dsp_eq(d, value) < 0;
+        dsp_free(d);
+        if (bad)
+            die("can't understand eq (type:freq:gain:q,...)");
+        dsp_eq_spec = value;
+    } else if (!strcasecmp(name, "loudness")) {
+        dsp_loudness_strength = atof(value);
+    } else if (!strcasecmp(name, "limiter")) {
+        dsp_limiter_db = atof(value);
+        dsp_limit = 1;
+    } else if (!strcasecmp(name, "output_queue")) {
+        output_queue = atoi(value);
+    } else if (!strcasecmp(name, "port")) {
+        rtp_port = atoi(value);
+    } else if (!strcasecmp(name, "portrange")) {
+        if (sscanf(value, "%d-%d", &rtp_port_low, &rtp_port_high) != 2 ||
+            rtp_port_low < 1 || rtp_port_high > 65535 || rtp_port_high <= rtp_port_low)
+            die("portrange must be given as low-high");
+    } else if (!strcasecmp(name, "portfd")) {
+        rtp_portfd = atoi(value);
+    } else {
+        // perhaps it's for one of the output backends
+        return audio_option(name, value);
+    }
+    return 1;
+}
+
 #ifdef HAIRTUNES_STANDALONE
 static int hex2bin(unsigned char *buf, char *hex) {
     int i, j;
@@ -137,22 +378,94 @@ static int hex2bin(unsigned char *buf, char *hex) {
 }
 #endif
 
-static int init_decoder(void) {
+// Real-time setup. None of it is fatal: without the privilege for it
+// (CAP_SYS_NICE, CAP_IPC_LOCK or the rlimits) we say so and carry on.
+#define PREFAULT_STACK  (256*1024)
+#define THREAD_STACK    (PREFAULT_STACK + 256*1024)
+
+// with memory locked, each thread's stack is pinned whole, so they are
+// made no bigger than the prefaulted part needs. NULL for the defaults
+static pthread_attr_t rt_thread_attr, *rt_attr = NULL;
+
+static void tune_thread(const char *who, const char *cpus, int priority) {
+#ifdef __linux__
+    if (cpus) {
+        char *list = strdup(cpus), *p = list, *item;
+        int lo, hi;
+        cpu_set_t set;
+
+        CPU_ZERO(&set);
+        while ((item = strsep(&p, ","))) {
+            int n = sscanf(item, "%d-%d", &lo, &hi);
+            if (n < 1)
+                continue;
+            if (n == 1)
+                hi = lo;
+            for (; lo <= hi && lo < CPU_SETSIZE; lo++)
+                if (lo >= 0)
+                    CPU_SET(lo, &set);
+        }
+        free(list);
+        if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set))
+            fprintf(stderr, "can't pin the %s thread to CPUs %s\n", who, cpus);
+    }
+#endif
+    if (priority > 0) {
+        struct sched_param sp;
+        memset(&sp, 0, sizeof(sp));
+        sp.sched_priority = priority;
+        if (pthread_setschedparam(pthread_self(), SCHED_FIFO, &sp))
+            fprintf(stderr, "can't run the %s thread SCHED_FIFO %d\n", who, priority);
+    }
+}
+
+// everything from now on, and this thread's stack, stays in RAM
+static void prefault_stack(void) {
+    volatile char stack[PREFAULT_STACK];
+    memset((char *)stack, 0, sizeof(stack));
+}
+
+// once per process, before the first session's buffers are allocated
+static void lock_memory(void) {
+    if (mlockall(MCL_CURRENT | MCL_FUTURE)) {
+        perror("can't lock memory");
+        return;
+    }
+    pthread_attr_init(&rt_thread_attr);
+    pthread_attr_setstacksize(&rt_thread_attr, THREAD_STACK);
+    rt_attr = &rt_thread_attr;
+    audio_thread_stack(THREAD_STACK);
+#ifdef M_TRIM_THRESHOLD
+    // freed memory stays with us instead of coming back as fresh faults
+    mallopt(M_TRIM_THRESHOLD, -1);
+    mallopt(M_MMAP_MAX, 0);
+#endif
+    prefault_stack();
+}
+
+static int init_decoder(hairtunes_session_t *s) {
     alac_file *alac;
+    int *fmtp = s->fmtp;
 
-    frame_size = fmtp[1]; // stereo samples
-    sampling_rate = fmtp[11];
+    s->frame_size = fmtp[1]; // stereo samples
+    s->sampling_rate = fmtp[11];
 
     int sample_size = fmtp[3];
-    if (sample_size != 16)
-        die("only 16-bit samples supported!");
+    if (sample_size != 16) {
+        fprintf(stderr, "only 16-bit samples supported!\n");
+        return 1;
+    }
+    if (s->frame_size <= 0 || s->frame_size > MAX_PACKET || s->sampling_rate <= 0) {
+        fprintf(stderr, "can't understand fmtp\n");
+        return 1;
+    }
 
     alac = create_alac(sample_size, 2);
     if (!alac)
         return 1;
-    decoder_info = alac;
+    s->decoder_info = alac;
 
-    alac->setinfo_max_samples_per_frame = frame_size;
+    alac->setinfo_max_samples_per_frame = s->frame_size;
     alac->setinfo_7a =      fmtp[2];
     alac->setinfo_sample_size = sample_size;
     alac->setinfo_rice_historymult = fmtp[4];
@@ -167,51 +480,210 @@ static int init_decoder(void) {
     return 0;
 }
 
-int hairtunes_init(char *pAeskey, char *pAesiv, char *fmtpstr, int pCtrlPort, int pTimingPort,
-         int pDataPort, char *pRtpHost, char*pPipeName, char *pLibaoDriver, char *pLibaoDeviceName, char *pLibaoDeviceId,
-         int bufStartFill)
-{
-    if(pAeskey != NULL)    
-        memcpy(aeskey, pAeskey, sizeof(aeskey));
-    if(pAesiv != NULL)
-        memcpy(aesiv, pAesiv, sizeof(aesiv));
-    if(pRtpHost != NULL)
-        rtphost = pRtpHost;
-    if(pPipeName != NULL)
-        pipename = pPipeName;
-    if(pLibaoDriver != NULL)
-        libao_driver = pLibaoDriver;
-    if(pLibaoDeviceName != NULL)
-        libao_devicename = pLibaoDeviceName;
-    if(pLibaoDeviceId != NULL)
-        libao_deviceid = pLibaoDeviceId;
-    
-    controlport = pCtrlPort;
-    timingport = pTimingPort;
-    dataport = pDataPort;
-    if(bufStartFill < 0)
-        bufStartFill = START_FILL;
-    buffer_start_fill = bufStartFill;
-
-    AES_set_decrypt_key(aeskey, 128, &aes);
-
-    memset(fmtp, 0, sizeof(fmtp));
-    int i = 0;
-    char *arg;
-    while ( (arg = strsep(&fmtpstr, " \t")) )
-        fmtp[i++] = atoi(arg);
+hairtunes_session_t *hairtunes_start(struct hairtunes_setup *setup, struct hairtunes_ports *ports) {
+    hairtunes_session_t *s = calloc(1, sizeof(hairtunes_session_t));
+    char *fmtpstr, *fmtpcopy, *arg;
+    int i = 0, err;
 
-    init_decoder();
-    init_buffer();
-    init_rtp();      // open a UDP listen port and start a listener; decode into ring buffer
+    memset(ports, 0, sizeof(*ports));
+    if (!s) {
+        ports->status = ENOMEM;
+        return NULL;
+    }
+    s->rtp_sockets[0] = s->rtp_sockets[1] = -1;
+    s->rtp_wake[0] = s->rtp_wake[1] = -1;
+    s->ab_buffering = 1;
+    s->fade_silent = 1;
+    s->bf_playback_rate = 1.0;
+    pthread_mutex_init(&s->ab_mutex, NULL);
+    pthread_cond_init(&s->ab_buffer_ready, NULL);
+    pthread_cond_init(&s->ab_space_ready, NULL);
+
+    if (setup->aeskey)
+        memcpy(s->aeskey, setup->aeskey, sizeof(s->aeskey));
+    if (setup->aesiv)
+        memcpy(s->aesiv, setup->aesiv, sizeof(s->aesiv));
+    s->controlport = setup->control_port;
+    s->buffer_start_fill = setup->start_fill < 0 ? START_FILL : setup->start_fill;
+
+    fmtpstr = setup->fmtp;
+    if (replay_name)
+        fmtpstr = replay_open(s);   // brings its own key, IV and format
+    if (!fmtpstr) {
+        err = EINVAL;
+        goto fail;
+    }
+    if (capture_name)
+        capture_open(s, fmtpstr);
+
+    AES_set_decrypt_key(s->aeskey, 128, &s->aes);
+
+    fmtpcopy = strdup(fmtpstr);
+    if (replay_name)
+        free(fmtpstr);
+    fmtpstr = fmtpcopy;
+    while ( (arg = strsep(&fmtpstr, " \t")) && i < 32 )
+        s->fmtp[i++] = atoi(arg);
+    free(fmtpcopy);
+
+    if (rt_mlock)
+        pthread_once(&rt_mlock_once, lock_memory);
+    if (init_decoder(s)) {
+        err = EINVAL;
+        goto fail;
+    }
+    if ((err = init_buffer(s)))
+        goto fail;
+    if (setup->drift_known)
+        clockrec_seed(s->clockrec, setup->drift);
+    if (!replay_name &&     // open a UDP listen port; decode into ring buffer
+        (err = init_rtp(s, setup->data_port ? setup->data_port : rtp_port, ports)))
+        goto fail;
+    if ((err = init_output(s)))     // resample and output from ring buffer
+        goto fail;
+
+    if (replay_name) {
+        // feed the capture through the same path as the network. a
+        // flat-out replay plays its own frames, in step with feeding them
+        if ((err = pthread_create(&s->replay_thread, rt_attr, replay_thread_func, s)))
+            goto fail;
+        s->replay_running = 1;
+        if (replay_speed <= 0)
+            return s;
+    } else {
+        if ((err = pthread_create(&s->rtp_thread, rt_attr, rtp_thread_func, s)))
+            goto fail;
+        s->rtp_running = 1;
+    }
+    if ((err = pthread_create(&s->audio_thread, rt_attr, audio_thread_func, s)))
+        goto fail;
+    s->audio_running = 1;
+    return s;
+
+fail:
+    hairtunes_stop(s);
+    memset(ports, 0, sizeof(*ports));
+    ports->status = err;
+    return NULL;
+}
+
+void hairtunes_volume(hairtunes_session_t *s, double db) {
+    if (db > 0)
+        db = 0;
+    if (debug)
+        fprintf(stderr, "VOL: %lf\n", db);
+    volume_set(s->vol, pow(10.0,0.05*db));
+}
+
+void hairtunes_flush(hairtunes_session_t *s) {
+    pthread_mutex_lock(&s->ab_mutex);
+    ab_resync(s);
+    pthread_mutex_unlock(&s->ab_mutex);
+    if (debug)
+        fprintf(stderr, "FLUSH\n");
+}
+
+void hairtunes_stop(hairtunes_session_t *s) {
+    int i;
+
+    pthread_mutex_lock(&s->ab_mutex);
+    __atomic_store_n(&s->stop, 1, __ATOMIC_RELEASE);
+    pthread_cond_broadcast(&s->ab_buffer_ready);
+    pthread_cond_broadcast(&s->ab_space_ready);
+    pthread_mutex_unlock(&s->ab_mutex);
+
+    if (s->rtp_running) {
+        if (write(s->rtp_wake[1], "", 1) != 1)
+            perror("can't stop the receive thread");
+        pthread_join(s->rtp_thread, NULL);
+    }
+    if (s->audio_running)
+        pthread_join(s->audio_thread, NULL);
+    if (s->replay_running)
+        pthread_join(s->replay_thread, NULL);
+
+    for (i=0; i<2; i++) {
+        if (s->rtp_sockets[i] >= 0)
+            close(s->rtp_sockets[i]);
+        if (s->rtp_wake[i] >= 0)
+            close(s->rtp_wake[i]);
+    }
+    if (s->capture_file)
+        fclose(s->capture_file);
+    if (s->replay_file)
+        fclose(s->replay_file);
+
+    if (s->output)
+        audio_close(s->output);
+    if (s->dsp)
+        dsp_free(s->dsp);
+    if (s->vol)
+        volume_free(s->vol);
+    if (s->resampler)
+        resampler_free(s->resampler);
+    if (s->clockrec)
+        clockrec_free(s->clockrec);
+    if (s->decoder_info)
+        destroy_alac(s->decoder_info);
+#ifdef FANCY_RESAMPLING
+    if (s->src)
+        src_delete(s->src);
+    free(s->frame);
+    free(s->outframe);
+#endif
+    for (i=0; i<BUFFER_FRAMES; i++)
+        free(s->audio_buffer[i].data);
+    free(s->outbuf);
+    free(s->plc_hist);
+    free(s->fade_buf);
+
+    pthread_mutex_destroy(&s->ab_mutex);
+    pthread_cond_destroy(&s->ab_buffer_ready);
+    pthread_cond_destroy(&s->ab_space_ready);
+    free(s);
+}
+
+// let our handler know where we end up listening
+static void report_ports(struct hairtunes_ports *msg) {
+    if (rtp_portfd < 0) {
+        if (!msg->status) {
+            printf("port: %d\n", msg->data_port);
+            printf("cport: %d\n", msg->control_port);
+        }
+        return;
+    }
+
+    if (write(rtp_portfd, msg, sizeof(*msg)) != sizeof(*msg))
+        perror("port report");
+}
+
+int hairtunes_init(char *pAeskey, char *pAesiv, char *fmtpstr, int pCtrlPort, int bufStartFill)
+{
+    struct hairtunes_setup setup;
+    struct hairtunes_ports ports;
+    hairtunes_session_t *s;
+
+    memset(&setup, 0, sizeof(setup));
+    setup.aeskey = pAeskey;
+    setup.aesiv = pAesiv;
+    setup.fmtp = fmtpstr;
+    setup.control_port = pCtrlPort;
+    setup.drift_known = clock_seeded;
+    setup.drift = clock_seed_ppm;
+    setup.start_fill = bufStartFill;
+
+    s = hairtunes_start(&setup, &ports);
+    if (!replay_name)
+        report_ports(&ports);
     fflush(stdout);
-    init_output();              // resample and output from ring buffer
+    if (!s)
+        die("Could not start the session");
 
     char line[128];
     int in_line = 0;
     int n;
     double f;
-    while (fgets(line + in_line, sizeof(line) - in_line, stdin)) {
+    while (!replay_name && fgets(line + in_line, sizeof(line) - in_line, stdin)) {
         n = strlen(line);
         if (line[n-1] != '\n') {
             in_line = strlen(line) - 1;
@@ -221,25 +693,25 @@ int hairtunes_init(char *pAeskey, char *pAesiv, char *fmtpstr, int pCtrlPort, in
         }
         if (sscanf(line, "vol: %lf\n", &f)) {
             assert(f<=0);
-            if (debug)
-                fprintf(stderr, "VOL: %lf\n", f);
-            pthread_mutex_lock(&vol_mutex);
-            volume = pow(10.0,0.05*f);
-            fix_volume = 65536.0 * volume;
-            pthread_mutex_unlock(&vol_mutex);
+            hairtunes_volume(s, f);
+            continue;
+        }
+        if (!strcmp(line, "stats\n")) {
+            print_stats(s);
             continue;
         }
         if (!strcmp(line, "exit\n")) {
             exit(0);
         }
         if (!strcmp(line, "flush\n")) {
-            pthread_mutex_lock(&ab_mutex);
-            ab_resync();
-            pthread_mutex_unlock(&ab_mutex);
-            if (debug)
-                fprintf(stderr, "FLUSH\n");
+            hairtunes_flush(s);
         }
     }
+    if (replay_name) {  // no controller needed; the replay ends the process
+        pthread_join(s->replay_thread, NULL);
+        s->replay_running = 0;
+    }
+    hairtunes_stop(s);
     fprintf(stderr, "bye!\n");
     fflush(stderr);
 
@@ -248,6 +720,8 @@ int hairtunes_init(char *pAeskey, char *pAesiv, char *fmtpstr, int pCtrlPort, in
 
 #ifdef HAIRTUNES_STANDALONE
 int main(int argc, char **argv) {
+    unsigned char aeskey[16], aesiv[16];
+    int controlport = 0;
     char *hexaeskey = 0, *hexaesiv = 0;
     char *fmtpstr = 0;
     char *arg;
@@ -268,13 +742,13 @@ int main(int argc, char **argv) {
             controlport = atoi(*++argv);
         } else
         if (!strcasecmp(arg, "tport")) {
-            timingport = atoi(*++argv);
+            ++argv;     // timing is not used
         } else
         if (!strcasecmp(arg, "dport")) {
-            dataport = atoi(*++argv);
+            ++argv;     // the data port comes from "port" or "portrange"
         } else
         if (!strcasecmp(arg, "host")) {
-            rtphost = *++argv;
+            ++argv;     // the sender is whoever sends
         } else
         if (!strcasecmp(arg, "pipe")) {
             if (libao_driver || libao_devicename || libao_deviceid ) {
@@ -310,33 +784,48 @@ int main(int argc, char **argv) {
             fancy_resampling = atoi(*++argv);
         }
 #endif
+        else
+        if (hairtunes_option(arg, argv[1])) {
+            argv++;
+        }
     }
 
-    if (!hexaeskey || !hexaesiv)
-        die("Must supply AES key and IV!");
+    if (replay_name) {
+        // key, IV and format come from the capture
+    } else {
+        if (!hexaeskey || !hexaesiv)
+            die("Must supply AES key and IV!");
 
-    if (hex2bin(aesiv, hexaesiv))
-        die("can't understand IV");
-    if (hex2bin(aeskey, hexaeskey))
-        die("can't understand key");
-    return hairtunes_init(NULL, NULL, fmtpstr, controlport, timingport, dataport,
-                    NULL, NULL, NULL, NULL, NULL, START_FILL);
+        if (hex2bin(aesiv, hexaesiv))
+            die("can't understand IV");
+        if (hex2bin(aeskey, hexaeskey))
+            die("can't understand key");
+    }
+    return hairtunes_init((char *)aeskey, (char *)aesiv, fmtpstr, controlport, START_FILL);
 }
 #endif
 
-static void init_buffer(void) {
+static int init_buffer(hairtunes_session_t *s) {
     int i;
     for (i=0; i<BUFFER_FRAMES; i++)
-        audio_buffer[i].data = malloc(OUTFRAME_BYTES);
-    ab_resync();
+        s->audio_buffer[i].data = malloc(OUTFRAME_BYTES(s));
+    ab_resync(s);
+
+    s->clockrec = clockrec_new(clock_type, (double)s->sampling_rate / s->frame_size);
+    if (!s->clockrec) {
+        fprintf(stderr, "can't set up clock recovery\n");
+        return EINVAL;
+    }
+    clockrec_set_limits(s->clockrec, clock_max_ppm, clock_slew);
+    return 0;
 }
 
-static void ab_resync(void) {
+static void ab_resync(hairtunes_session_t *s) {
     int i;
     for (i=0; i<BUFFER_FRAMES; i++)
-        audio_buffer[i].ready = 0;
-    ab_synced = 0;
-    ab_buffering = 1;
+        s->audio_buffer[i].ready = 0;
+    s->ab_synced = 0;
+    s->ab_buffering = 1;
 }
 
 // the sequence numbers will wrap pretty often.
@@ -346,133 +835,189 @@ static inline int seq_order(seq_t a, seq_t b) {
     return d > 0;
 }
 
-static void alac_decode(short *dest, char *buf, int len) {
+static void alac_decode(hairtunes_session_t *s, short *dest, char *buf, int len) {
     unsigned char packet[MAX_PACKET];
     assert(len<=MAX_PACKET);
 
     unsigned char iv[16];
     int aeslen = len & ~0xf;
-    memcpy(iv, aesiv, sizeof(iv));
-    AES_cbc_encrypt((unsigned char*)buf, packet, aeslen, &aes, iv, AES_DECRYPT);
+    memcpy(iv, s->aesiv, sizeof(iv));
+    AES_cbc_encrypt((unsigned char*)buf, packet, aeslen, &s->aes, iv, AES_DECRYPT);
     memcpy(packet+aeslen, buf+aeslen, len-aeslen);
 
     int outsize;
 
-    decode_frame(decoder_info, packet, dest, &outsize);
+    decode_frame(s->decoder_info, packet, dest, &outsize);
 
-    assert(outsize == FRAME_BYTES);
+    assert(outsize == FRAME_BYTES(s));
 }
 
-static void buffer_put_packet(seq_t seqno, char *data, int len) {
+static void buffer_put_packet(hairtunes_session_t *s, seq_t seqno, char *data, int len) {
     abuf_t *abuf = 0;
     short buf_fill;
 
-    pthread_mutex_lock(&ab_mutex);
-    if (!ab_synced) {
-        ab_write = seqno;
-        ab_read = seqno-1;
-        ab_synced = 1;
-    }
-    if (seqno == ab_write+1) {                  // expected packet
-        abuf = audio_buffer + BUFIDX(seqno);
-        ab_write = seqno;
-    } else if (seq_order(ab_write, seqno)) {    // newer than expected
-        rtp_request_resend(ab_write+1, seqno-1);
-        abuf = audio_buffer + BUFIDX(seqno);
-        ab_write = seqno;
-    } else if (seq_order(ab_read, seqno)) {     // late but not yet played
-        abuf = audio_buffer + BUFIDX(seqno);
+    pthread_mutex_lock(&s->ab_mutex);
+    if (!s->ab_synced) {
+        s->ab_write = seqno;
+        s->ab_read = seqno-1;
+        s->ab_synced = 1;
+    }
+    if (seqno == s->ab_write+1) {                   // expected packet
+        abuf = s->audio_buffer + BUFIDX(seqno);
+        s->ab_write = seqno;
+        clock_gettime(CLOCK_MONOTONIC, &s->ab_write_time);
+    } else if (seq_order(s->ab_write, seqno)) {     // newer than expected
+        rtp_request_resend(s, s->ab_write+1, seqno-1);
+        abuf = s->audio_buffer + BUFIDX(seqno);
+        s->ab_write = seqno;
+        clock_gettime(CLOCK_MONOTONIC, &s->ab_write_time);
+    } else if (seq_order(s->ab_read, seqno)) {      // late but not yet played
+        abuf = s->audio_buffer + BUFIDX(seqno);
     } else {    // too late.
-        fprintf(stderr, "\nlate packet %04X (%04X:%04X)\n", seqno, ab_read, ab_write);
+        STAT_ADD(s, late_packets, 1);
+        fprintf(stderr, "\nlate packet %04X (%04X:%04X)\n", seqno, s->ab_read, s->ab_write);
     }
-    buf_fill = ab_write - ab_read;
-    pthread_mutex_unlock(&ab_mutex);
+    buf_fill = s->ab_write - s->ab_read;
+    pthread_mutex_unlock(&s->ab_mutex);
 
     if (abuf) {
-        alac_decode(abuf->data, data, len);
+        alac_decode(s, abuf->data, data, len);
         abuf->ready = 1;
     }
 
-    pthread_mutex_lock(&ab_mutex);
-    if (ab_buffering && buf_fill >= buffer_start_fill) {
-        ab_buffering = 0;
-        pthread_cond_signal(&ab_buffer_ready);
+    pthread_mutex_lock(&s->ab_mutex);
+    if (s->ab_buffering && buf_fill >= s->buffer_start_fill) {
+        s->ab_buffering = 0;
+        pthread_cond_signal(&s->ab_buffer_ready);
     }
-    pthread_mutex_unlock(&ab_mutex);
+    pthread_mutex_unlock(&s->ab_mutex);
 }
 
-static int rtp_sockets[2];  // data, control
-#ifdef AF_INET6
-static struct sockaddr_in6 rtp_client;
-#else
-static struct sockaddr_in rtp_client;
+static ssize_t rtp_recv(hairtunes_session_t *s, int idx, char *packet, size_t len) {
+    struct iovec iov;
+    struct msghdr msg;
+    union {                 // aligned for the cmsghdrs the kernel puts in it
+        char buf[CMSG_SPACE(sizeof(unsigned int))];
+        struct cmsghdr align;
+    } cbuf;
+    ssize_t plen;
+
+    iov.iov_base = packet;
+    iov.iov_len = len;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_name = &s->rtp_client;
+    msg.msg_namelen = sizeof(s->rtp_client);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cbuf.buf;
+    msg.msg_controllen = sizeof(cbuf.buf);
+
+    plen = recvmsg(s->rtp_sockets[idx], &msg, 0);
+
+#ifdef SO_RXQ_OVFL
+    struct cmsghdr *cmsg;
+    for (cmsg = CMSG_FIRSTHDR(&msg); plen >= 0 && cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SO_RXQ_OVFL) {
+            unsigned int drops;
+            memcpy(&drops, CMSG_DATA(cmsg), sizeof(drops));
+            // the kernel reports a running total for the socket
+            STAT_ADD(s, socket_drops, drops - s->rtp_drops[idx]);
+            s->rtp_drops[idx] = drops;
+        }
+    }
 #endif
+    return plen;
+}
 
-static void *rtp_thread_func(void *arg) {
-    socklen_t si_len = sizeof(rtp_client);
-    char packet[MAX_PACKET];
+static void rtp_handle_packet(hairtunes_session_t *s, char *packet, ssize_t plen) {
     char *pktp;
     seq_t seqno;
-    ssize_t plen;
-    int sock = rtp_sockets[0], csock = rtp_sockets[1];
-    int readsock;
     char type;
 
+    type = packet[1] & ~0x80;
+    if (type == 0x60 || type == 0x56) {   // audio data / resend
+        pktp = packet;
+        if (type==0x56) {
+            pktp += 4;
+            plen -= 4;
+        }
+        seqno = ntohs(*(unsigned short *)(pktp+2));
+
+        // adjust pointer and length
+        pktp += 12;
+        plen -= 12;
+
+        // check if packet contains enough content to be reasonable
+        if (plen >= 16) {
+            buffer_put_packet(s, seqno, pktp, plen);
+        } else {
+            // resync?
+            if (type == 0x56 && seqno == 0) {
+                fprintf(stderr, "Suspected resync request packet received. Initiating resync.\n");
+                pthread_mutex_lock(&s->ab_mutex);
+                ab_resync(s);
+                pthread_mutex_unlock(&s->ab_mutex);
+            }
+        }
+    }
+}
+
+static void capture_packet(hairtunes_session_t *s, int idx, char *packet, ssize_t plen);
+
+static void *rtp_thread_func(void *arg) {
+    hairtunes_session_t *s = arg;
+    char packet[MAX_PACKET];
+    ssize_t plen;
+    int sock = s->rtp_sockets[0], csock = s->rtp_sockets[1], wake = s->rtp_wake[0];
+    int readidx, maxfd;
+
+    tune_thread("receive", rtp_cpus, 0);
+    if (rt_mlock)
+        prefault_stack();
+
     fd_set fds;
     FD_ZERO(&fds);
     FD_SET(sock, &fds);
     FD_SET(csock, &fds);
-
-    while (select(csock>sock ? csock+1 : sock+1, &fds, 0, 0, 0)!=-1) {
+    FD_SET(wake, &fds);
+    maxfd = sock > csock ? sock : csock;
+    if (wake > maxfd)
+        maxfd = wake;
+
+    while (select(maxfd+1, &fds, 0, 0, 0)!=-1) {
+        if (FD_ISSET(wake, &fds))
+            break;
         if (FD_ISSET(sock, &fds)) {
-            readsock = sock;
+            readidx = 0;
         } else {
-            readsock = csock;
+            readidx = 1;
         }
         FD_SET(sock, &fds);
         FD_SET(csock, &fds);
+        FD_SET(wake, &fds);
 
-        plen = recvfrom(readsock, packet, sizeof(packet), 0, (struct sockaddr*)&rtp_client, &si_len);
+        plen = rtp_recv(s, readidx, packet, sizeof(packet));
         if (plen < 0)
             continue;
         assert(plen<=MAX_PACKET);
+        STAT_ADD(s, packets, 1);
 
-        type = packet[1] & ~0x80;
-        if (type == 0x60 || type == 0x56) {   // audio data / resend
-            pktp = packet;
-            if (type==0x56) {
-                pktp += 4;
-                plen -= 4;
-            }
-            seqno = ntohs(*(unsigned short *)(pktp+2));
-
-            // adjust pointer and length
-            pktp += 12;
-            plen -= 12;
-
-            // check if packet contains enough content to be reasonable
-            if (plen >= 16) {
-                buffer_put_packet(seqno, pktp, plen);
-            } else {
-                // resync?
-                if (type == 0x56 && seqno == 0) {
-                    fprintf(stderr, "Suspected resync request packet received. Initiating resync.\n");
-                    pthread_mutex_lock(&ab_mutex);
-                    ab_resync();
-                    pthread_mutex_unlock(&ab_mutex);
-                }
-            }
-        }
+        if (s->capture_file)
+            capture_packet(s, readidx, packet, plen);
+        rtp_handle_packet(s, packet, plen);
     }
 
     return 0;
 }
 
-static void rtp_request_resend(seq_t first, seq_t last) {
+static void rtp_request_resend(hairtunes_session_t *s, seq_t first, seq_t last) {
     if (seq_order(last, first))
         return;
 
-    fprintf(stderr, "requesting resend on %d packets (port %d)\n", last-first+1, controlport);
+    fprintf(stderr, "requesting resend on %d packets (port %d)\n", last-first+1, s->controlport);
+    STAT_ADD(s, resend_requests, 1);
+    if (s->rtp_sockets[1] < 0)      // replaying, nobody to ask
+        return;
 
     char req[8];    // *not* a standard RTCP NACK
     req[0] = 0x80;
@@ -482,15 +1027,60 @@ static void rtp_request_resend(seq_t first, seq_t last) {
     *(unsigned short *)(req+6) = htons(last-first+1);  // count
 
 #ifdef AF_INET6
-    rtp_client.sin6_port = htons(controlport);
+    s->rtp_client.sin6_port = htons(s->controlport);
 #else
-    rtp_client.sin_port = htons(controlport);
+    s->rtp_client.sin_port = htons(s->controlport);
 #endif
-    sendto(rtp_sockets[1], req, sizeof(req), 0, (struct sockaddr *)&rtp_client, sizeof(rtp_client));
+    sendto(s->rtp_sockets[1], req, sizeof(req), 0, (struct sockaddr *)&s->rtp_client, sizeof(s->rtp_client));
 }
 
 
-static int init_rtp(void) {
+static void tune_rtp_socket(int sock, int type, int control) {
+    int on = 1;
+
+    if (rtp_rcvbuf > 0) {
+#ifdef SO_RCVBUFFORCE
+        // lets a privileged receiver go beyond net.core.rmem_max
+        if (setsockopt(sock, SOL_SOCKET, SO_RCVBUFFORCE, &rtp_rcvbuf, sizeof(rtp_rcvbuf)) < 0)
+#endif
+        if (setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &rtp_rcvbuf, sizeof(rtp_rcvbuf)) < 0)
+            perror("SO_RCVBUF");
+    }
+#ifdef SO_BUSY_POLL
+    if (rtp_busy_poll > 0 &&
+        setsockopt(sock, SOL_SOCKET, SO_BUSY_POLL, &rtp_busy_poll, sizeof(rtp_busy_poll)) < 0)
+        perror("SO_BUSY_POLL");
+#endif
+#ifdef SO_RXQ_OVFL
+    setsockopt(sock, SOL_SOCKET, SO_RXQ_OVFL, &on, sizeof(on));
+#endif
+    (void)on;
+
+    if (!control)
+        return;
+
+    // resend requests are the only thing we send - let them jump the queue
+#ifdef SO_PRIORITY
+    if (rtp_priority >= 0 &&
+        setsockopt(sock, SOL_SOCKET, SO_PRIORITY, &rtp_priority, sizeof(rtp_priority)) < 0)
+        perror("SO_PRIORITY");
+#endif
+    if (rtp_dscp >= 0) {
+        int tos = rtp_dscp << 2;
+#if defined(AF_INET6) && defined(IPV6_TCLASS)
+        if (type == AF_INET6 &&
+            setsockopt(sock, IPPROTO_IPV6, IPV6_TCLASS, &tos, sizeof(tos)) < 0)
+            perror("IPV6_TCLASS");
+#endif
+        // also applies to v4-mapped peers on a dual-stack socket
+        if (setsockopt(sock, IPPROTO_IP, IP_TOS, &tos, sizeof(tos)) < 0 && type == AF_INET)
+            perror("IP_TOS");
+    }
+}
+
+// bind the data and control sockets, at 'port' if given, else the first
+// free pair in the range. 0 or an errno value.
+static int init_rtp(hairtunes_session_t *s, int assigned, struct hairtunes_ports *ports) {
     struct sockaddr_in si;
     int type = AF_INET;
     struct sockaddr* si_p = (struct sockaddr*)&si;
@@ -521,7 +1111,8 @@ static int init_rtp(void) {
 #endif
 
     int sock = -1, csock = -1;    // data and control (we treat the streams the same here)
-    unsigned short port = 6000;
+    int port = assigned ? assigned : rtp_port_low;
+    int err;
     while(1) {
         if(sock < 0)
             sock = socket(type, SOCK_DGRAM, IPPROTO_UDP);
@@ -535,13 +1126,19 @@ static int init_rtp(void) {
             continue;
         }
 #endif
-        if (sock==-1)
-            die("Can't create data socket!");
+        if (sock==-1) {
+            err = errno;
+            fprintf(stderr, "Can't create data socket!\n");
+            goto fail;
+        }
 
         if(csock < 0)
             csock = socket(type, SOCK_DGRAM, IPPROTO_UDP);
-        if (csock==-1)
-            die("Can't create control socket!");
+        if (csock==-1) {
+            err = errno;
+            fprintf(stderr, "Can't create control socket!\n");
+            goto fail;
+        }
 
         *sin_port = htons(port);
         int bind1 = bind(sock, si_p, si_len);
@@ -552,370 +1149,678 @@ static int init_rtp(void) {
         if(bind1 != -1) { close(sock); sock = -1; }
         if(bind2 != -1) { close(csock); csock = -1; }
 
+        // an assigned pair is not ours to move away from
+        err = EADDRINUSE;
+        if (assigned) {
+            fprintf(stderr, "Assigned RTP ports are in use!\n");
+            goto fail;
+        }
         port += 3;
+        if (port + 1 > rtp_port_high) {
+            fprintf(stderr, "No free RTP ports in range!\n");
+            goto fail;
+        }
     }
 
-    printf("port: %d\n", port); // let our handler know where we end up listening
-    printf("cport: %d\n", port+1);
+    if (pipe(s->rtp_wake) < 0) {
+        err = errno;
+        goto fail;
+    }
 
-    pthread_t rtp_thread;
-    rtp_sockets[0] = sock;
-    rtp_sockets[1] = csock;
-    pthread_create(&rtp_thread, NULL, rtp_thread_func, (void *)rtp_sockets);
+    tune_rtp_socket(sock, type, 0);
+    tune_rtp_socket(csock, type, 1);
 
-    return port;
+    s->rtp_sockets[0] = sock;
+    s->rtp_sockets[1] = csock;
+    ports->data_port = port;
+    ports->control_port = port + 1;
+    return 0;
+
+fail:
+    if (sock >= 0)
+        close(sock);
+    if (csock >= 0)
+        close(csock);
+    return err;
 }
 
-static short lcg_rand(void) {
-	static unsigned long lcg_prev = 12345;
-	lcg_prev = lcg_prev * 69069 + 3;
-	return lcg_prev & 0xffff;
+// Capture file: a header carrying the session key, IV and fmtp, then one
+// record per datagram as received, stamped relative to the first one.
+#define CAPTURE_MAGIC   "HTCAP01"
+
+typedef struct {
+    unsigned long long ns;      // arrival time
+    unsigned short len;
+    unsigned char sock;         // 0 data, 1 control
+    unsigned char pad[5];
+} capture_rec_t;
+
+static long long ns_since(struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1000000000LL + (now.tv_nsec - start->tv_nsec);
 }
 
-static inline short dithered_vol(short sample) {
-    static short rand_a, rand_b;
-    long out;
+static void capture_open(hairtunes_session_t *s, char *fmtpstr) {
+    unsigned short len = strlen(fmtpstr);
 
-    out = (long)sample * fix_volume;
-    if (fix_volume < 0x10000) {
-        rand_b = rand_a;
-        rand_a = lcg_rand();
-        out += rand_a;
-        out -= rand_b;
+    s->capture_file = fopen(capture_name, "wb");
+    if (!s->capture_file) {
+        perror("can't open capture file");
+        return;
     }
-    return out>>16;
+    fwrite(CAPTURE_MAGIC, 1, 8, s->capture_file);
+    fwrite(s->aeskey, 1, sizeof(s->aeskey), s->capture_file);
+    fwrite(s->aesiv, 1, sizeof(s->aesiv), s->capture_file);
+    fwrite(&len, sizeof(len), 1, s->capture_file);
+    fwrite(fmtpstr, 1, len, s->capture_file);
+    clock_gettime(CLOCK_MONOTONIC, &s->capture_start);
 }
 
-typedef struct {
-    double hist[2];
-    double a[2];
-    double b[3];
-} biquad_t;
+// rtp thread only. stdio buffering keeps this to a memcpy most of the time;
+// the tail is flushed when the session stops.
+static void capture_packet(hairtunes_session_t *s, int idx, char *packet, ssize_t plen) {
+    capture_rec_t rec;
+
+    memset(&rec, 0, sizeof(rec));
+    rec.ns = ns_since(&s->capture_start);
+    rec.len = plen;
+    rec.sock = idx;
+    fwrite(&rec, sizeof(rec), 1, s->capture_file);
+    fwrite(packet, 1, plen, s->capture_file);
+}
+
+static char *replay_open(hairtunes_session_t *s) {
+    char magic[8];
+    unsigned short len;
+    char *fmtpstr;
 
-static void biquad_init(biquad_t *bq, double a[], double b[]) {
-    bq->hist[0] = bq->hist[1] = 0.0;
-    memcpy(bq->a, a, 2*sizeof(double));
-    memcpy(bq->b, b, 3*sizeof(double));
+    s->replay_file = fopen(replay_name, "rb");
+    if (!s->replay_file) {
+        perror("can't open replay file");
+        return NULL;
+    }
+    if (fread(magic, 1, 8, s->replay_file) != 8 || memcmp(magic, CAPTURE_MAGIC, 8) ||
+        fread(s->aeskey, 1, sizeof(s->aeskey), s->replay_file) != sizeof(s->aeskey) ||
+        fread(s->aesiv, 1, sizeof(s->aesiv), s->replay_file) != sizeof(s->aesiv) ||
+        fread(&len, sizeof(len), 1, s->replay_file) != 1) {
+        fprintf(stderr, "not a hairtunes capture\n");
+        return NULL;
+    }
+    fmtpstr = malloc(len + 1);
+    if (fread(fmtpstr, 1, len, s->replay_file) != len) {
+        fprintf(stderr, "truncated capture header\n");
+        free(fmtpstr);
+        return NULL;
+    }
+    fmtpstr[len] = 0;
+    srand(0);   // make sample stuffing repeatable
+    return fmtpstr;
 }
 
-static void biquad_lpf(biquad_t *bq, double freq, double Q) {
-    double w0 = 2.0 * M_PI * freq * frame_size / (double)sampling_rate;
-    double alpha = sin(w0)/(2.0*Q);
+static short *buffer_get_frame(hairtunes_session_t *s);
+static int play_frame(hairtunes_session_t *s, short *inbuf);
 
-    double a_0 = 1.0 + alpha;
-    double b[3], a[2];
-    b[0] = (1.0-cos(w0))/(2.0*a_0);
-    b[1] = (1.0-cos(w0))/a_0;
-    b[2] = b[0];
-    a[0] = -2.0*cos(w0)/a_0;
-    a[1] = (1-alpha)/a_0;
+// play frames while at least 'keep' are buffered. with only this thread
+// touching the buffer, buffer_get_frame can't hit an underrun here.
+// 0, or < 0 if the output is gone.
+static int replay_play(hairtunes_session_t *s, int keep) {
+    while (1) {
+        pthread_mutex_lock(&s->ab_mutex);
+        int ready = s->ab_synced && !s->ab_buffering && (short)(s->ab_write - s->ab_read) >= keep;
+        pthread_mutex_unlock(&s->ab_mutex);
+        if (!ready)
+            return 0;
+        if (play_frame(s, buffer_get_frame(s)) < 0) {
+            fprintf(stderr, "lost the output device\n");
+            return -1;
+        }
+    }
+}
 
-    biquad_init(bq, a, b);
+static void *replay_thread_func(void *arg) {
+    hairtunes_session_t *s = arg;
+    capture_rec_t rec;
+    char packet[MAX_PACKET];
+    struct timespec start;
+    unsigned long count = 0;
+
+    // the replay stands in for the receive thread, and at full speed
+    // plays too
+    if (replay_speed <= 0)
+        tune_thread("replay", audio_cpus ? audio_cpus : rtp_cpus, rt_priority);
+    else
+        tune_thread("replay", rtp_cpus, 0);
+    if (rt_mlock)
+        prefault_stack();
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while (!__atomic_load_n(&s->stop, __ATOMIC_ACQUIRE) &&
+           fread(&rec, sizeof(rec), 1, s->replay_file) == 1) {
+        if (rec.len > MAX_PACKET || fread(packet, 1, rec.len, s->replay_file) != rec.len)
+            break;
+
+        if (replay_speed > 0) {
+            long long wait = rec.ns / replay_speed - ns_since(&start);
+            if (wait > 0) {
+                struct timespec ts;
+                ts.tv_sec = wait / 1000000000LL;
+                ts.tv_nsec = wait % 1000000000LL;
+                nanosleep(&ts, NULL);
+            }
+        }
+
+        STAT_ADD(s, packets, 1);
+        count++;
+        rtp_handle_packet(s, packet, rec.len);
+
+        // flat out, this thread also does the audio thread's job, holding
+        // the buffer at its starting fill so runs repeat exactly
+        if (replay_speed <= 0 && replay_play(s, s->buffer_start_fill) < 0)
+            goto out;
+    }
+
+    if (replay_speed <= 0) {
+        replay_play(s, 1);
+    } else {
+        // let the audio thread play out what is left
+        pthread_mutex_lock(&s->ab_mutex);
+        while (!s->stop && s->ab_synced && !s->ab_buffering &&
+               (short)(s->ab_write - s->ab_read) > 0)
+            pthread_cond_wait(&s->ab_space_ready, &s->ab_mutex);
+        pthread_mutex_unlock(&s->ab_mutex);
+    }
+
+    double secs = ns_since(&start) / 1e9;
+    fprintf(stderr, "replay: %lu packets in %.3f s, %.0f ns/packet\n",
+            count, secs, count ? secs * 1e9 / count : 0.0);
+    print_stats(s);
+out:
+    return NULL;
 }
 
-static double biquad_filt(biquad_t *bq, double in) {
-    double w = in - bq->a[0]*bq->hist[0] - bq->a[1]*bq->hist[1];
-    double out = bq->b[1]*bq->hist[0] + bq->b[2]*bq->hist[1] + bq->b[0]*w;
-    bq->hist[1] = bq->hist[0];
-    bq->hist[0] = w;
+// a recent converged drift, for the next session to start from. taken
+// every few seconds so the end of a stream can't spoil it.
+#define DRIFT_SNAPSHOT_FRAMES   1024
 
-    return out;
+int hairtunes_get_drift(hairtunes_session_t *s, double *ppm) {
+    if (!s->bf_have_snapshot)
+        return 0;
+    *ppm = s->bf_drift_snapshot;
+    return 1;
 }
 
-static double bf_playback_rate = 1.0;
+// Declicking at the edges of the audio, only run from the audio
+// thread. Wherever the audio stops (underrun, flush, a muted frame) the
+// output ramps from where it was down to silence, instead of stepping;
+// where it starts again it fades in; and where it jumps from one place to
+// another (an overrun) the step is spread out as a decaying offset. Each
+// of these is a few milliseconds at the start of the next frame, so
+// nothing is held back to do it.
+#define FADE_SAMPLES    128
+
+static inline short fade_clip(int s) {
+    return s < -32768 ? -32768 : s > 32767 ? 32767 : s;
+}
 
-static double bf_est_drift = 0.0;   // local clock is slower by
-static biquad_t bf_drift_lpf;
-static double bf_est_err = 0.0, bf_last_err;
-static biquad_t bf_err_lpf, bf_err_deriv_lpf;
-static double desired_fill;
-static int fill_count;
+// fill 'frame' with silence, leading into it from the last sample
+static void fade_to_silence(hairtunes_session_t *s, short *frame) {
+    int i, n = FADE_SAMPLES < s->frame_size ? FADE_SAMPLES : s->frame_size;
 
-static void bf_est_reset(short fill) {
-    biquad_lpf(&bf_drift_lpf, 1.0/180.0, 0.3);
-    biquad_lpf(&bf_err_lpf, 1.0/10.0, 0.25);
-    biquad_lpf(&bf_err_deriv_lpf, 1.0/2.0, 0.2);
-    fill_count = 0;
-    bf_playback_rate = 1.0;
-    bf_est_err = bf_last_err = 0;
-    desired_fill = fill_count = 0;
+    memset(frame, 0, FRAME_BYTES(s));
+    if (!s->fade_silent) {
+        for (i = 0; i < n; i++) {
+            double w = 1.0 - (i + 1.0) / n;
+            frame[2*i] = s->fade_last[0] * w;
+            frame[2*i+1] = s->fade_last[1] * w;
+        }
+    }
+    s->fade_silent = 1;
+    s->fade_last[0] = s->fade_last[1] = 0;
 }
 
-static void bf_est_update(short fill) {
-    if (fill_count < 1000) {
-        desired_fill += (double)fill/1000.0;
-        fill_count++;
-        return;
+// 'jump': this frame doesn't follow on from the last one
+static void fade_audio(hairtunes_session_t *s, short *frame, int jump) {
+    int i, n = FADE_SAMPLES < s->frame_size ? FADE_SAMPLES : s->frame_size;
+
+    if (s->fade_silent) {
+        for (i = 0; i < n; i++) {
+            double w = (i + 0.5) / n;
+            frame[2*i] *= w;
+            frame[2*i+1] *= w;
+        }
+    } else if (jump) {
+        int d0 = s->fade_last[0] - frame[0], d1 = s->fade_last[1] - frame[1];
+        for (i = 0; i < n; i++) {
+            double w = 1.0 - (i + 1.0) / n;
+            frame[2*i] = fade_clip(frame[2*i] + d0 * w);
+            frame[2*i+1] = fade_clip(frame[2*i+1] + d1 * w);
+        }
     }
+    s->fade_silent = 0;
+    s->fade_last[0] = frame[2*s->frame_size-2];
+    s->fade_last[1] = frame[2*s->frame_size-1];
+}
 
-#define CONTROL_A   (1e-4)
-#define CONTROL_B   (1e-1)
+// Packet loss concealment, only ever run from the audio thread.
+// A lost frame is filled by repeating the last pitch period of the
+// previous frame (found by cross-correlating its tail), fading to silence
+// over a few frames; the first frame after the loss is crossfaded in from
+// the continued repetition.
+#define PLC_OLA         64      // match window and crossfade length, samples
+#define PLC_MIN_PERIOD  32
+#define PLC_FADE_FRAMES 3       // concealed frames after the first one
+
+static void plc_reset(hairtunes_session_t *s) {
+    s->plc_have_hist = 0;
+    s->plc_lost = 0;
+}
 
-    double buf_delta = fill - desired_fill;
-    bf_est_err = biquad_filt(&bf_err_lpf, buf_delta);
-    double err_deriv = biquad_filt(&bf_err_deriv_lpf, bf_est_err - bf_last_err);
-    double adj_error = CONTROL_A * bf_est_err;
+// a frame too short to hold a period plus the match window gets the
+// plain fade instead
+static inline int plc_active(hairtunes_session_t *s) {
+    return plc_enabled && s->frame_size >= PLC_OLA + PLC_MIN_PERIOD;
+}
 
-    bf_est_drift = biquad_filt(&bf_drift_lpf, CONTROL_B*(adj_error + err_deriv) + bf_est_drift);
+// find the lag whose preceding samples best match the tail of the history
+static int plc_find_period(hairtunes_session_t *s) {
+    int n = s->frame_size;
+    int lag, i, best = PLC_MIN_PERIOD;
+    double best_score = -1.0;
+
+    for (lag = PLC_MIN_PERIOD; lag <= n - PLC_OLA; lag++) {
+        double xy = 0.0, yy = 1.0;
+        short *x = s->plc_hist + 2*(n - PLC_OLA);
+        short *y = x - 2*lag;
+        for (i = 0; i < 2*PLC_OLA; i += 2) {
+            double a = (double)x[i] + x[i+1];
+            double b = (double)y[i] + y[i+1];
+            xy += a*b;
+            yy += b*b;
+        }
+        double score = xy / sqrt(yy);
+        if (score > best_score) {
+            best_score = score;
+            best = lag;
+        }
+    }
+    return best;
+}
 
-    if (debug)
-        fprintf(stderr, "bf %d err %f drift %f desiring %f ed %f estd %f\n",
-                fill, bf_est_err, bf_est_drift, desired_fill, err_deriv, err_deriv + adj_error);
-    bf_playback_rate = 1.0 + adj_error + bf_est_drift;
+// next stereo sample of the periodic extension of the history
+static inline short *plc_next(hairtunes_session_t *s) {
+    short *p = s->plc_hist + 2*(s->frame_size - s->plc_period + s->plc_pos);
+    if (++s->plc_pos == s->plc_period)
+        s->plc_pos = 0;
+    return p;
+}
+
+static void plc_conceal(hairtunes_session_t *s, short *frame) {
+    int i;
+
+    if (!plc_active(s) || !s->plc_have_hist || s->plc_lost > PLC_FADE_FRAMES) {
+        fade_to_silence(s, frame);
+        s->plc_lost++;
+        return;
+    }
+    if (!s->plc_lost) {
+        s->plc_period = plc_find_period(s);
+        s->plc_pos = 0;
+    }
+
+    // full level for the first frame, then a linear fade over the rest
+    double gain = 1.0, step = 0.0;
+    if (s->plc_lost) {
+        gain = 1.0 - (double)(s->plc_lost-1)/PLC_FADE_FRAMES;
+        step = 1.0 / (PLC_FADE_FRAMES * s->frame_size);
+    }
+    for (i = 0; i < s->frame_size; i++) {
+        short *p = plc_next(s);
+        frame[2*i] = p[0] * gain;
+        frame[2*i+1] = p[1] * gain;
+        gain -= step;
+    }
+    STAT_ADD(s, concealed_frames, 1);
+    s->plc_lost++;
+}
+
+static void plc_good_frame(hairtunes_session_t *s, short *frame) {
+    int i;
 
-    bf_last_err = bf_est_err;
+    if (plc_active(s) && s->plc_have_hist && s->plc_lost) {
+        // level the repetition would have reached by now
+        double gain = 1.0 - (double)(s->plc_lost-1)/PLC_FADE_FRAMES;
+        if (gain < 0.0)
+            gain = 0.0;
+        for (i = 0; i < PLC_OLA; i++) {
+            short *p = plc_next(s);
+            double w = (i + 0.5) / PLC_OLA;
+            frame[2*i] = frame[2*i]*w + p[0]*gain*(1.0-w);
+            frame[2*i+1] = frame[2*i+1]*w + p[1]*gain*(1.0-w);
+        }
+    }
+    if (!s->plc_hist)
+        s->plc_hist = malloc(FRAME_BYTES(s));
+    memcpy(s->plc_hist, frame, FRAME_BYTES(s));
+    s->plc_have_hist = 1;
+    s->plc_lost = 0;
+}
+
+// audio handed to the output but not yet played, in frames, where the
+// output can say
+static double output_delay(hairtunes_session_t *s) {
+    int delay = audio_delay(s->output);
+    if (delay > 0)
+        return (double)delay / s->frame_size;
+    return 0;
 }
 
 // get the next frame, when available. return 0 if underrun/stream reset.
-static short *buffer_get_frame(void) {
+static short *buffer_get_frame(hairtunes_session_t *s) {
     short buf_fill;
     seq_t read;
     abuf_t *abuf = 0;
     unsigned short next;
-    int i;
-
-    pthread_mutex_lock(&ab_mutex);
-
-    buf_fill = ab_write - ab_read;
-    if (buf_fill < 1 || !ab_synced || ab_buffering) {    // init or underrun. stop and wait
-        if (ab_synced)
+    int i, jump = 0;
+
+    pthread_mutex_lock(&s->ab_mutex);
+
+    buf_fill = s->ab_write - s->ab_read;
+    if (buf_fill < 1 || !s->ab_synced || s->ab_buffering) {    // init or underrun. stop and wait
+        if (!s->fade_silent) {
+            // one more frame first, for the output to fade out on
+            pthread_mutex_unlock(&s->ab_mutex);
+            if (!s->fade_buf)
+                s->fade_buf = malloc(FRAME_BYTES(s));
+            fade_to_silence(s, s->fade_buf);
+            return s->fade_buf;
+        }
+        if (s->ab_synced) {
+            STAT_ADD(s, underruns, 1);
             fprintf(stderr, "\nunderrun.\n");
+        }
 
-        ab_buffering = 1;
-        pthread_cond_wait(&ab_buffer_ready, &ab_mutex);
-        ab_read++;
-        buf_fill = ab_write - ab_read;
-        bf_est_reset(buf_fill);
-        pthread_mutex_unlock(&ab_mutex);
-
+        s->ab_buffering = 1;
+        if (!s->out_paused) {
+            // nothing to play until the buffer refills. the output may
+            // take a while to stop, so not with the receive side locked out
+            pthread_mutex_unlock(&s->ab_mutex);
+            s->out_paused = audio_pause(s->output, 1);
+            pthread_mutex_lock(&s->ab_mutex);
+        }
+        if (!s->stop && s->ab_buffering)
+            pthread_cond_wait(&s->ab_buffer_ready, &s->ab_mutex);
+        s->ab_read++;
+        clockrec_reset(s->clockrec);
+        s->bf_playback_rate = 1.0;
+        pthread_mutex_unlock(&s->ab_mutex);
+
+        plc_reset(s);
         return 0;
     }
     if (buf_fill >= BUFFER_FRAMES) {   // overrunning! uh-oh. restart at a sane distance
+        STAT_ADD(s, overruns, 1);
         fprintf(stderr, "\noverrun.\n");
-        ab_read = ab_write - buffer_start_fill;
+        s->ab_read = s->ab_write - s->buffer_start_fill;
+        jump = 1;
+    }
+    read = s->ab_read;
+    s->ab_read++;
+    pthread_cond_signal(&s->ab_space_ready);
+    buf_fill = s->ab_write - s->ab_read;
+
+    // the fill only moves in whole frames; the time since the newest
+    // packet came in says how far the sender has got into the next one
+    double frame_ns = 1e9 * s->frame_size / s->sampling_rate;
+    double since = ns_since(&s->ab_write_time) / frame_ns;
+    if (since < 0)
+        since = 0;
+    if (since > 1)
+        since = 1;
+    // what the device has queued counts too: the sender's audio isn't
+    // played until it drains
+    s->bf_playback_rate = clockrec_update(s->clockrec, buf_fill + since + output_delay(s));
+    if (debug || ++s->bf_snapshot_count >= DRIFT_SNAPSHOT_FRAMES) {
+        clockrec_state_t cs;
+        clockrec_get_state(s->clockrec, &cs);
+        if (debug)
+            fprintf(stderr, "bf %d drift %f rate %f err %f%s\n",
+                    buf_fill, cs.ppm, cs.rate_ppm, cs.err, cs.locked ? " locked" : "");
+        if (s->bf_snapshot_count >= DRIFT_SNAPSHOT_FRAMES) {
+            s->bf_snapshot_count = 0;
+            if (cs.locked) {
+                s->bf_drift_snapshot = cs.ppm;
+                s->bf_have_snapshot = 1;
+            }
+        }
     }
-    read = ab_read;
-    ab_read++;
-    buf_fill = ab_write - ab_read;
-    bf_est_update(buf_fill);
 
     // check if t+16, t+32, t+64, t+128, ... (START_FILL / 2)
     // packets have arrived... last-chance resend
-    if (!ab_buffering) {
+    if (!s->ab_buffering) {
         for (i = 16; i < (START_FILL / 2); i = (i * 2)) {
-            next = ab_read + i;
-            abuf = audio_buffer + BUFIDX(next);
+            next = s->ab_read + i;
+            abuf = s->audio_buffer + BUFIDX(next);
             if (!abuf->ready) {
-                rtp_request_resend(next, next);
+                rtp_request_resend(s, next, next);
             }
         }
     }
 
-    abuf_t *curframe = audio_buffer + BUFIDX(read);
-    if (!curframe->ready) {
+    abuf_t *curframe = s->audio_buffer + BUFIDX(read);
+    int missing = !curframe->ready;
+    if (missing) {
+        STAT_ADD(s, missing_frames, 1);
         fprintf(stderr, "\nmissing frame.\n");
-        memset(curframe->data, 0, FRAME_BYTES);
     }
     curframe->ready = 0;
-    pthread_mutex_unlock(&ab_mutex);
+    pthread_mutex_unlock(&s->ab_mutex);
+
+    if (missing)
+        plc_conceal(s, curframe->data);
+    else
+        plc_good_frame(s, curframe->data);
+    // a muted frame has faded itself out
+    if (!missing || !s->fade_silent)
+        fade_audio(s, curframe->data, jump);
 
     return curframe->data;
 }
 
-static int stuff_buffer(double playback_rate, short *inptr, short *outptr) {
-    int i;
-    int stuffsamp = frame_size;
-    int stuff = 0;
-    double p_stuff;
-
-    p_stuff = 1.0 - pow(1.0 - fabs(playback_rate-1.0), frame_size);
+static int init_play(hairtunes_session_t *s) {
+    s->outbuf = malloc(OUTFRAME_BYTES(s));
 
-    if (rand() < p_stuff * RAND_MAX) {
-        stuff = playback_rate > 1.0 ? -1 : 1;
-        stuffsamp = rand() % (frame_size - 1);
-    }
-
-    pthread_mutex_lock(&vol_mutex);
-    for (i=0; i<stuffsamp; i++) {   // the whole frame, if no stuffing
-        *outptr++ = dithered_vol(*inptr++);
-        *outptr++ = dithered_vol(*inptr++);
-    };
-    if (stuff) {
-        if (stuff==1) {
-            if (debug)
-                fprintf(stderr, "+++++++++\n");
-            // interpolate one sample
-            *outptr++ = dithered_vol(((long)inptr[-2] + (long)inptr[0]) >> 1);
-            *outptr++ = dithered_vol(((long)inptr[-1] + (long)inptr[1]) >> 1);
-        } else if (stuff==-1) {
-            if (debug)
-                fprintf(stderr, "---------\n");
-            inptr++;
-            inptr++;
-        }
-        for (i=stuffsamp; i<frame_size + stuff; i++) {
-            *outptr++ = dithered_vol(*inptr++);
-            *outptr++ = dithered_vol(*inptr++);
-        }
+    s->resampler = resampler_new(resample_mode, s->frame_size);
+    if (!s->resampler) {
+        fprintf(stderr, "can't set up resampler\n");
+        return ENOMEM;
     }
-    pthread_mutex_unlock(&vol_mutex);
+    resampler_set_budget(s->resampler, resample_budget * 1000L);
 
-    return frame_size + stuff;
-}
+    s->vol = volume_new(s->sampling_rate);
 
-static void *audio_thread_func(void *arg) {
-    ao_device* dev = arg;
-    int play_samples;
-
-    signed short buf_fill __attribute__((unused));
-    signed short *inbuf, *outbuf, *silence;
-    outbuf = malloc(OUTFRAME_BYTES);
-    silence = malloc(OUTFRAME_BYTES);
-    int i;
-
-    for (i=0; i<OUTFRAME_BYTES/2; i++) {
-        silence[i] = 0;
+    if (dsp_eq_spec || dsp_loudness_strength > 0 || dsp_limit) {
+        s->dsp = dsp_new(s->sampling_rate, OUTFRAME_BYTES(s)/4);
+        if (dsp_eq_spec && dsp_eq(s->dsp, dsp_eq_spec) < 0) {
+            // fine at 44.1 kHz, but a band above this stream's Nyquist
+            fprintf(stderr, "eq doesn't fit %d Hz\n", s->sampling_rate);
+            return EINVAL;
+        }
+        dsp_loudness(s->dsp, dsp_loudness_strength);
+        if (dsp_limit)
+            dsp_limiter(s->dsp, dsp_limiter_db);
     }
 
 #ifdef FANCY_RESAMPLING
-    float *frame, *outframe;
-    SRC_DATA srcdat;
     if (fancy_resampling) {
-        frame = malloc(frame_size*2*sizeof(float));
-        outframe = malloc(2*frame_size*2*sizeof(float));
-
-        srcdat.data_in = frame;
-        srcdat.data_out = outframe;
-        srcdat.input_frames = FRAME_BYTES;
-        srcdat.output_frames = 2*FRAME_BYTES;
-        srcdat.src_ratio = 1.0;
-        srcdat.end_of_input = 0;
+        s->frame = malloc(s->frame_size*2*sizeof(float));
+        s->outframe = malloc(2*s->frame_size*2*sizeof(float));
+
+        s->srcdat.data_in = s->frame;
+        s->srcdat.data_out = s->outframe;
+        s->srcdat.input_frames = FRAME_BYTES(s);
+        s->srcdat.output_frames = 2*FRAME_BYTES(s);
+        s->srcdat.src_ratio = 1.0;
+        s->srcdat.end_of_input = 0;
     }
 #endif
+    return 0;
+}
 
-    while (1) {
-       if (ab_buffering) {
-           inbuf = silence;
-       } else {
-            do {
-                inbuf = buffer_get_frame();
-            } while (!inbuf);
-       }
+// resample one frame and hand it to the output. 0, or < 0 if the output
+// is gone.
+static int play_frame(hairtunes_session_t *s, short *inbuf) {
+    int play_samples;
+
+    if (s->out_paused) {
+        audio_pause(s->output, 0);
+        s->out_paused = 0;
+    }
 
 #ifdef FANCY_RESAMPLING
         if (fancy_resampling) {
             int i;
-            pthread_mutex_lock(&vol_mutex);
-            for (i=0; i<2*FRAME_BYTES; i++) {
-                frame[i] = (float)inbuf[i] / 32768.0;
-                frame[i] *= volume;
-            }
-            pthread_mutex_unlock(&vol_mutex);
-            srcdat.src_ratio = bf_playback_rate;
-            src_process(src, &srcdat);
-            assert(srcdat.input_frames_used == FRAME_BYTES);
-            src_float_to_short_array(outframe, outbuf, FRAME_BYTES*2);
-            play_samples = srcdat.output_frames_gen;
+            for (i=0; i<2*FRAME_BYTES(s); i++)
+                s->frame[i] = (float)inbuf[i] / 32768.0;
+            s->srcdat.src_ratio = s->bf_playback_rate;
+            src_process(s->src, &s->srcdat);
+            assert(s->srcdat.input_frames_used == FRAME_BYTES(s));
+            src_float_to_short_array(s->outframe, s->outbuf, FRAME_BYTES(s)*2);
+            play_samples = s->srcdat.output_frames_gen;
         } else
 #endif
 
-            play_samples = stuff_buffer(bf_playback_rate, inbuf, outbuf);
-
-        if (pipename) {
-            if (pipe_handle == -1) {
-                // attempt to open pipe - block if there are no readers
-                pipe_handle = open(pipename, O_WRONLY);
-            }
-
-            // only write if pipe open (there's a reader)
-            if (pipe_handle != -1) {
-                 if (write(pipe_handle, outbuf, play_samples*4) == -1) {
-                    // write failed - do anything here?
-                    // SIGPIPE is handled elsewhere...
-                 }
-            }
-        } else {
-            ao_play(dev, (char *)outbuf, play_samples*4);
+        {
+            play_samples = resampler_process(s->resampler, s->bf_playback_rate, inbuf, s->frame_size,
+                                             s->outbuf, OUTFRAME_BYTES(s)/4);
         }
-    }
-
-    return 0;
-}
 
-#define NUM_CHANNELS 2
+        if (s->dsp)
+            dsp_process(s->dsp, s->vol, s->outbuf, play_samples);
+        else
+            volume_apply(s->vol, s->outbuf, play_samples);
 
-static void handle_broken_fifo() {
-    close(pipe_handle);
-    pipe_handle = -1;
+        return audio_play(s->output, s->outbuf, play_samples);
 }
 
-static void init_pipe(const char* pipe) {
-    // make the FIFO and catch the broken pipe signal
-    mknod(pipe, S_IFIFO | 0644, 0);
-    signal(SIGPIPE, handle_broken_fifo);
-}
+static void *audio_thread_func(void *arg) {
+    hairtunes_session_t *s = arg;
+    signed short *inbuf, *silence;
+    silence = malloc(OUTFRAME_BYTES(s));
+    int i, buffering = 1;
 
-static void* init_ao(void) {
-    ao_initialize();
+    tune_thread("audio", audio_cpus, rt_priority);
+    if (rt_mlock)
+        prefault_stack();
 
-    int driver;
-    if (libao_driver) {
-        // if a libao driver is specified on the command line, use that
-        driver = ao_driver_id(libao_driver);
-        if (driver == -1) {
-            die("Could not find requested ao driver");
-        }
-    } else {
-        // otherwise choose the default
-        driver = ao_default_driver_id();
+    for (i=0; i<OUTFRAME_BYTES(s)/2; i++) {
+        silence[i] = 0;
     }
 
-    ao_sample_format fmt;
-    memset(&fmt, 0, sizeof(fmt));
-
-    fmt.bits = 16;
-    fmt.rate = sampling_rate;
-    fmt.channels = NUM_CHANNELS;
-    fmt.byte_format = AO_FMT_NATIVE;
+    while (!stopping(s)) {
+       if (s->ab_buffering) {
+           // a flush or an underrun: what the resampler holds back belongs
+           // to the old stream. dropped here, as only this thread uses it
+           if (!buffering)
+               resampler_reset(s->resampler);
+           buffering = 1;
+           // once faded out, stop an output that can stop, rather than
+           // keep it going on silence
+           if (s->fade_silent && !s->out_paused)
+               s->out_paused = audio_pause(s->output, 1);
+           if (s->out_paused) {
+               pthread_mutex_lock(&s->ab_mutex);
+               while (!s->stop && s->ab_buffering)
+                   pthread_cond_wait(&s->ab_buffer_ready, &s->ab_mutex);
+               pthread_mutex_unlock(&s->ab_mutex);
+               continue;
+           }
+           fade_to_silence(s, silence);
+           inbuf = silence;
+       } else {
+            buffering = 0;
+            do {
+                inbuf = buffer_get_frame(s);
+            } while (!inbuf && !stopping(s));
+            if (!inbuf)
+                break;
+       }
 
-    ao_option *ao_opts = NULL;
-    if(libao_deviceid) {
-        ao_append_option(&ao_opts, "id", libao_deviceid);
-    } else if(libao_devicename){
-        ao_append_option(&ao_opts, "dev", libao_devicename);
-        // Old libao versions (for example, 0.8.8) only support
-        // "dsp" instead of "dev".
-        ao_append_option(&ao_opts, "dsp", libao_devicename);
+       if (play_frame(s, inbuf) < 0) {
+           // the rest of the process carries on; this stream goes quiet
+           fprintf(stderr, "lost the output device\n");
+           break;
+       }
     }
 
-    ao_device *dev = ao_open_live(driver, &fmt, ao_opts);
-    if (dev == NULL) {
-        die("Could not open ao device");
-    }
+    free(silence);
+    return 0;
+}
 
-    return dev;
+// the outputs are set up once, for every session to open in turn; the
+// options are all in by the time the first one starts
+static void init_outputs_once(void) {
+    if (pipename)
+        audio_option("pipe", pipename);
+    if (libao_driver)
+        audio_option("ao_driver", libao_driver);
+    if (libao_devicename)
+        audio_option("ao_devicename", libao_devicename);
+    if (libao_deviceid)
+        audio_option("ao_deviceid", libao_deviceid);
+    if (!output_count)
+        output_backend[output_count++] = pipename ? &audio_pipe : &audio_ao;
 }
 
-static int init_output(void) {
-    void* arg = 0;
+int hairtunes_output_shared(void) {
+    int i;
 
-    if (pipename) {
-        init_pipe(pipename);
-    } else {
-        arg = init_ao();
+    pthread_once(&output_once, init_outputs_once);
+    // one capture or replay file between them won't do either
+    if (capture_name || replay_name)
+        return 0;
+    for (i=0; i<output_count; i++)
+        if (!output_backend[i]->shared)
+            return 0;
+    return 1;
+}
+
+static int init_output(hairtunes_session_t *s) {
+    audio_format_t fmt;
+    int i;
+
+    pthread_once(&output_once, init_outputs_once);
+    for (i=0; i<output_count; i++) {
+        memset(&fmt, 0, sizeof(fmt));
+        fmt.rate = s->sampling_rate;
+        fmt.channels = 2;
+        fmt.bits = 16;
+        if (!i) {
+            s->output = audio_open(output_backend[i], &fmt);
+            if (s->output)
+                continue;
+        } else if (audio_add(s->output, output_backend[i], &fmt, output_queue)) {
+            continue;
+        }
+
+        if (fmt.rate != s->sampling_rate || fmt.channels != 2 || fmt.bits != 16)
+            fprintf(stderr, "%s output can't play %d Hz stereo 16-bit (offers %d Hz, %d channels, %d-bit)\n",
+                    output_backend[i]->name, s->sampling_rate, fmt.rate, fmt.channels, fmt.bits);
+        if (!i) {
+            fprintf(stderr, "Could not open output\n");
+            return EIO;
+        }
+        // the others are extras; play without this one
+        fprintf(stderr, "Could not open %s output\n", output_backend[i]->name);
     }
 
 #ifdef FANCY_RESAMPLING
     int err;
     if (fancy_resampling)
-        src = src_new(SRC_SINC_MEDIUM_QUALITY, 2, &err);
+        s->src = src_new(SRC_SINC_MEDIUM_QUALITY, 2, &err);
     else
-        src = 0;
+        s->src = 0;
 #endif
 
-    pthread_t audio_thread;
-    pthread_create(&audio_thread, NULL, audio_thread_func, arg);
-
-    return 0;
+    return init_play(s);
 }
-
@@ -1,11 +1,61 @@
 #ifndef _HAIRTUNES_H_
 #define _HAIRTUNES_H_
-int hairtunes_init(char *pAeskey, char *pAesiv, char *fmtpstr, int pCtrlPort, int pTimingPort,
-         int pDataPort, char *pRtpHost, char*pPipeName, char *pLibaoDriver, char *pLibaoDeviceName, char *pLibaoDeviceId,
-         int bufStartFill);
+// run one session on stdin commands ("vol: -15.0", "flush", "stats",
+// "exit"), reporting its ports as the "portfd" option says
+int hairtunes_init(char *pAeskey, char *pAesiv, char *fmtpstr, int pCtrlPort, int bufStartFill);
+
+// set a decoder tunable by name; call before starting any session.
+// returns 0 if the name is not known.
+int hairtunes_option(char *name, char *value);
+
+// The outputs are set by the options, once for the whole process, so
+// every session plays to the same device, pipe or file. Returns whether
+// they can take more than one session at a time; if not, the caller is
+// to let only one play at once.
+int hairtunes_output_shared(void);
+
+// written to the "portfd" descriptor once the RTP sockets are bound,
+// in place of the "port: N" lines on stdout
+struct hairtunes_ports {
+    int status;         // 0 on success, otherwise an errno value
+    int data_port;
+    int control_port;
+};
+
+// A session is one stream, from SETUP to TEARDOWN: its own sockets,
+// buffer, decoder, clock recovery and outputs, and its own receive and
+// audio threads. Any number can run in one process, as far as the
+// outputs allow.
+typedef struct hairtunes_session hairtunes_session_t;
+
+struct hairtunes_setup {
+    char *aeskey;       // 16 bytes
+    char *aesiv;        // 16 bytes
+    char *fmtp;         // the a=fmtp line, from the first number on
+    int control_port;   // the sender's, for resend requests
+    int data_port;      // to bind, 0 for the "port" option or the range
+    int drift_known;    // start clock recovery from 'drift' (ppm)
+    double drift;
+    int start_fill;     // frames, < 0 for the default
+};
+
+// NULL on failure, with the reason in ports->status
+hairtunes_session_t *hairtunes_start(struct hairtunes_setup *setup, struct hairtunes_ports *ports);
+
+// volume in dB, 0 down to -144 (muted)
+void hairtunes_volume(hairtunes_session_t *s, double db);
+void hairtunes_flush(hairtunes_session_t *s);
+
+// the sender clock drift learned by the session, in ppm, once it has
+// converged; returns 0 if it hasn't. pass it back in the setup to start
+// the next session from it.
+int hairtunes_get_drift(hairtunes_session_t *s, double *ppm);
+
+// stop the threads, close the outputs and free the session
+void hairtunes_stop(hairtunes_session_t *s);
 
 // default buffer size
 // needs to be a power of 2 because of the way BUFIDX(seqno) works
 #define BUFFER_FRAMES  512
 
-#endif 
+#endif
@@ -0,0 +1,542 @@
+/*
+ * RAOPSim - local RAOP sender for load-testing ShairPort
+ * Copyright (c) ShairPort contributors 2012
+ * All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+// Plays the part of iTunes: runs the RTSP exchange that shairport's
+// parseMessage handles, then streams AES-encrypted ALAC frames over UDP
+// with configurable loss, jitter, reordering and clock skew, answering
+// resend requests from a history of sent packets. Several sessions can
+// run in parallel to load a single receiver.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <math.h>
+#include <time.h>
+#include <poll.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <openssl/aes.h>
+#include <openssl/rsa.h>
+#include <openssl/pem.h>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+
+#define FRAME_SIZE      352
+#define SAMPLING_RATE   44100
+#define FMTP            "96 352 0 16 40 10 14 2 255 0 0 44100"
+#define MAX_PACKET      2048
+#define HISTORY         512     // packets kept for resends
+#define MAX_PENDING     256     // packets held back by jitter/reordering
+
+// the public half of the key shairport decrypts the AES key with
+#define AIRPORT_PUBLIC_KEY \
+"-----BEGIN PUBLIC KEY-----\n" \
+"MIIBIjANBgkqhkiG9w0BAQEFAAOCAQ8AMIIBCgKCAQEA59dE8qLieItsH1WgjrcF\n" \
+"RKj6eUWqi+bGLOX1HL3U3GhC/j0Qg90u3sG/1CUtwC5vOYvfDmFI6oSFXi5ELabW\n" \
+"JmT2dKHzBJKa3k9ok+8t9ucRqMd6DZHJ2YCCLlDRKSKv6kDqnw4UwPdpOMXziC/A\n" \
+"Mj3Z/lUVX1G7WSHCAWKf1zNS1eLvqr+boEjXuBOitnZ/bDzPHrTOZz0Dew0uowxf\n" \
+"/+sG+NCK3eQJVxqcaJ/vEHKIVd2M+5qL71yJQ+87X6oV3eaYvt3zWZYD6z5vYTcr\n" \
+"tij2VZ9Zmni/UAaHqn9JdsBWLUEpVviYnhimNVvYFZeCXg/IdTQ+x4IRdiXNv5hE\n" \
+"ewIDAQAB\n" \
+"-----END PUBLIC KEY-----\n"
+
+// options (constant once the sessions start)
+static char *host = "127.0.0.1";
+static char *rtsp_port = "5002";
+static int sessions = 1;
+static double duration = 10.0;      // seconds of audio per session
+static double loss = 0.0;           // probability a packet is never sent
+static double jitter = 0.0;         // max extra send delay, seconds
+static double reorder = 0.0;        // probability a packet is held back a frame
+static double skew_ppm = 0.0;       // sender clock is fast by
+static double flush_every = 0.0;    // seconds between FLUSHes, 0 for none
+static double volume_db = -15.0;
+static int verbose = 0;
+
+typedef struct {
+    unsigned long sent, dropped, reordered, resend_requests, resent, missed_resends;
+} sim_stats_t;
+
+static sim_stats_t totals;
+static pthread_mutex_t totals_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+typedef struct {
+    double when;
+    int len;
+    char data[MAX_PACKET];
+} pending_t;
+
+typedef struct {
+    int id;
+    int rtsp;
+    int cseq;
+    int dsock, csock;
+    struct sockaddr_storage server;
+    socklen_t server_len;
+    int server_port;
+
+    unsigned char aeskey[16], aesiv[16];
+    AES_KEY aes;
+
+    unsigned short seq;
+    unsigned int rtptime, ssrc;
+    double phase;
+
+    struct {
+        int len;
+        unsigned short seq;
+        char data[MAX_PACKET];
+    } history[HISTORY];
+    pending_t pending[MAX_PENDING];
+    int npending;
+
+    sim_stats_t stats;
+} session_t;
+
+static void die(char *why) {
+    fprintf(stderr, "FATAL: %s\n", why);
+    exit(1);
+}
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double frand(void) {
+    return (double)random() / RAND_MAX;
+}
+
+// base64 without the trailing '=', as iTunes sends it
+static void base64(char *out, unsigned char *in, int len) {
+    int n = EVP_EncodeBlock((unsigned char *)out, in, len);
+    while (n > 0 && out[n-1] == '=')
+        out[--n] = 0;
+}
+
+static int rtsp_request(session_t *s, char *method, char *headers, char *body, char *resp, int resplen) {
+    char req[4096];
+    int len, got = 0, n;
+
+    len = snprintf(req, sizeof(req),
+                   "%s rtsp://127.0.0.1/%u RTSP/1.0\r\n"
+                   "CSeq: %d\r\n"
+                   "User-Agent: raopsim\r\n"
+                   "%s"
+                   "Content-Length: %d\r\n"
+                   "\r\n"
+                   "%s",
+                   method, s->ssrc, ++s->cseq, headers ? headers : "",
+                   body ? (int)strlen(body) : 0, body ? body : "");
+    if (write(s->rtsp, req, len) != len)
+        return -1;
+
+    // responses from shairport carry no body
+    while (got < resplen - 1) {
+        n = read(s->rtsp, resp + got, resplen - 1 - got);
+        if (n <= 0)
+            return -1;
+        got += n;
+        resp[got] = 0;
+        if (strstr(resp, "\r\n\r\n"))
+            break;
+    }
+    if (verbose)
+        fprintf(stderr, "[%d] %s -> %.*s\n", s->id, method, (int)strcspn(resp, "\r"), resp);
+    return strncmp(resp, "RTSP/1.0 200", 12) ? -1 : 0;
+}
+
+static int rtsp_connect(session_t *s) {
+    struct addrinfo hints, *ai;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host, rtsp_port, &hints, &ai))
+        return -1;
+    s->rtsp = socket(ai->ai_family, ai->ai_socktype, 0);
+    if (s->rtsp < 0 || connect(s->rtsp, ai->ai_addr, ai->ai_addrlen) < 0) {
+        freeaddrinfo(ai);
+        return -1;
+    }
+    memcpy(&s->server, ai->ai_addr, ai->ai_addrlen);
+    s->server_len = ai->ai_addrlen;
+    freeaddrinfo(ai);
+    return 0;
+}
+
+static int udp_socket(session_t *s, int *port) {
+    struct sockaddr_storage addr;
+    socklen_t len = s->server_len;
+    int sock = socket(s->server.ss_family, SOCK_DGRAM, 0);
+
+    memcpy(&addr, &s->server, len);
+    if (addr.ss_family == AF_INET)
+        ((struct sockaddr_in *)&addr)->sin_port = 0;
+    else
+        ((struct sockaddr_in6 *)&addr)->sin6_port = 0;
+    if (sock < 0 || bind(sock, (struct sockaddr *)&addr, len) < 0)
+        return -1;
+    getsockname(sock, (struct sockaddr *)&addr, &len);
+    *port = ntohs(addr.ss_family == AF_INET ? ((struct sockaddr_in *)&addr)->sin_port
+                                            : ((struct sockaddr_in6 *)&addr)->sin6_port);
+    return sock;
+}
+
+static void send_to_server(session_t *s, int sock, int port, char *data, int len) {
+    struct sockaddr_storage addr;
+    memcpy(&addr, &s->server, s->server_len);
+    if (addr.ss_family == AF_INET)
+        ((struct sockaddr_in *)&addr)->sin_port = htons(port);
+    else
+        ((struct sockaddr_in6 *)&addr)->sin6_port = htons(port);
+    sendto(sock, data, len, 0, (struct sockaddr *)&addr, s->server_len);
+}
+
+static int handshake(session_t *s) {
+    char resp[4096], headers[1024], body[2048];
+    unsigned char challenge[16], rsakey[256];
+    char b64[512], b64iv[64];
+    int cport, tport;
+
+    if (rtsp_connect(s))
+        return -1;
+
+    RAND_bytes(challenge, sizeof(challenge));
+    base64(b64, challenge, sizeof(challenge));
+    snprintf(headers, sizeof(headers), "Apple-Challenge: %s\r\n", b64);
+    if (rtsp_request(s, "OPTIONS", headers, NULL, resp, sizeof(resp)))
+        return -1;
+
+    BIO *bio = BIO_new_mem_buf(AIRPORT_PUBLIC_KEY, -1);
+    RSA *rsa = PEM_read_bio_RSA_PUBKEY(bio, NULL, NULL, NULL);
+    BIO_free(bio);
+    int keylen = RSA_public_encrypt(sizeof(s->aeskey), s->aeskey, rsakey, rsa, RSA_PKCS1_OAEP_PADDING);
+    RSA_free(rsa);
+    if (keylen <= 0)
+        return -1;
+    base64(b64, rsakey, keylen);
+    base64(b64iv, s->aesiv, sizeof(s->aesiv));
+    snprintf(body, sizeof(body),
+             "v=0\r\n"
+             "o=iTunes %u 0 IN IP4 127.0.0.1\r\n"
+             "s=iTunes\r\n"
+             "c=IN IP4 127.0.0.1\r\n"
+             "t=0 0\r\n"
+             "m=audio 0 RTP/AVP 96\r\n"
+             "a=rtpmap:96 AppleLossless\r\n"
+             "a=fmtp:" FMTP "\r\n"
+             "a=rsaaeskey:%s\r\n"
+             "a=aesiv:%s\r\n",
+             s->ssrc, b64, b64iv);
+    if (rtsp_request(s, "ANNOUNCE", "Content-Type: application/sdp\r\n", body, resp, sizeof(resp)))
+        return -1;
+
+    s->dsock = udp_socket(s, &tport);   // the data socket's port doubles as the timing port
+    s->csock = udp_socket(s, &cport);
+    if (s->dsock < 0 || s->csock < 0)
+        return -1;
+    snprintf(headers, sizeof(headers),
+             "Transport: RTP/AVP/UDP;unicast;interleaved=0-1;mode=record;"
+             "control_port=%d;timing_port=%d\r\n", cport, tport);
+    if (rtsp_request(s, "SETUP", headers, NULL, resp, sizeof(resp)))
+        return -1;
+    char *sp = strstr(resp, "server_port=");
+    if (!sp)
+        return -1;
+    s->server_port = atoi(sp + 12);
+
+    snprintf(headers, sizeof(headers), "Session: DEADBEEF\r\nRange: npt=0-\r\n"
+             "RTP-Info: seq=%u;rtptime=%u\r\n", s->seq, s->rtptime);
+    if (rtsp_request(s, "RECORD", headers, NULL, resp, sizeof(resp)))
+        return -1;
+
+    snprintf(body, sizeof(body), "volume: %f\r\n", volume_db);
+    if (rtsp_request(s, "SET_PARAMETER", "Content-Type: text/parameters\r\n", body, resp, sizeof(resp)))
+        return -1;
+    return 0;
+}
+
+// A stereo ALAC frame using the decoder's uncompressed escape, so we
+// need no encoder: 23 header bits, then 16-bit left/right pairs.
+static int alac_frame(session_t *s, unsigned char *out) {
+    unsigned int acc = 0;
+    int bits = 0, len = 0, i;
+
+#define PUTBITS(v, n) do {                              \
+        acc = (acc << (n)) | ((v) & ((1u << (n)) - 1)); \
+        bits += (n);                                    \
+        while (bits >= 8) {                             \
+            bits -= 8;                                  \
+            out[len++] = acc >> bits;                   \
+        }                                               \
+    } while (0)
+
+    PUTBITS(1, 3);      // stereo
+    PUTBITS(0, 4);
+    PUTBITS(0, 12);
+    PUTBITS(0, 1);      // no sample count, the default frame size applies
+    PUTBITS(0, 2);
+    PUTBITS(1, 1);      // not compressed
+    for (i = 0; i < FRAME_SIZE; i++) {
+        // a 1 kHz tone, so dropouts are audible and measurable downstream
+        short v = 16000 * sin(s->phase);
+        s->phase += 2.0 * M_PI * 1000.0 / SAMPLING_RATE;
+        PUTBITS(v, 16);
+        PUTBITS(v, 16);
+    }
+    if (bits)
+        out[len++] = acc << (8 - bits);
+#undef PUTBITS
+    return len;
+}
+
+static int build_packet(session_t *s, char *pkt, int first) {
+    unsigned char frame[MAX_PACKET], iv[16];
+    int len = alac_frame(s, frame);
+    int aeslen = len & ~0xf;
+
+    pkt[0] = 0x80;
+    pkt[1] = first ? 0xe0 : 0x60;
+    *(unsigned short *)(pkt+2) = htons(s->seq);
+    *(unsigned int *)(pkt+4) = htonl(s->rtptime);
+    *(unsigned int *)(pkt+8) = htonl(s->ssrc);
+    memcpy(iv, s->aesiv, sizeof(iv));
+    AES_cbc_encrypt(frame, (unsigned char *)pkt+12, aeslen, &s->aes, iv, AES_ENCRYPT);
+    memcpy(pkt+12+aeslen, frame+aeslen, len-aeslen);
+    return len + 12;
+}
+
+static void schedule(session_t *s, char *pkt, int len, double when) {
+    if (s->npending == MAX_PENDING)
+        die("too many packets held back - reduce jitter");
+    pending_t *p = &s->pending[s->npending++];
+    p->when = when;
+    p->len = len;
+    memcpy(p->data, pkt, len);
+}
+
+static double send_due(session_t *s, double t) {
+    double next = INFINITY;
+    int i = 0;
+    while (i < s->npending) {
+        pending_t *p = &s->pending[i];
+        if (p->when <= t) {
+            send_to_server(s, s->dsock, s->server_port, p->data, p->len);
+            s->stats.sent++;
+            *p = s->pending[--s->npending];
+            continue;
+        }
+        if (p->when < next)
+            next = p->when;
+        i++;
+    }
+    return next;
+}
+
+static void handle_resends(session_t *s) {
+    unsigned char req[64];
+    char resp[MAX_PACKET + 4];
+    ssize_t n;
+
+    while ((n = recv(s->csock, req, sizeof(req), MSG_DONTWAIT)) >= 8) {
+        if ((req[1] & ~0x80) != 0x55)
+            continue;
+        unsigned short first = ntohs(*(unsigned short *)(req+4));
+        unsigned short count = ntohs(*(unsigned short *)(req+6));
+        s->stats.resend_requests++;
+        while (count--) {
+            int idx = first % HISTORY;
+            if (s->history[idx].len && s->history[idx].seq == first) {
+                resp[0] = 0x80;
+                resp[1] = 0x56 | 0x80;
+                *(unsigned short *)(resp+2) = htons(1);
+                memcpy(resp+4, s->history[idx].data, s->history[idx].len);
+                send_to_server(s, s->csock, s->server_port + 1, resp, s->history[idx].len + 4);
+                s->stats.resent++;
+            } else {
+                s->stats.missed_resends++;
+            }
+            first++;
+        }
+    }
+}
+
+static void *session_thread(void *arg) {
+    session_t *s = arg;
+    char pkt[MAX_PACKET], resp[4096];
+    double period = (double)FRAME_SIZE / SAMPLING_RATE / (1.0 + skew_ppm * 1e-6);
+    long frames = duration * SAMPLING_RATE / FRAME_SIZE, k;
+
+    RAND_bytes(s->aeskey, sizeof(s->aeskey));
+    RAND_bytes(s->aesiv, sizeof(s->aesiv));
+    AES_set_encrypt_key(s->aeskey, 128, &s->aes);
+    s->seq = random();
+    s->rtptime = random();
+    s->ssrc = random();
+
+    if (handshake(s)) {
+        fprintf(stderr, "[%d] RTSP handshake failed\n", s->id);
+        return NULL;
+    }
+
+    double start = now(), next_flush = flush_every > 0 ? flush_every : INFINITY;
+    for (k = 0; k < frames; k++) {
+        double nominal = start + k * period;
+        int len = build_packet(s, pkt, k == 0);
+
+        int idx = s->seq % HISTORY;
+        s->history[idx].seq = s->seq;
+        s->history[idx].len = len;
+        memcpy(s->history[idx].data, pkt, len);
+
+        if (k && frand() < loss) {
+            s->stats.dropped++;
+        } else {
+            double when = nominal + jitter * frand();
+            if (frand() < reorder) {
+                when += period;
+                s->stats.reordered++;
+            }
+            schedule(s, pkt, len, when);
+        }
+        s->seq++;
+        s->rtptime += FRAME_SIZE;
+
+        // until the next frame is due, send what is due and answer resends
+        double t;
+        while ((t = now()) < nominal + period) {
+            double wake = send_due(s, t);
+            if (wake > nominal + period)
+                wake = nominal + period;
+            struct pollfd pfd = { s->csock, POLLIN, 0 };
+            // rounded up: truncated, the last millisecond before a send
+            // would be spent polling with no timeout
+            int ms = ceil((wake - t) * 1000.0);
+            if (poll(&pfd, 1, ms > 0 ? ms : 0) > 0)
+                handle_resends(s);
+        }
+
+        if (k * period >= next_flush) {
+            char headers[128];
+            snprintf(headers, sizeof(headers), "Session: DEADBEEF\r\nRTP-Info: seq=%u;rtptime=%u\r\n",
+                     s->seq, s->rtptime);
+            rtsp_request(s, "FLUSH", headers, NULL, resp, sizeof(resp));
+            next_flush += flush_every;
+        }
+    }
+    while (s->npending)
+        send_due(s, INFINITY);
+
+    // give late resend requests a moment before hanging up
+    struct pollfd pfd = { s->csock, POLLIN, 0 };
+    while (poll(&pfd, 1, 200) > 0)
+        handle_resends(s);
+    rtsp_request(s, "TEARDOWN", "Session: DEADBEEF\r\n", NULL, resp, sizeof(resp));
+    close(s->rtsp);
+    close(s->dsock);
+    close(s->csock);
+
+    pthread_mutex_lock(&totals_mutex);
+    totals.sent += s->stats.sent;
+    totals.dropped += s->stats.dropped;
+    totals.reordered += s->stats.reordered;
+    totals.resend_requests += s->stats.resend_requests;
+    totals.resent += s->stats.resent;
+    totals.missed_resends += s->stats.missed_resends;
+    pthread_mutex_unlock(&totals_mutex);
+    return NULL;
+}
+
+static void usage(void) {
+    fprintf(stderr,
+            "Usage: raopsim [options]\n"
+            "  -h host       receiver address (127.0.0.1)\n"
+            "  -p port       receiver RTSP port (5002)\n"
+            "  -n count      parallel sessions (1)\n"
+            "  -t seconds    audio streamed per session (10)\n"
+            "  -l percent    packet loss (0)\n"
+            "  -j ms         maximum send jitter (0)\n"
+            "  -r percent    packets reordered (0)\n"
+            "  -s ppm        sender clock skew (0)\n"
+            "  -f seconds    send FLUSH this often (never)\n"
+            "  -V dB         volume to set (-15)\n"
+            "  -S seed       random seed\n"
+            "  -v            print RTSP replies\n");
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+    int opt, i;
+    unsigned int seed = time(NULL);
+
+    while ((opt = getopt(argc, argv, "h:p:n:t:l:j:r:s:f:V:S:v")) != -1) {
+        switch (opt) {
+        case 'h': host = optarg; break;
+        case 'p': rtsp_port = optarg; break;
+        case 'n': sessions = atoi(optarg); break;
+        case 't': duration = atof(optarg); break;
+        case 'l': loss = atof(optarg) / 100.0; break;
+        case 'j': jitter = atof(optarg) / 1000.0; break;
+        case 'r': reorder = atof(optarg) / 100.0; break;
+        case 's': skew_ppm = atof(optarg); break;
+        case 'f': flush_every = atof(optarg); break;
+        case 'V': volume_db = atof(optarg); break;
+        case 'S': seed = strtoul(optarg, NULL, 0); break;
+        case 'v': verbose = 1; break;
+        default: usage();
+        }
+    }
+    if (sessions < 1 || duration <= 0)
+        usage();
+    srandom(seed);
+
+    session_t **all = calloc(sessions, sizeof(session_t *));
+    pthread_t *threads = calloc(sessions, sizeof(pthread_t));
+    double start = now();
+    for (i = 0; i < sessions; i++) {
+        all[i] = calloc(1, sizeof(session_t));
+        all[i]->id = i;
+        pthread_create(&threads[i], NULL, session_thread, all[i]);
+    }
+    for (i = 0; i < sessions; i++)
+        pthread_join(threads[i], NULL);
+
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    printf("sessions %d  wall %.2f s  cpu %.2f s\n", sessions, now() - start,
+           ru.ru_utime.tv_sec + ru.ru_stime.tv_sec + (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1e6);
+    printf("sent %lu  dropped %lu  reordered %lu\n", totals.sent, totals.dropped, totals.reordered);
+    printf("resend requests %lu  resent %lu  unavailable %lu\n",
+           totals.resend_requests, totals.resent, totals.missed_resends);
+    return 0;
+}
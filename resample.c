@@ -0,0 +1,344 @@
+/*
+ * Drift-correcting resampler for HairTunes
+ * Copyright (c) ShairPort contributors 2012
+ * All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <math.h>
+#include <time.h>
+
+#include "resample.h"
+
+// The sinc modes are a polyphase windowed-sinc interpolator: the kernel is
+// tabulated at NPHASE fractional offsets and linearly interpolated between
+// neighbouring phases, so the ratio can change smoothly on every sample.
+// The dot products run four taps at a time using GCC vector extensions,
+// which come out as SSE on x86 and NEON on ARM.
+#define NPHASE      128
+#define MAX_TAPS    32
+#define HALF_MAX    (MAX_TAPS/2)
+
+// the fill controller never needs more than this; clamping keeps the
+// held-back input bounded
+#define RATE_LIMIT  0.005
+
+typedef float v4sf __attribute__((vector_size(16)));
+typedef float v4sf_u __attribute__((vector_size(16), aligned(4)));
+
+static const struct {
+    const char *name;
+    int taps;
+    double cutoff;      // fraction of the sample rate
+    double beta;        // Kaiser window shape
+} modes[RESAMPLE_MODES] = {
+    { "stuff",  0,  0,    0 },
+    { "fast",   8,  0.40, 5.0 },
+    { "medium", 16, 0.44, 7.0 },
+    { "best",   32, 0.46, 9.0 },
+};
+
+struct resampler {
+    int mode;
+    int taps;
+    float *table[RESAMPLE_MODES];   // (NPHASE+1) rows of 'taps' coefficients
+
+    float *buf[2];      // input history, one per channel
+    int cap, fill;
+    double pos;         // input position of the next output sample
+
+    long budget_ns;
+    double avg_ns;
+    int calls;
+};
+
+static double bessel_i0(double x) {
+    double sum = 1.0, term = 1.0;
+    int k;
+    for (k = 1; k < 50; k++) {
+        term *= (x / (2*k)) * (x / (2*k));
+        sum += term;
+        if (term < sum * 1e-12)
+            break;
+    }
+    return sum;
+}
+
+static float *build_table(int mode) {
+    int taps = modes[mode].taps;
+    double fc = modes[mode].cutoff, beta = modes[mode].beta;
+    float *table;
+    int p, k;
+
+    if (posix_memalign((void **)&table, 16, (NPHASE+1) * taps * sizeof(float)))
+        return NULL;
+
+    for (p = 0; p <= NPHASE; p++) {
+        float *row = table + p*taps;
+        double sum = 0.0;
+        for (k = 0; k < taps; k++) {
+            // distance from the output position to input tap k
+            double x = k - (taps/2 - 1) - (double)p / NPHASE;
+            double t = x / (taps/2);
+            double h = 2*fc;
+            if (x != 0.0)
+                h = sin(2*M_PI*fc*x) / (M_PI*x);
+            h *= t*t < 1.0 ? bessel_i0(beta * sqrt(1.0 - t*t)) / bessel_i0(beta) : 0.0;
+            row[k] = h;
+            sum += h;
+        }
+        // unity gain at DC for every phase
+        for (k = 0; k < taps; k++)
+            row[k] /= sum;
+    }
+    return table;
+}
+
+static void set_mode(resampler_t *rs, int mode) {
+    rs->mode = mode;
+    rs->taps = modes[mode].taps;
+    rs->avg_ns = 0;
+    rs->calls = 0;
+}
+
+resampler_t *resampler_new(int mode, int max_frames) {
+    resampler_t *rs;
+    int i;
+
+    if (mode < 0 || mode >= RESAMPLE_MODES)
+        return NULL;
+    rs = calloc(1, sizeof(resampler_t));
+    if (!rs)
+        return NULL;
+
+    rs->cap = 2*max_frames + MAX_TAPS;
+    rs->buf[0] = malloc(rs->cap * sizeof(float));
+    rs->buf[1] = malloc(rs->cap * sizeof(float));
+    if (!rs->buf[0] || !rs->buf[1]) {
+        resampler_free(rs);
+        return NULL;
+    }
+    // the requested kernel, and the cheaper ones the budget may fall back to
+    for (i = RESAMPLE_FAST; i <= mode; i++) {
+        rs->table[i] = build_table(i);
+        if (!rs->table[i]) {
+            resampler_free(rs);
+            return NULL;
+        }
+    }
+    set_mode(rs, mode);
+    resampler_reset(rs);
+    return rs;
+}
+
+void resampler_free(resampler_t *rs) {
+    int i;
+    if (!rs)
+        return;
+    for (i = 0; i < RESAMPLE_MODES; i++)
+        free(rs->table[i]);
+    free(rs->buf[0]);
+    free(rs->buf[1]);
+    free(rs);
+}
+
+int resampler_mode(const char *name) {
+    int i;
+    for (i = 0; i < RESAMPLE_MODES; i++)
+        if (!strcasecmp(name, modes[i].name))
+            return i;
+    return -1;
+}
+
+const char *resampler_mode_name(int mode) {
+    if (mode < 0 || mode >= RESAMPLE_MODES)
+        return "?";
+    return modes[mode].name;
+}
+
+void resampler_reset(resampler_t *rs) {
+    // start with enough silence behind the first sample for the widest kernel
+    rs->fill = HALF_MAX - 1;
+    memset(rs->buf[0], 0, rs->fill * sizeof(float));
+    memset(rs->buf[1], 0, rs->fill * sizeof(float));
+    rs->pos = HALF_MAX - 1;
+}
+
+void resampler_set_budget(resampler_t *rs, long budget_ns) {
+    rs->budget_ns = budget_ns;
+    rs->avg_ns = 0;
+    rs->calls = 0;
+}
+
+int resampler_current_mode(resampler_t *rs) {
+    return rs->mode;
+}
+
+static int stuff_process(double rate, const short *inptr, int frames, short *outptr) {
+    int i;
+    int stuffsamp = frames;
+    int stuff = 0;
+    double p_stuff;
+
+    p_stuff = 1.0 - pow(1.0 - fabs(rate-1.0), frames);
+
+    if (rand() < p_stuff * RAND_MAX) {
+        stuff = rate > 1.0 ? -1 : 1;
+        stuffsamp = rand() % (frames - 1);
+    }
+
+    for (i=0; i<stuffsamp; i++) {   // the whole frame, if no stuffing
+        *outptr++ = *inptr++;
+        *outptr++ = *inptr++;
+    };
+    if (stuff) {
+        if (stuff==1) {
+            // interpolate one sample
+            *outptr++ = ((long)inptr[-2] + (long)inptr[0]) >> 1;
+            *outptr++ = ((long)inptr[-1] + (long)inptr[1]) >> 1;
+        } else if (stuff==-1) {
+            inptr++;
+            inptr++;
+        }
+        for (i=stuffsamp; i<frames + stuff; i++) {
+            *outptr++ = *inptr++;
+            *outptr++ = *inptr++;
+        }
+    }
+
+    return frames + stuff;
+}
+
+static inline short clip16(float x) {
+    // clamp first so the conversion can't overflow, then round to nearest
+    if (x > 32767.0f)
+        return 32767;
+    if (x < -32768.0f)
+        return -32768;
+    return (short)(x < 0 ? x - 0.5f : x + 0.5f);
+}
+
+static int sinc_process(resampler_t *rs, double rate,
+                        const short *in, int frames, short *out, int max_out) {
+    int taps = rs->taps, half = taps/2;
+    const float *table = rs->table[rs->mode];
+    float *l = rs->buf[0], *r = rs->buf[1];
+    double pos;
+    int i, k, n = 0;
+
+    // append the new input, skipping ahead if a long run of short output
+    // calls has let the backlog fill up
+    if (rs->fill + frames > rs->cap) {
+        int drop = rs->fill + frames - rs->cap;
+        memmove(l, l + drop, (rs->fill - drop) * sizeof(float));
+        memmove(r, r + drop, (rs->fill - drop) * sizeof(float));
+        rs->fill -= drop;
+        rs->pos -= drop;
+        if (rs->pos < HALF_MAX - 1)
+            rs->pos = HALF_MAX - 1;
+    }
+    for (i = 0; i < frames; i++) {
+        l[rs->fill + i] = in[2*i];
+        r[rs->fill + i] = in[2*i+1];
+    }
+    rs->fill += frames;
+
+    pos = rs->pos;
+    while (n < max_out) {
+        int ipos = (int)pos;
+        if (ipos + half >= rs->fill)
+            break;
+
+        float f = (pos - ipos) * NPHASE;
+        int p = (int)f;
+        if (p >= NPHASE)    // a fraction just under 1 can round up in float
+            p = NPHASE - 1;
+        float frac = f - p;
+        const v4sf *c0 = (const v4sf *)(table + p*taps);
+        const v4sf *c1 = (const v4sf *)(table + (p+1)*taps);
+        const float *xl = l + ipos - half + 1;
+        const float *xr = r + ipos - half + 1;
+        v4sf vfrac = { frac, frac, frac, frac };
+        v4sf suml = { 0, 0, 0, 0 }, sumr = { 0, 0, 0, 0 };
+
+        for (k = 0; k < taps/4; k++) {
+            v4sf c = c0[k] + vfrac * (c1[k] - c0[k]);
+            suml += c * *(const v4sf_u *)(xl + 4*k);
+            sumr += c * *(const v4sf_u *)(xr + 4*k);
+        }
+        out[2*n] = clip16(suml[0] + suml[1] + suml[2] + suml[3]);
+        out[2*n+1] = clip16(sumr[0] + sumr[1] + sumr[2] + sumr[3]);
+
+        pos += rate;
+        n++;
+    }
+    rs->pos = pos;
+
+    // keep only what the widest kernel can still reach
+    int shift = (int)rs->pos - (HALF_MAX - 1);
+    if (shift > rs->fill)
+        shift = rs->fill;
+    if (shift > 0) {
+        memmove(l, l + shift, (rs->fill - shift) * sizeof(float));
+        memmove(r, r + shift, (rs->fill - shift) * sizeof(float));
+        rs->fill -= shift;
+        rs->pos -= shift;
+    }
+
+    return n;
+}
+
+int resampler_process(resampler_t *rs, double rate,
+                      const short *in, int frames, short *out, int max_out) {
+    struct timespec t0, t1;
+    int n;
+
+    if (rate > 1.0 + RATE_LIMIT)
+        rate = 1.0 + RATE_LIMIT;
+    if (rate < 1.0 - RATE_LIMIT)
+        rate = 1.0 - RATE_LIMIT;
+
+    if (!rs->taps)
+        return stuff_process(rate, in, frames, out);
+
+    if (rs->budget_ns)
+        clock_gettime(CLOCK_THREAD_CPUTIME_ID, &t0);
+
+    n = sinc_process(rs, rate, in, frames, out, max_out);
+
+    if (rs->budget_ns) {
+        clock_gettime(CLOCK_THREAD_CPUTIME_ID, &t1);
+        long ns = (t1.tv_sec - t0.tv_sec) * 1000000000L + (t1.tv_nsec - t0.tv_nsec);
+        rs->avg_ns += (ns - rs->avg_ns) / 16.0;
+        if (++rs->calls >= 64 && rs->avg_ns > rs->budget_ns && rs->mode > RESAMPLE_FAST) {
+            fprintf(stderr, "resampler: %.0f ns per block is over budget, dropping to %s\n",
+                    rs->avg_ns, modes[rs->mode - 1].name);
+            set_mode(rs, rs->mode - 1);
+        }
+    }
+
+    return n;
+}
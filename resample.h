@@ -0,0 +1,43 @@
+#ifndef _RESAMPLE_H_
+#define _RESAMPLE_H_
+
+// Drift correction for the output path: interleaved stereo 16-bit frames
+// in, the same frames played back at a slightly different rate out.
+//
+// 'rate' is input samples consumed per output sample, as produced by the
+// buffer fill controller: above 1.0 the output runs short, below 1.0 long.
+
+enum {
+    RESAMPLE_STUFF = 0,     // insert/drop one interpolated sample now and then
+    RESAMPLE_FAST,          // windowed sinc, 8 taps
+    RESAMPLE_MEDIUM,        // 16 taps
+    RESAMPLE_BEST,          // 32 taps
+    RESAMPLE_MODES
+};
+
+typedef struct resampler resampler_t;
+
+// max_frames is the largest input block that will be passed in
+resampler_t *resampler_new(int mode, int max_frames);
+void resampler_free(resampler_t *rs);
+
+// returns the mode for a name ("stuff", "fast", "medium", "best"), or -1
+int resampler_mode(const char *name);
+const char *resampler_mode_name(int mode);
+
+// drop held-back input, eg. after a flush
+void resampler_reset(resampler_t *rs);
+
+// average cost allowed per call, in nanoseconds of thread CPU time. a sinc
+// resampler running over it steps down one quality level, never below fast.
+// 0 disables the check.
+void resampler_set_budget(resampler_t *rs, long budget_ns);
+int resampler_current_mode(resampler_t *rs);
+
+// resample 'frames' stereo frames from 'in' into 'out', writing at most
+// 'max_out' frames; returns the number written. sinc modes hold back a few
+// samples of look-ahead, so the count differs from call to call.
+int resampler_process(resampler_t *rs, double rate,
+                      const short *in, int frames, short *out, int max_out);
+
+#endif
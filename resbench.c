@@ -0,0 +1,280 @@
+/*
+ * resbench - cost and quality of the drift-correction modes
+ * Copyright (c) ShairPort contributors 2012
+ * All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+// Runs a sine through each drift-correction mode at a range of clock
+// offsets, the way hairtunes feeds it (one ALAC frame per call), and
+// reports the CPU cost per frame along with THD+N and the strongest
+// spurious tone of the output, measured on a windowed FFT.
+//
+//   resbench [-f frame_size] [-r rate] [-t freq,...] [-p ppm,...] [-m mode,...]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <math.h>
+#include <time.h>
+
+#include "resample.h"
+
+#ifdef FANCY_RESAMPLING
+#include <samplerate.h>
+#endif
+
+#define FFT_SIZE    65536
+#define SETTLE      8192        // output samples skipped before measuring
+#define MAIN_LOBE   12          // bins either side of the tone counted as signal
+
+static int frame_size = 352;
+static int sampling_rate = 44100;
+
+static void die(char *why) {
+    fprintf(stderr, "FATAL: %s\n", why);
+    exit(1);
+}
+
+static double cpu_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void fft(double *re, double *im, int n) {
+    int i, j, k, len;
+
+    for (i = 1, j = 0; i < n; i++) {
+        int bit = n >> 1;
+        for (; j & bit; bit >>= 1)
+            j ^= bit;
+        j ^= bit;
+        if (i < j) {
+            double t;
+            t = re[i]; re[i] = re[j]; re[j] = t;
+            t = im[i]; im[i] = im[j]; im[j] = t;
+        }
+    }
+    for (len = 2; len <= n; len <<= 1) {
+        double a = -2*M_PI / len;
+        for (i = 0; i < n; i += len) {
+            for (k = 0; k < len/2; k++) {
+                double wr = cos(a*k), wi = sin(a*k);
+                double *ur = re + i + k, *ui = im + i + k;
+                double *vr = re + i + k + len/2, *vi = im + i + k + len/2;
+                double xr = *vr * wr - *vi * wi;
+                double xi = *vr * wi + *vi * wr;
+                *vr = *ur - xr; *vi = *ui - xi;
+                *ur += xr; *ui += xi;
+            }
+        }
+    }
+}
+
+// THD+N and the largest single bin outside the tone, both relative to the
+// tone, from one channel of interleaved output
+static void analyse(const short *out, double *thdn, double *spur) {
+    static double re[FFT_SIZE], im[FFT_SIZE], pw[FFT_SIZE/2];
+    int i, peak = 1;
+    double sig = 0, noise = 0, maxspur = 0;
+
+    for (i = 0; i < FFT_SIZE; i++) {
+        // 4-term Blackman-Harris, sidelobes below the 16-bit floor
+        double x = 2*M_PI*i / FFT_SIZE;
+        double w = 0.35875 - 0.48829*cos(x) + 0.14128*cos(2*x) - 0.01168*cos(3*x);
+        re[i] = out[2*i] * w;
+        im[i] = 0;
+    }
+    fft(re, im, FFT_SIZE);
+
+    for (i = 1; i < FFT_SIZE/2; i++) {
+        pw[i] = re[i]*re[i] + im[i]*im[i];
+        if (pw[i] > pw[peak])
+            peak = i;
+    }
+    for (i = 4; i < FFT_SIZE/2; i++) {
+        if (abs(i - peak) <= MAIN_LOBE) {
+            sig += pw[i];
+        } else {
+            noise += pw[i];
+            if (pw[i] > maxspur)
+                maxspur = pw[i];
+        }
+    }
+    *thdn = 10*log10((noise + 1e-30) / sig);
+    *spur = 10*log10((maxspur + 1e-30) / pw[peak]);
+}
+
+// -1 dBFS stereo sine, the right channel a quarter period behind
+static short *make_tone(double freq, int frames) {
+    short *buf = malloc(frames * 4);
+    double amp = 32767 * pow(10, -1/20.0);
+    int i;
+
+    for (i = 0; i < frames; i++) {
+        double ph = 2*M_PI*freq*i / sampling_rate;
+        buf[2*i] = lrint(amp * sin(ph));
+        buf[2*i+1] = lrint(amp * cos(ph));
+    }
+    return buf;
+}
+
+// push 'in' through one mode at a fixed clock offset; returns CPU ns per frame
+static double run_mode(int mode, double rate, const short *in, int in_frames,
+                       short *out, int *out_frames) {
+    int blocks = in_frames / frame_size, b, n = 0;
+    double t0, t1;
+
+#ifdef FANCY_RESAMPLING
+    if (mode == RESAMPLE_MODES) {
+        // the libsamplerate path, as hairtunes drives it
+        int err;
+        SRC_STATE *src = src_new(SRC_SINC_MEDIUM_QUALITY, 2, &err);
+        float *fin = malloc(frame_size * 2 * sizeof(float));
+        float *fout = malloc(2 * frame_size * 2 * sizeof(float));
+        SRC_DATA sd;
+        int i;
+
+        memset(&sd, 0, sizeof(sd));
+        t0 = cpu_ns();
+        for (b = 0; b < blocks; b++) {
+            for (i = 0; i < 2*frame_size; i++)
+                fin[i] = in[2*b*frame_size + i] / 32768.0;
+            sd.data_in = fin;
+            sd.data_out = fout;
+            sd.input_frames = frame_size;
+            sd.output_frames = 2*frame_size;
+            sd.src_ratio = 1.0 / rate;
+            src_process(src, &sd);
+            src_float_to_short_array(fout, out + 2*n, sd.output_frames_gen * 2);
+            n += sd.output_frames_gen;
+        }
+        t1 = cpu_ns();
+        src_delete(src);
+        free(fin);
+        free(fout);
+        *out_frames = n;
+        return (t1 - t0) / blocks;
+    }
+#endif
+
+    resampler_t *rs = resampler_new(mode, frame_size);
+    if (!rs)
+        die("can't set up resampler");
+
+    srand(1);
+    t0 = cpu_ns();
+    for (b = 0; b < blocks; b++)
+        n += resampler_process(rs, rate, in + 2*b*frame_size, frame_size,
+                               out + 2*n, frame_size + 3);
+    t1 = cpu_ns();
+
+    resampler_free(rs);
+    *out_frames = n;
+    return (t1 - t0) / blocks;
+}
+
+static int parse_list(char *s, double *list, int max) {
+    int n = 0;
+    char *tok;
+    while (n < max && (tok = strsep(&s, ",")))
+        list[n++] = atof(tok);
+    return n;
+}
+
+int main(int argc, char **argv) {
+    double tones[16] = { 1000, 10000, 18000 }, ppms[16] = { 0, 20, 100, 500, 2000 };
+    int ntones = 3, nppms = 5;
+    int modelist[RESAMPLE_MODES+1], nmodes = 0;
+    char *modearg = NULL;
+    int opt, i, t, p;
+
+    while ((opt = getopt(argc, argv, "f:r:t:p:m:h")) != -1) {
+        switch (opt) {
+        case 'f': frame_size = atoi(optarg); break;
+        case 'r': sampling_rate = atoi(optarg); break;
+        case 't': ntones = parse_list(optarg, tones, 16); break;
+        case 'p': nppms = parse_list(optarg, ppms, 16); break;
+        case 'm': modearg = optarg; break;
+        default:
+            fprintf(stderr, "usage: %s [-f frame_size] [-r rate] [-t freq,...] "
+                    "[-p ppm,...] [-m mode,...]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (frame_size < 16)
+        die("frame size too small");
+
+    if (modearg) {
+        char *tok;
+        int m;
+        while ((tok = strsep(&modearg, ","))) {
+#ifdef FANCY_RESAMPLING
+            if (!strcmp(tok, "src"))
+                m = RESAMPLE_MODES;
+            else
+#endif
+            if ((m = resampler_mode(tok)) < 0)
+                die("unknown mode");
+            // each mode once, so the list can't outgrow modelist
+            for (i = 0; i < nmodes; i++)
+                if (modelist[i] == m)
+                    die("mode given twice");
+            if (nmodes == sizeof(modelist)/sizeof(modelist[0]))
+                die("too many modes");
+            modelist[nmodes++] = m;
+        }
+    } else {
+        for (i = 0; i < RESAMPLE_MODES; i++)
+            modelist[nmodes++] = i;
+#ifdef FANCY_RESAMPLING
+        modelist[nmodes++] = RESAMPLE_MODES;
+#endif
+    }
+
+    // enough input for the measured window at the slowest output rate
+    int in_frames = (SETTLE + FFT_SIZE) * 1.01 + 4*frame_size;
+    short *out = malloc(in_frames * 2 * 4);
+
+    printf("%-7s %6s %7s %10s %9s %9s\n", "mode", "ppm", "tone", "ns/frame", "THD+N dB", "spur dBc");
+    for (t = 0; t < ntones; t++) {
+        short *in = make_tone(tones[t], in_frames);
+        for (i = 0; i < nmodes; i++) {
+            for (p = 0; p < nppms; p++) {
+                int out_frames;
+                double thdn, spur;
+                double ns = run_mode(modelist[i], 1.0 + ppms[p] * 1e-6,
+                                     in, in_frames, out, &out_frames);
+                if (out_frames < SETTLE + FFT_SIZE)
+                    die("short output");
+                analyse(out + 2*SETTLE, &thdn, &spur);
+                printf("%-7s %6g %7g %10.0f %9.1f %9.1f\n",
+                       modelist[i] == RESAMPLE_MODES ? "src" : resampler_mode_name(modelist[i]),
+                       ppms[p], tones[t], ns, thdn, spur);
+            }
+        }
+        free(in);
+    }
+    return 0;
+}
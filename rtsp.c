@@ -0,0 +1,189 @@
+/*
+ * RTSP request parser for ShairPort
+ * Copyright (c) ShairPort contributors 2012
+ * All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include "rtsp.h"
+
+static int isBlank(char pChar)
+{
+  return pChar == ' ' || pChar == '\t';
+}
+
+void rtspReset(struct rtspRequest *pReq)
+{
+  memset(pReq, 0, sizeof(struct rtspRequest));
+}
+
+// METHOD uri RTSP/1.0
+static int parseRequestLine(struct rtspRequest *pReq, const char *pBuf, int pStart, int pLen)
+{
+  const char *tLine = pBuf + pStart;
+  const char *tSpace = memchr(tLine, ' ', pLen);
+  if(tSpace == NULL || tSpace == tLine)
+  {
+    return RTSP_BAD;
+  }
+  pReq->method.offset = pStart;
+  pReq->method.length = tSpace - tLine;
+
+  int tUri = pReq->method.length + 1;
+  tSpace = memchr(tLine + tUri, ' ', pLen - tUri);
+  pReq->uri.offset = pStart + tUri;
+  pReq->uri.length = (tSpace != NULL ? tSpace - tLine : pLen) - tUri;
+  return 0;
+}
+
+// Name: value
+static int parseHeaderLine(struct rtspRequest *pReq, const char *pBuf, int pStart, int pLen)
+{
+  const char *tLine = pBuf + pStart;
+  const char *tColon = memchr(tLine, ':', pLen);
+  if(tColon == NULL)
+  {
+    return 0; // not a header; nothing we need
+  }
+  int tName = 0, tNameEnd = tColon - tLine;
+  int tValue = tNameEnd + 1, tValueEnd = pLen;
+  while(tName < tNameEnd && isBlank(tLine[tNameEnd - 1]))
+  {
+    tNameEnd--;
+  }
+  while(tValue < tValueEnd && isBlank(tLine[tValue]))
+  {
+    tValue++;
+  }
+  while(tValueEnd > tValue && isBlank(tLine[tValueEnd - 1]))
+  {
+    tValueEnd--;
+  }
+
+  if(tNameEnd - tName == 14 && !strncasecmp(tLine, "Content-Length", 14))
+  {
+    char *tEnd = NULL;
+    char tNumber[12];
+    int tDigits = tValueEnd - tValue;
+    if(tDigits < 1 || tDigits >= sizeof(tNumber))
+    {
+      return RTSP_BAD;
+    }
+    memcpy(tNumber, tLine + tValue, tDigits);
+    tNumber[tDigits] = '\0';
+    long tLength = strtol(tNumber, &tEnd, 10);
+    if(*tEnd != '\0' || tLength < 0 || tLength > RTSP_MAX_REQUEST)
+    {
+      return RTSP_BAD;
+    }
+    pReq->contentLength = tLength;
+  }
+
+  if(pReq->headerCount < RTSP_MAX_HEADERS)
+  {
+    pReq->names[pReq->headerCount].offset = pStart + tName;
+    pReq->names[pReq->headerCount].length = tNameEnd - tName;
+    pReq->values[pReq->headerCount].offset = pStart + tValue;
+    pReq->values[pReq->headerCount].length = tValueEnd - tValue;
+    pReq->headerCount++;
+  }
+  return 0;
+}
+
+int rtspParse(struct rtspRequest *pReq, const char *pBuf, int pLen)
+{
+  // a line at a time until the blank one that ends the headers
+  while(pReq->bodyStart == 0)
+  {
+    const char *tNewline = memchr(pBuf + pReq->scanned, '\n', pLen - pReq->scanned);
+    if(tNewline == NULL)
+    {
+      pReq->scanned = pLen;
+      return pLen >= RTSP_MAX_REQUEST ? RTSP_BAD : RTSP_INCOMPLETE;
+    }
+    int tStart = pReq->lineStart;
+    int tLen = tNewline - pBuf - tStart;
+    pReq->scanned = pReq->lineStart = tNewline - pBuf + 1;
+    if(tLen > 0 && pBuf[tStart + tLen - 1] == '\r')
+    {
+      tLen--;
+    }
+
+    if(tLen == 0)
+    {
+      if(pReq->method.length == 0)
+      {
+        continue; // stray line ending between requests
+      }
+      pReq->bodyStart = pReq->scanned;
+      pReq->length = pReq->bodyStart + pReq->contentLength;
+    }
+    else if(pReq->method.length == 0)
+    {
+      if(parseRequestLine(pReq, pBuf, tStart, tLen) == RTSP_BAD)
+      {
+        return RTSP_BAD;
+      }
+    }
+    else if(parseHeaderLine(pReq, pBuf, tStart, tLen) == RTSP_BAD)
+    {
+      return RTSP_BAD;
+    }
+  }
+
+  // then just count the body in
+  if(pReq->length > RTSP_MAX_REQUEST)
+  {
+    return RTSP_BAD;
+  }
+  pReq->scanned = pLen < pReq->length ? pLen : pReq->length;
+  return pLen >= pReq->length ? RTSP_COMPLETE : RTSP_INCOMPLETE;
+}
+
+char *rtspHeader(struct rtspRequest *pReq, char *pBuf, const char *pName, int *pLen)
+{
+  int tNameLen = strlen(pName);
+  int tIdx = 0;
+  for(tIdx = 0; tIdx < pReq->headerCount; tIdx++)
+  {
+    if(pReq->names[tIdx].length == tNameLen &&
+       !strncasecmp(pBuf + pReq->names[tIdx].offset, pName, tNameLen))
+    {
+      if(pLen != NULL)
+      {
+        *pLen = pReq->values[tIdx].length;
+      }
+      return pBuf + pReq->values[tIdx].offset;
+    }
+  }
+  return NULL;
+}
+
+int rtspIsMethod(struct rtspRequest *pReq, const char *pBuf, const char *pMethod)
+{
+  int tLen = strlen(pMethod);
+  return pReq->method.length == tLen && !memcmp(pBuf + pReq->method.offset, pMethod, tLen);
+}
@@ -0,0 +1,49 @@
+#ifndef _RTSP_H
+#define _RTSP_H
+
+// Incremental RTSP request parsing. A request is indexed where it lies in
+// the receive buffer, as offsets rather than pointers so the buffer may
+// grow and move between reads, and each call only looks at the bytes the
+// last one didn't get to. Whatever follows a complete request (the next
+// one, pipelined) is left alone.
+
+#define RTSP_MAX_HEADERS  32
+#define RTSP_MAX_REQUEST  65536   // headers and body together
+
+#define RTSP_INCOMPLETE   0
+#define RTSP_COMPLETE     1
+#define RTSP_BAD          (-1)
+
+struct rtspSlice
+{
+  int offset;
+  int length;
+};
+
+struct rtspRequest
+{
+  int scanned;            // bytes looked at so far
+  int lineStart;          // of the line being scanned
+  int bodyStart;          // 0 until the blank line after the headers
+  int contentLength;
+  int length;             // of the whole request, once the headers are in
+  struct rtspSlice method;
+  struct rtspSlice uri;
+  int headerCount;        // beyond RTSP_MAX_HEADERS, headers are skipped
+  struct rtspSlice names[RTSP_MAX_HEADERS];
+  struct rtspSlice values[RTSP_MAX_HEADERS];
+};
+
+void rtspReset(struct rtspRequest *pReq);
+
+// pBuf holds pLen bytes, the start of which are those seen before
+int rtspParse(struct rtspRequest *pReq, const char *pBuf, int pLen);
+
+// header value with the surrounding blanks trimmed, or NULL; names are
+// matched without regard to case
+char *rtspHeader(struct rtspRequest *pReq, char *pBuf, const char *pName, int *pLen);
+
+// TRUE if the request's method is pMethod
+int rtspIsMethod(struct rtspRequest *pReq, const char *pBuf, const char *pMethod);
+
+#endif
@@ -26,6 +26,7 @@
 
 #include <fcntl.h>
 #include <signal.h>
+#include <pthread.h>
 #include "socketlib.h"
 #include "shairport.h"
 #include "hairtunes.h"
@@ -41,6 +42,40 @@
 
 int kCurrentLogLevel = LOG_INFO;
 int bufferStartFill = -1;
+static struct portPool *kPortPool = NULL;
+static struct driftCache *kDriftCache = NULL;
+static char kDriftDevice[32] = "default";  // output the cached drifts belong to
+
+// Every stream plays to the same outputs. Unless they can take several at
+// once, the first connection to set one up keeps them until its stream
+// ends, and SETUPs from the others are turned away.
+static int kOutputShared = FALSE;
+static struct connection *kOutputOwner = NULL;
+
+// Sessions are started and stopped on a thread of their own, in the
+// order asked for: starting binds sockets and opens outputs, stopping
+// joins the stream's threads and drains its outputs, and storing the
+// drift may rewrite the cache file, none of which the event loop should
+// wait for. A SETUP parks its connection until its session is up. As the
+// jobs run in turn, every stream stopped before it has let go of its
+// outputs by then, while other connections carry on.
+struct sessionJob
+{
+  struct connection      *conn;     // the SETUP waiting for this start, NULL for a stop
+  hairtunes_session_t    *session;  // to stop, or the one started
+  struct hairtunes_setup setup;
+  struct hairtunes_ports ports;
+  int                    rtpPort;   // released once a stopped session is gone
+  char                   driftKey[DRIFT_KEY_SIZE];
+  struct sessionJob      *next;
+};
+static pthread_mutex_t kSessionLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t kSessionQueued = PTHREAD_COND_INITIALIZER;
+static struct sessionJob *kSessionHead = NULL;
+static struct sessionJob **kSessionTail = &kSessionHead;
+static struct sessionJob *kSessionStarted = NULL;   // for the loop to answer
+static int kSessionWake[2] = { -1, -1 };  // written to when one is added
+static int kSessionThread = FALSE;
 
 #ifdef _WIN32
 #define DEVNULL "nul"
@@ -51,10 +86,17 @@ int bufferStartFill = -1;
 #define SOCKET_LOG_LEVEL LOG_DEBUG_VV
 #define HEADER_LOG_LEVEL LOG_DEBUG
 #define AVAHI_LOG_LEVEL LOG_DEBUG
-
-static void handleClient(int pSock, char *pPassword, char *pHWADDR);
-static void writeDataToClient(int pSock, struct shairbuffer *pResponse);
-static int readDataFromClient(int pSock, struct shairbuffer *pClientBuffer);
+#define ACCEPT_RETRY_MS 1000  // after running out of descriptors
+
+static int acceptClients(struct eventLoop *pLoop, int pServerSock, struct addrinfo *pAddrInfo,
+                          char *pPassword, char *pHWADDR);
+static void serviceClient(struct eventLoop *pLoop, struct connection *pConn, int pEvents);
+static void closeClient(struct eventLoop *pLoop, struct connection *pConn);
+static void initPeerAddress(struct connection *pConn);
+static int readDataFromClient(struct connection *pConn);
+static int writeDataToClient(struct connection *pConn);
+static void answerRequest(struct connection *pConn);
+static void dropRequest(struct connection *pConn);
 
 static int parseMessage(struct connection *pConn,unsigned char *pIpBin, unsigned int pIpBinLen, char *pHWADDR);
 static void propogateCSeq(struct connection *pConn);
@@ -65,23 +107,53 @@ static void cleanup(struct connection *pConnection);
 static int startAvahi(const char *pHwAddr, const char *pServerName, int pPort);
 
 static int getAvailChars(struct shairbuffer *pBuf);
-static void addToShairBuffer(struct shairbuffer *pBuf, char *pNewBuf);
-static void addNToShairBuffer(struct shairbuffer *pBuf, char *pNewBuf, int pNofNewBuf);
 
-static char *getTrimmedMalloc(char *pChar, int pSize, int pEndStr, int pAddNL);
+// string constants only: their length is worked out by the compiler
+#define addStaticPart(pConn, pText) addPart((pConn), (pText), sizeof(pText) - 1)
+static void addPart(struct connection *pConn, const char *pText, int pLength);
+static void clearResponse(struct connection *pConn);
+
+static char *arenaAlloc(struct arena *pArena, int pSize);
 static char *getTrimmed(char *pChar, int pSize, int pEndStr, int pAddNL, char *pTrimDest);
 
 static void slog(int pLevel, char *pFormat, ...);
 static int isLogEnabledFor(int pLevel);
 
-static void initConnection(struct connection *pConn, struct keyring *pKeys, struct comms *pComms, int pSocket, char *pPassword);
-static void closePipe(int *pPipe);
+static void initConnection(struct connection *pConn, int pSocket, char *pPassword);
+static void endSession(struct connection *pConn);
+static void startSessionThread(struct eventLoop *pLoop);
+static int startSession(struct connection *pConn, struct hairtunes_setup *pSetup);
+static void refuseSetup(struct connection *pConn);
+static void answerSetup(struct connection *pConn, hairtunes_session_t *pSession,
+                        struct hairtunes_ports *pPorts);
+static void answerStarted(struct eventLoop *pLoop);
 static void initBuffer(struct shairbuffer *pBuf, int pNumChars);
 
-static void setKeys(struct keyring *pKeys, char *pIV, char* pAESKey, char *pFmtp);
 static RSA *loadKey(void);
 
 
+// Options are applied before any session starts, so every one shares them.
+static int setDecoderOption(char *pOption)
+{
+  char *tValue = pOption != NULL ? strchr(pOption, '=') : NULL;
+  if(tValue == NULL)
+  {
+    fprintf(stderr, "decoder option must be given as name=value\n");
+    return FALSE;
+  }
+  *tValue++ = '\0';
+  if(!hairtunes_option(pOption, tValue))
+  {
+    fprintf(stderr, "unknown decoder option: %s\n", pOption);
+    return FALSE;
+  }
+  if(!strcmp(pOption, "output"))
+  {
+    strncpy(kDriftDevice, tValue, sizeof(kDriftDevice) - 1);
+  }
+  return TRUE;
+}
+
 static void handle_sigchld(int signo) {
     int status;
     waitpid(-1, &status, WNOHANG);
@@ -98,6 +170,8 @@ int main(int argc, char **argv)
       perror("sigaction");
       return 1;
   }
+  // one client hanging up mustn't take the others with it
+  signal(SIGPIPE, SIG_IGN);
 
   char tHWID[HWID_SIZE] = {0,51,52,53,54,55};
   char tHWID_Hex[HWID_SIZE * 2 + 1];
@@ -111,6 +185,8 @@ int main(int argc, char **argv)
   int  tUseKnownHWID = FALSE;
   int  tDaemonize = FALSE;
   int  tPort = PORT;
+  char *tPortRange = NULL;
+  char *tDriftFile = NULL;
 
   char *arg;
   while ( (arg = *++argv) ) {
@@ -150,6 +226,39 @@ int main(int argc, char **argv)
     {
       bufferStartFill = atoi(arg + 9);
     }
+    else if(!strcmp(arg, "-r"))
+    {
+      tPortRange = *++argv;
+      argc--;
+    }
+    else if(!strncmp(arg, "--rtp_ports=", 12))
+    {
+      tPortRange = arg + 12;
+    }
+    else if(!strcmp(arg, "-D"))
+    {
+      tDriftFile = *++argv;
+      argc--;
+    }
+    else if(!strncmp(arg, "--drift_cache=", 14))
+    {
+      tDriftFile = arg + 14;
+    }
+    else if(!strcmp(arg, "-O"))
+    {
+      if(!setDecoderOption(*++argv))
+      {
+        return 1;
+      }
+      argc--;
+    }
+    else if(!strncmp(arg, "--decoder_option=", 17))
+    {
+      if(!setDecoderOption(arg + 17))
+      {
+        return 1;
+      }
+    }
     else if(!strcmp(arg, "-k"))
     {
       tUseKnownHWID = TRUE;
@@ -183,6 +292,10 @@ int main(int argc, char **argv)
       slog(LOG_INFO, "  -p, --password=secret   Sets Password (not working)\n");
       slog(LOG_INFO, "  -o, --server_port=5002  Sets Port for Avahi/dns-sd/howl\n");
       slog(LOG_INFO, "  -b, --buffer=282        Sets Number of frames to buffer before beginning playback\n");
+      slog(LOG_INFO, "  -r, --rtp_ports=6000-6999 Sets the UDP port range handed out to streams\n");
+      slog(LOG_INFO, "  -D, --drift_cache=FILE  Keeps learned clock drift per sender in FILE\n");
+      slog(LOG_INFO, "  -O, --decoder_option=name=value\n");
+      slog(LOG_INFO, "                          Sets a hairtunes tuning option (rcvbuf, busypoll, priority, dscp)\n");
       slog(LOG_INFO, "  -d                      Daemon mode\n");
       slog(LOG_INFO, "  -q, --quiet             Supresses all output.\n");
       slog(LOG_INFO, "  -v,-v2,-v3,-vv          Various debugging levels\n");
@@ -196,6 +309,23 @@ int main(int argc, char **argv)
      return(0);
   }
 
+  if(tPortRange != NULL)
+  {
+    int tLow = 0, tHigh = 0;
+    if(sscanf(tPortRange, "%d-%d", &tLow, &tHigh) != 2 || tLow < 1 || tHigh > 65535 || tHigh <= tLow)
+    {
+      fprintf(stderr, "rtp port range must be given as low-high\n");
+      return 1;
+    }
+    kPortPool = createPortPool(tLow, tHigh);
+    if(kPortPool == NULL)
+    {
+      return 1;
+    }
+  }
+
+  kDriftCache = createDriftCache(tDriftFile);
+
   if(tDaemonize)
   {
     int tPid = fork();
@@ -264,35 +394,63 @@ int main(int argc, char **argv)
       exit(1);
     }
 
-    int tClientSock = 0;
+    // every control connection is served from this one thread
+    struct eventLoop *tLoop = createEventLoop();
+    if(tLoop == NULL || setNonBlocking(tServerSock) == ERROR ||
+       watchSocket(tLoop, tServerSock, EVENT_READ, NULL) == ERROR)
+    {
+      exit(1);
+    }
+    startSessionThread(tLoop);
+    kOutputShared = hairtunes_output_shared();
+    if(!kOutputShared)
+    {
+      slog(LOG_DEBUG, "Output can't be shared, one stream at a time\n");
+    }
+    // out of descriptors, the listen socket stays ready with a client no
+    // accept() can take; it is left out of the loop for a while instead
+    int tAccepting = TRUE;
+    time_t tResumeAt = 0;
     while(1)
     {
-      slog(LOG_DEBUG_V, "Waiting for clients to connect\n");
-      tClientSock = acceptClient(tServerSock, tAddrInfo);
-      if(tClientSock > 0)
+      struct socketEvent tReady[MAX_EVENTS];
+      int tCount = waitEvents(tLoop, tReady, MAX_EVENTS, tAccepting ? -1 : ACCEPT_RETRY_MS);
+      if(!tAccepting && time(NULL) >= tResumeAt &&
+         watchSocket(tLoop, tServerSock, EVENT_READ, NULL) != ERROR)
+      {
+        tAccepting = TRUE;
+      }
+      if(tCount == ERROR)
+      {
+        if(errno != EINTR) // SIGCHLD from avahi
+        {
+          perror("Error waiting for clients");
+          sleep(1);
+        }
+        continue;
+      }
+      int tIdx = 0;
+      for(tIdx = 0; tIdx < tCount; tIdx++)
       {
-        int tPid = fork();
-        if(tPid == 0)
+        if(tReady[tIdx].data == kSessionWake)
         {
-          freeaddrinfo(tAddrInfo);
-          tAddrInfo = NULL;
-          slog(LOG_DEBUG, "...Accepted Client Connection..\n");
-          close(tServerSock);
-          handleClient(tClientSock, tPassword, tHWID);
-          //close(tClientSock);
-          return 0;
+          answerStarted(tLoop);
+        }
+        else if(tReady[tIdx].data == NULL)
+        {
+          if(!acceptClients(tLoop, tServerSock, tAddrInfo, tPassword, tHWID))
+          {
+            slog(LOG_INFO, "Out of file descriptors, not accepting clients for a while\n");
+            forgetSocket(tLoop, tServerSock);
+            tAccepting = FALSE;
+            tResumeAt = time(NULL) + (ACCEPT_RETRY_MS + 999) / 1000;
+          }
         }
         else
         {
-          slog(LOG_DEBUG_VV, "Child now busy handling new client\n");
-          close(tClientSock);
+          serviceClient(tLoop, tReady[tIdx].data, tReady[tIdx].events);
         }
       }
-      else
-      {
-        // failed to init server socket....try waiting a moment...
-        sleep(2);
-      }
     }
   }
 
@@ -305,62 +463,42 @@ int main(int argc, char **argv)
   return 0;
 }
 
-static int findEnd(char *tReadBuf)
+// Takes every client waiting. FALSE if accept() ran out of descriptors
+// or memory, leaving the rest waiting.
+static int acceptClients(struct eventLoop *pLoop, int pServerSock, struct addrinfo *pAddrInfo,
+                          char *pPassword, char *pHWADDR)
 {
-  // find \n\n, \r\n\r\n, or \r\r is found
-  int tIdx = 0;
-  int tLen = strlen(tReadBuf);
-  for(tIdx = 0; tIdx < tLen; tIdx++)
+  int tClientSock = 0;
+  while((tClientSock = acceptClient(pServerSock, pAddrInfo)) >= 0)
   {
-    if(tReadBuf[tIdx] == '\r')
+    slog(LOG_DEBUG, "...Accepted Client Connection..\n");
+    struct connection *tConn = malloc(sizeof(struct connection));
+    initConnection(tConn, tClientSock, pPassword);
+    tConn->hwid = pHWADDR;
+    initPeerAddress(tConn);
+    if(setNonBlocking(tClientSock) == ERROR ||
+       watchSocket(pLoop, tClientSock, EVENT_READ, tConn) == ERROR)
     {
-      if(tIdx + 1 < tLen)
-      {
-        if(tReadBuf[tIdx+1] == '\r')
-        {
-          return (tIdx+1);
-        }
-        else if(tIdx+3 < tLen)
-        {
-          if(tReadBuf[tIdx+1] == '\n' &&
-             tReadBuf[tIdx+2] == '\r' &&
-             tReadBuf[tIdx+3] == '\n')
-          {
-            return (tIdx+3);
-          }
-        }
-      }
-    }
-    else if(tReadBuf[tIdx] == '\n')
-    {
-      if(tIdx + 1 < tLen && tReadBuf[tIdx+1] == '\n')
-      {
-        return (tIdx + 1);
-      }
+      closeClient(pLoop, tConn);
     }
   }
-  // Found nothing
-  return -1;
+  if(errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM)
+  {
+    return FALSE;
+  }
+  return TRUE;
 }
 
-static void handleClient(int pSock, char *pPassword, char *pHWADDR)
+// The address the client reached us on, which goes into the Apple-Response
+static void initPeerAddress(struct connection *pConn)
 {
-  slog(LOG_DEBUG_VV, "In Handle Client\n");
-  fflush(stdout);
-
   socklen_t len;
   struct sockaddr_storage addr;
-  #ifdef AF_INET6
-  unsigned char ipbin[INET6_ADDRSTRLEN];
-  #else
-  unsigned char ipbin[INET_ADDRSTRLEN];
-  #endif
-  unsigned int ipbinlen;
   int port;
   char ipstr[64];
 
   len = sizeof addr;
-  getsockname(pSock, (struct sockaddr*)&addr, &len);
+  getsockname(pConn->clientSocket, (struct sockaddr*)&addr, &len);
 
   // deal with both IPv4 and IPv6:
   if (addr.ss_family == AF_INET) {
@@ -368,8 +506,8 @@ static void handleClient(int pSock, char *pPassword, char *pHWADDR)
       struct sockaddr_in *s = (struct sockaddr_in *)&addr;
       port = ntohs(s->sin_port);
       inet_ntop(AF_INET, &s->sin_addr, ipstr, sizeof ipstr);
-      memcpy(ipbin, &s->sin_addr, 4);
-      ipbinlen = 4;
+      memcpy(pConn->ipBin, &s->sin_addr, 4);
+      pConn->ipBinLen = 4;
   } else { // AF_INET6
       slog(LOG_DEBUG_V, "Constructing ipv6 address\n");
       struct sockaddr_in6 *s = (struct sockaddr_in6 *)&addr;
@@ -385,128 +523,219 @@ static void handleClient(int pSock, char *pPassword, char *pHWADDR)
       if(memcmp(&addr.bin[0], "\x00\x00\x00\x00" "\x00\x00\x00\x00" "\x00\x00\xff\xff", 12) == 0)
       {
         // its ipv4...
-        memcpy(ipbin, &addr.bin[12], 4);
-        ipbinlen = 4;
+        memcpy(pConn->ipBin, &addr.bin[12], 4);
+        pConn->ipBinLen = 4;
       }
       else
       {
-        memcpy(ipbin, &s->sin6_addr, 16);
-        ipbinlen = 16;
+        memcpy(pConn->ipBin, &s->sin6_addr, 16);
+        pConn->ipBinLen = 16;
       }
   }
 
   slog(LOG_DEBUG_V, "Peer IP address: %s\n", ipstr);
   slog(LOG_DEBUG_V, "Peer port      : %d\n", port);
+}
 
-  int tMoreDataNeeded = 1;
-  struct keyring     tKeys;
-  struct comms       tComms;
-  struct connection  tConn;
-  initConnection(&tConn, &tKeys, &tComms, pSock, pPassword);
-
-  while(1)
+// A client is either reading a request or, once it has one, writing the
+// response; it only waits to write when the socket is full. Requests
+// pipelined behind the one answered are answered in turn.
+static void serviceClient(struct eventLoop *pLoop, struct connection *pConn, int pEvents)
+{
+  if((pEvents & EVENT_READ) && pConn->resp.count == 0)
   {
-    tMoreDataNeeded = 1;
+    int tError = readDataFromClient(pConn);
+    if(tError)
+    {
+      slog(LOG_DEBUG, "Error reading from socket, closing client\n");
+      closeClient(pLoop, pConn);
+      return;
+    }
+  }
 
-    initBuffer(&tConn.recv, 80); // Just a random, small size to seed the buffer with.
-    initBuffer(&tConn.resp, 80);
-    
-    int tError = FALSE;
-    while(1 == tMoreDataNeeded)
+  while(TRUE)
+  {
+    if(pConn->resp.count > 0)
     {
-      tError = readDataFromClient(pSock, &(tConn.recv));
-      if(!tError && strlen(tConn.recv.data) > 0)
+      int tDone = writeDataToClient(pConn);
+      if(tDone == ERROR)
       {
-        slog(LOG_DEBUG_VV, "Finished Reading some data from client\n");
-        // parse client request
-        tMoreDataNeeded = parseMessage(&tConn, ipbin, ipbinlen, pHWADDR);
-        if(1 == tMoreDataNeeded)
-        {
-          slog(LOG_DEBUG_VV, "\n\nNeed to read more data\n");
-        }
-        else if(-1 == tMoreDataNeeded) // Forked process down below ended.
-        {
-          slog(LOG_DEBUG_V, "Forked Process ended...cleaning up\n");
-          cleanup(&tConn);
-          // pSock was already closed
-          return;
-        }
-        // if more data needed,
+        closeClient(pLoop, pConn);
+        return;
       }
-      else
+      if(!tDone)
+      {
+        // the socket is full; carry on when it drains, reading nothing new
+        watchSocket(pLoop, pConn->clientSocket, EVENT_WRITE, pConn);
+        return;
+      }
+      // the response may have pointed into the request, so it stays till now
+      dropRequest(pConn);
+      if(pConn->closing)
       {
-        slog(LOG_DEBUG, "Error reading from socket, closing client\n");
-        // Error reading data....quit.
-        cleanup(&tConn);
+        slog(LOG_DEBUG_V, "Session ended...cleaning up\n");
+        closeClient(pLoop, pConn);
         return;
       }
     }
-    slog(LOG_DEBUG_VV, "Writing: %d chars to socket\n", tConn.resp.current);
-    //tConn->resp.data[tConn->resp.current-1] = '\0';
-    writeDataToClient(pSock, &(tConn.resp));
-   // Finished reading one message...
-    cleanupBuffers(&tConn);
+
+    if(pConn->recv.current == 0)
+    {
+      break;
+    }
+    int tState = rtspParse(&(pConn->request), pConn->recv.data, pConn->recv.current);
+    if(tState == RTSP_BAD)
+    {
+      slog(LOG_INFO, "Malformed or oversized request, closing client\n");
+      closeClient(pLoop, pConn);
+      return;
+    }
+    if(tState == RTSP_INCOMPLETE)
+    {
+      slog(LOG_DEBUG_VV, "Need to read more data\n");
+      break;
+    }
+    answerRequest(pConn);
+    if(pConn->starting)
+    {
+      // nothing more from this client until its session is up
+      forgetSocket(pLoop, pConn->clientSocket);
+      return;
+    }
+    slog(LOG_DEBUG_VV, "Writing: %d chars to socket\n", pConn->resp.length);
+  }
+
+  if(pEvents & EVENT_WRITE)
+  {
+    watchSocket(pLoop, pConn->clientSocket, EVENT_READ, pConn);
   }
-  cleanup(&tConn);
-  fflush(stdout);
 }
 
-static void writeDataToClient(int pSock, struct shairbuffer *pResponse)
+// Answers the request at the front of the receive buffer, which stays
+// there until the answer has been sent.
+static void answerRequest(struct connection *pConn)
 {
-  slog(LOG_DEBUG_VV, "\n----Beg Send Response Header----\n%.*s\n", pResponse->current, pResponse->data);
-  send(pSock, pResponse->data, pResponse->current,0);
-  slog(LOG_DEBUG_VV, "----Send Response Header----\n");
+  struct shairbuffer *tRecv = &(pConn->recv);
+  int tLength = pConn->request.length;
+
+  pConn->scratch.used = 0;
+  clearResponse(pConn);
+
+  // end the request for the handlers that search it as a string; there
+  // is always a byte to spare past what has been read
+  char tNext = tRecv->data[tLength];
+  tRecv->data[tLength] = '\0';
+  pConn->closing = (-1 == parseMessage(pConn, pConn->ipBin, pConn->ipBinLen, pConn->hwid)); // Torn down; close once the reply is out
+  tRecv->data[tLength] = tNext;
 }
 
-static int readDataFromClient(int pSock, struct shairbuffer *pClientBuffer)
+// Drops the answered request from the receive buffer, leaving whatever
+// came in behind it.
+static void dropRequest(struct connection *pConn)
 {
-  char tReadBuf[MAX_SIZE];
-  tReadBuf[0] = '\0';
-
-  int tRetval = 1;
-  int tEnd = -1;
-  while(tRetval > 0 && tEnd < 0)
-  {
-     // Read from socket until \n\n, \r\n\r\n, or \r\r is found
-      slog(LOG_DEBUG_V, "Waiting To Read...\n");
-      fflush(stdout);
-      tRetval = read(pSock, tReadBuf, MAX_SIZE);
-      // if new buffer contains the end of request string, only copy partial buffer?
-      tEnd = findEnd(tReadBuf);
-      if(tEnd >= 0)
-      {
-        if(pClientBuffer->marker == 0)
-        {
-          pClientBuffer->marker = tEnd+1; // Marks start of content
-        }
-        slog(SOCKET_LOG_LEVEL, "Found end of http request at: %d\n", tEnd);
-        fflush(stdout);        
-      }
-      else
-      {
-        tEnd = MAX_SIZE;
-        slog(SOCKET_LOG_LEVEL, "Read %d of data so far\n%s\n", tRetval, tReadBuf);
-        fflush(stdout);
-      }
-      if(tRetval > 0)
-      {
-        // Copy read data into tReceive;
-        slog(SOCKET_LOG_LEVEL, "Read %d data, using %d of it\n", tRetval, tEnd);
-        addNToShairBuffer(pClientBuffer, tReadBuf, tRetval);
-        slog(LOG_DEBUG_VV, "Finished copying data\n");
-      }
-      else
+  struct shairbuffer *tRecv = &(pConn->recv);
+  int tLength = pConn->request.length;
+
+  tRecv->current -= tLength;
+  memmove(tRecv->data, tRecv->data + tLength, tRecv->current);
+  rtspReset(&(pConn->request));
+}
+
+static void closeClient(struct eventLoop *pLoop, struct connection *pConn)
+{
+  if(pConn->clientSocket != -1)
+  {
+    forgetSocket(pLoop, pConn->clientSocket);
+  }
+  cleanup(pConn);
+  free(pConn);
+}
+
+// 1 when all of the response has gone, 0 if the socket is full, ERROR if
+// the client has gone
+static int writeDataToClient(struct connection *pConn)
+{
+  struct response *tResp = &(pConn->resp);
+  if(tResp->next == 0 && isLogEnabledFor(LOG_DEBUG_VV))
+  {
+    int tIdx = 0;
+    slog(LOG_DEBUG_VV, "\n----Beg Send Response Header----\n");
+    for(tIdx = 0; tIdx < tResp->count; tIdx++)
+    {
+      slog(LOG_DEBUG_VV, "%.*s", (int)tResp->parts[tIdx].iov_len, (char *)tResp->parts[tIdx].iov_base);
+    }
+  }
+  while(tResp->next < tResp->count)
+  {
+    int tSent = writev(pConn->clientSocket, tResp->parts + tResp->next, tResp->count - tResp->next);
+    if(tSent < 0)
+    {
+      if(errno == EINTR)
       {
-        slog(LOG_DEBUG, "Error reading data from socket, got: %d bytes", tRetval);
-        return tRetval;
+        continue;
       }
+      return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : ERROR;
+    }
+    // step over what went, which may stop partway through a part
+    while(tResp->next < tResp->count && tSent >= tResp->parts[tResp->next].iov_len)
+    {
+      tSent -= tResp->parts[tResp->next].iov_len;
+      tResp->next++;
+    }
+    if(tSent > 0)
+    {
+      tResp->parts[tResp->next].iov_base = (char *)tResp->parts[tResp->next].iov_base + tSent;
+      tResp->parts[tResp->next].iov_len -= tSent;
+    }
   }
-  if(tEnd + 1 != tRetval)
+  clearResponse(pConn);
+  slog(LOG_DEBUG_VV, "----Send Response Header----\n");
+  return 1;
+}
+
+// Reads whatever the socket has, straight into the receive buffer, until
+// it is drained or holds as much as a request may be. 0 when done, or an
+// error (or end of file) otherwise.
+static int readDataFromClient(struct connection *pConn)
+{
+  struct shairbuffer *pClientBuffer = &(pConn->recv);
+
+  if(pClientBuffer->data == NULL)
   {
-    slog(SOCKET_LOG_LEVEL, "Read more data after end of http request. %d instead of %d\n", tRetval, tEnd+1);
+    initBuffer(pClientBuffer, MAX_SIZE);
   }
-  slog(SOCKET_LOG_LEVEL, "Finished Reading Data:\n%s\nEndOfData\n", pClientBuffer->data);
-  fflush(stdout);
+  while(pClientBuffer->current < RTSP_MAX_REQUEST)
+  {
+    // keep a byte spare, to end the request with
+    if(getAvailChars(pClientBuffer) <= 1)
+    {
+      int tNewSize = pClientBuffer->maxsize * 2;
+      if(tNewSize > RTSP_MAX_REQUEST + 1)
+      {
+        tNewSize = RTSP_MAX_REQUEST + 1;
+      }
+      pClientBuffer->data = realloc(pClientBuffer->data, tNewSize);
+      pClientBuffer->maxsize = tNewSize;
+    }
+    int tRetval = read(pConn->clientSocket, pClientBuffer->data + pClientBuffer->current,
+                       getAvailChars(pClientBuffer) - 1);
+    if(tRetval < 0 && errno == EINTR)
+    {
+      continue;
+    }
+    if(tRetval < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+    {
+      break;
+    }
+    if(tRetval <= 0)
+    {
+      slog(LOG_DEBUG, "Error reading data from socket, got: %d bytes", tRetval);
+      return tRetval == 0 ? ERROR : tRetval;
+    }
+    slog(SOCKET_LOG_LEVEL, "Read %d data\n", tRetval);
+    pClientBuffer->current += tRetval;
+  }
+  slog(SOCKET_LOG_LEVEL, "Finished Reading Data:\n%.*s\nEndOfData\n", pClientBuffer->current, pClientBuffer->data);
   return 0;
 }
 
@@ -546,11 +775,6 @@ static char *getFromBuffer(char *pBufferPtr, const char *pField, int pLenAfterFi
   return tFound;
 }
 
-static char *getFromHeader(char *pHeaderPtr, const char *pField, int *pReturnSize)
-{
-  return getFromBuffer(pHeaderPtr, pField, 2, pReturnSize, "\r\n");
-}
-
 static char *getFromContent(char *pContentPtr, const char* pField, int *pReturnSize)
 {
   return getFromBuffer(pContentPtr, pField, 1, pReturnSize, "\r\n");
@@ -561,6 +785,39 @@ static char *getFromSetup(char *pContentPtr, const char* pField, int *pReturnSiz
   return getFromBuffer(pContentPtr, pField, 1, pReturnSize, ";\r\n");
 }
 
+// Drift is a property of the sender's clock against our output's, so
+// that pair is the key. iTunes identifies itself with DACP-ID; anything
+// else is known by its address.
+static void getDriftKey(struct connection *pConn, char *pKey, int pKeySize)
+{
+  char tSender[64] = "";
+  int tSize = 0;
+  char *tFound = rtspHeader(&(pConn->request), pConn->recv.data, "DACP-ID", &tSize);
+  if(tFound != NULL && tSize > 0 && tSize < sizeof(tSender))
+  {
+    getTrimmed(tFound, tSize, TRUE, FALSE, tSender);
+  }
+  else
+  {
+    struct sockaddr_storage tAddr;
+    socklen_t tLen = sizeof(tAddr);
+    if(getpeername(pConn->clientSocket, (struct sockaddr *)&tAddr, &tLen) != 0 ||
+       getnameinfo((struct sockaddr *)&tAddr, tLen, tSender, sizeof(tSender), NULL, 0, NI_NUMERICHOST) != 0)
+    {
+      strcpy(tSender, "unknown");
+    }
+  }
+  snprintf(pKey, pKeySize, "%s@%s", tSender, kDriftDevice);
+  char *tChar = pKey;
+  for(; *tChar; tChar++)
+  {
+    if(*tChar <= ' ')
+    {
+      *tChar = '_';
+    }
+  }
+}
+
 // Handles compiling the Apple-Challenge, HWID, and Server IP Address
 // Into the response the airplay client is expecting.
 static int buildAppleResponse(struct connection *pConn, unsigned char *pIpBin,
@@ -568,17 +825,20 @@ static int buildAppleResponse(struct connection *pConn, unsigned char *pIpBin,
 {
   // Find Apple-Challenge
   char *tResponse = NULL;
+  int tResponseLen = 0;
 
   int tFoundSize = 0;
-  char* tFound = getFromHeader(pConn->recv.data, "Apple-Challenge", &tFoundSize);
+  char* tFound = rtspHeader(&(pConn->request), pConn->recv.data, "Apple-Challenge", &tFoundSize);
   if(tFound != NULL)
   {
-    char tTrim[tFoundSize + 2];
-    getTrimmed(tFound, tFoundSize, TRUE, TRUE, tTrim);
-    slog(LOG_DEBUG_VV, "HeaderChallenge:  [%s] len: %d  sizeFound: %d\n", tTrim, strlen(tTrim), tFoundSize);
-    int tChallengeDecodeSize = 16;
-    char *tChallenge = decode_base64((unsigned char *)tTrim, tFoundSize, &tChallengeDecodeSize);
+    slog(LOG_DEBUG_VV, "HeaderChallenge:  [%.*s] sizeFound: %d\n", tFoundSize, tFound, tFoundSize);
+    unsigned char *tChallenge = (unsigned char *)arenaAlloc(&(pConn->scratch), BASE64_DECODED_SIZE(tFoundSize));
+    int tChallengeDecodeSize = tChallenge != NULL ? decodeBase64(tFound, tFoundSize, tChallenge) : ERROR;
     slog(LOG_DEBUG_VV, "Challenge Decode size: %d  expected 16\n", tChallengeDecodeSize);
+    if(tChallengeDecodeSize < 0 || tChallengeDecodeSize > 16)
+    {
+      return FALSE;
+    }
 
     int tCurSize = 0;
     unsigned char tChalResp[38];
@@ -599,34 +859,37 @@ static int buildAppleResponse(struct connection *pConn, unsigned char *pIpBin,
       tCurSize += tPad;
     }
 
-    char *tTmp = encode_base64((unsigned char *)tChalResp, tCurSize);
-    slog(LOG_DEBUG_VV, "Full sig: %s\n", tTmp);
-    free(tTmp);
+    if(isLogEnabledFor(LOG_DEBUG_VV))
+    {
+      char tTmp[BASE64_ENCODED_SIZE(sizeof(tChalResp))];
+      encodeBase64(tChalResp, tCurSize, tTmp);
+      slog(LOG_DEBUG_VV, "Full sig: %s\n", tTmp);
+    }
 
     // RSA Encrypt
-    RSA *rsa = loadKey();  // Free RSA
+    RSA *rsa = loadKey();
     int tSize = RSA_size(rsa);
     unsigned char tTo[tSize];
     RSA_private_encrypt(tCurSize, (unsigned char *)tChalResp, tTo, rsa, RSA_PKCS1_PADDING);
     
     // Wrap RSA Encrypted binary in Base64 encoding
-    tResponse = encode_base64(tTo, tSize);
-    int tLen = strlen(tResponse);
-    while(tLen > 1 && tResponse[tLen-1] == '=')
+    tResponse = arenaAlloc(&(pConn->scratch), BASE64_ENCODED_SIZE(tSize));
+    if(tResponse != NULL)
     {
-      tResponse[tLen-1] = '\0';
+      tResponseLen = encodeBase64(tTo, tSize, tResponse);
+      while(tResponseLen > 1 && tResponse[tResponseLen-1] == '=')
+      {
+        tResponse[--tResponseLen] = '\0';
+      }
     }
-    free(tChallenge);
-    RSA_free(rsa);
   }
 
   if(tResponse != NULL)
   {
     // Append to current response
-    addToShairBuffer(&(pConn->resp), "Apple-Response: ");
-    addToShairBuffer(&(pConn->resp), tResponse);
-    addToShairBuffer(&(pConn->resp), "\r\n");
-    free(tResponse);
+    addStaticPart(pConn, "Apple-Response: ");
+    addPart(pConn, tResponse, tResponseLen);
+    addStaticPart(pConn, "\r\n");
     return TRUE;
   }
   return FALSE;
@@ -635,47 +898,19 @@ static int buildAppleResponse(struct connection *pConn, unsigned char *pIpBin,
 //parseMessage(tConn->recv.data, tConn->recv.mark, &tConn->resp, ipstr, pHWADDR, tConn->keys);
 static int parseMessage(struct connection *pConn, unsigned char *pIpBin, unsigned int pIpBinLen, char *pHWID)
 {
-  int tReturn = 0; // 0 = good, 1 = Needs More Data, -1 = close client socket.
-  if(pConn->resp.data == NULL)
-  {
-    initBuffer(&(pConn->resp), MAX_SIZE);
-  }
-
-  char *tContent = getFromHeader(pConn->recv.data, "Content-Length", NULL);
-  if(tContent != NULL)
-  {
-    int tContentSize = atoi(tContent);
-    if(pConn->recv.marker == 0 || strlen(pConn->recv.data+pConn->recv.marker) != tContentSize)
-    {
-      if(isLogEnabledFor(HEADER_LOG_LEVEL))
-      {
-        slog(HEADER_LOG_LEVEL, "Content-Length: %s value -> %d\n", tContent, tContentSize);
-        if(pConn->recv.marker != 0)
-        {
-          slog(HEADER_LOG_LEVEL, "ContentPtr has %d, but needs %d\n", 
-                  strlen(pConn->recv.data+pConn->recv.marker), tContentSize);
-        }
-      }
-      // check if value in tContent > 2nd read from client.
-      return 1; // means more content-length needed
-    }
-  }
-  else
-  {
-    slog(LOG_DEBUG_VV, "No content, header only\n");
-  }
+  int tReturn = 0; // 0 = good, -1 = close client socket.
 
   // "Creates" a new Response Header for our response message
-  addToShairBuffer(&(pConn->resp), "RTSP/1.0 200 OK\r\n");
+  addStaticPart(pConn, "RTSP/1.0 200 OK\r\n");
 
   if(isLogEnabledFor(LOG_INFO))
   {
-    int tLen = strchr(pConn->recv.data, ' ') - pConn->recv.data;
-    if(tLen < 0 || tLen > 20)
+    int tLen = pConn->request.method.length;
+    if(tLen > 20)
     {
       tLen = 20;
     }
-    slog(LOG_INFO, "********** RECV %.*s **********\n", tLen, pConn->recv.data);
+    slog(LOG_INFO, "********** RECV %.*s **********\n", tLen, pConn->recv.data + pConn->request.method.offset);
   }
 
   if(pConn->password != NULL)
@@ -689,46 +924,49 @@ static int parseMessage(struct connection *pConn, unsigned char *pIpBin, unsigne
   }
 
   // Find option, then based on option, do different actions.
-  if(strncmp(pConn->recv.data, "OPTIONS", 7) == 0)
+  if(rtspIsMethod(&(pConn->request), pConn->recv.data, "OPTIONS"))
   {
     propogateCSeq(pConn);
-    addToShairBuffer(&(pConn->resp),
+    addStaticPart(pConn,
       "Public: ANNOUNCE, SETUP, RECORD, PAUSE, FLUSH, TEARDOWN, OPTIONS, GET_PARAMETER, SET_PARAMETER\r\n");
   }
-  else if(!strncmp(pConn->recv.data, "ANNOUNCE", 8))
+  else if(rtspIsMethod(&(pConn->request), pConn->recv.data, "ANNOUNCE"))
   {
-    char *tContent = pConn->recv.data + pConn->recv.marker;
+    char *tContent = pConn->recv.data + pConn->request.bodyStart;
     int tSize = 0;
     char *tHeaderVal = getFromContent(tContent, "a=aesiv", &tSize); // Not allocated memory, just pointing
     if(tSize > 0)
     {
-      int tKeySize = 0;
-      char tEncodedAesIV[tSize + 2];
-      getTrimmed(tHeaderVal, tSize, TRUE, TRUE, tEncodedAesIV);
-      slog(LOG_DEBUG_VV, "AESIV: [%.*s] Size: %d  Strlen: %d\n", tSize, tEncodedAesIV, tSize, strlen(tEncodedAesIV));
-      char *tDecodedIV =  decode_base64((unsigned char*) tEncodedAesIV, tSize, &tSize);
+      // decoded into the scratch arena, and copied out of it into the keyring
+      slog(LOG_DEBUG_VV, "AESIV: [%.*s] Size: %d\n", tSize, tHeaderVal, tSize);
+      unsigned char *tDecodedIV = (unsigned char *)arenaAlloc(&(pConn->scratch), BASE64_DECODED_SIZE(tSize));
+      int tIVSize = tDecodedIV != NULL ? decodeBase64(tHeaderVal, tSize, tDecodedIV) : ERROR;
 
-      // grab the key, copy it out of the receive buffer
+      int tKeySize = 0;
       tHeaderVal = getFromContent(tContent, "a=rsaaeskey", &tKeySize);
-      char tEncodedAesKey[tKeySize + 2]; // +1 for nl, +1 for \0
-      getTrimmed(tHeaderVal, tKeySize, TRUE, TRUE, tEncodedAesKey);
-      slog(LOG_DEBUG_VV, "AES KEY: [%s] Size: %d  Strlen: %d\n", tEncodedAesKey, tKeySize, strlen(tEncodedAesKey));
-      // remove base64 coding from key
-      char *tDecodedAesKey = decode_base64((unsigned char*) tEncodedAesKey,
-                              tKeySize, &tKeySize);  // Need to free DecodedAesKey
+      slog(LOG_DEBUG_VV, "AES KEY: [%.*s] Size: %d\n", tKeySize, tHeaderVal, tKeySize);
+      unsigned char *tDecodedAesKey = tHeaderVal == NULL ? NULL :
+        (unsigned char *)arenaAlloc(&(pConn->scratch), BASE64_DECODED_SIZE(tKeySize));
+      tKeySize = tDecodedAesKey != NULL ? decodeBase64(tHeaderVal, tKeySize, tDecodedAesKey) : ERROR;
 
       // Grab the formats
       int tFmtpSize = 0;
-      char *tFmtp = getFromContent(tContent, "a=fmtp", &tFmtpSize);  // Don't need to free
-      tFmtp = getTrimmedMalloc(tFmtp, tFmtpSize, TRUE, FALSE); // will need to free
-      slog(LOG_DEBUG_VV, "Format: %s\n", tFmtp);
+      char *tFmtp = getFromContent(tContent, "a=fmtp", &tFmtpSize);
 
       RSA *rsa = loadKey();
+      unsigned char *tDecryptedKey = (unsigned char *)arenaAlloc(&(pConn->scratch), RSA_size(rsa));
+      if(tIVSize != sizeof(pConn->keys.aesiv) || tKeySize < 0 || tDecryptedKey == NULL ||
+         tFmtp == NULL || tFmtpSize >= FMTP_SIZE)
+      {
+        slog(LOG_INFO, "Can't make out the stream's key, IV or format\n");
+        clearResponse(pConn);
+        addStaticPart(pConn, "RTSP/1.0 400 Bad Request\r\n");
+        propogateCSeq(pConn);
+        addStaticPart(pConn, "\r\n");
+        return 0;
+      }
       // Decrypt the binary aes key
-      char *tDecryptedKey = malloc(RSA_size(rsa) * sizeof(char)); // Need to Free Decrypted key
-      //char tDecryptedKey[RSA_size(rsa)];
-      if(RSA_private_decrypt(tKeySize, (unsigned char *)tDecodedAesKey, 
-      (unsigned char*) tDecryptedKey, rsa, RSA_PKCS1_OAEP_PADDING) >= 0)
+      if(RSA_private_decrypt(tKeySize, tDecodedAesKey, tDecryptedKey, rsa, RSA_PKCS1_OAEP_PADDING) >= 0)
       {
         slog(LOG_DEBUG, "Decrypted AES key from RSA Successfully\n");
       }
@@ -736,155 +974,127 @@ static int parseMessage(struct connection *pConn, unsigned char *pIpBin, unsigne
       {
         slog(LOG_INFO, "Error Decrypting AES key from RSA\n");
       }
-      free(tDecodedAesKey);
-      RSA_free(rsa);
 
-      setKeys(pConn->keys, tDecodedIV, tDecryptedKey, tFmtp);
+      memcpy(pConn->keys.aesiv, tDecodedIV, sizeof(pConn->keys.aesiv));
+      memcpy(pConn->keys.aeskey, tDecryptedKey, sizeof(pConn->keys.aeskey));
+      getTrimmed(tFmtp, tFmtpSize, TRUE, FALSE, pConn->keys.fmt);
+      pConn->keys.set = TRUE;
+      slog(LOG_DEBUG_VV, "Format: %s\n", pConn->keys.fmt);
 
       propogateCSeq(pConn);
     }
   }
-  else if(!strncmp(pConn->recv.data, "SETUP", 5))
+  else if(rtspIsMethod(&(pConn->request), pConn->recv.data, "SETUP"))
   {
-    // Setup pipes
-    struct comms *tComms = pConn->hairtunes;
-    if (! (pipe(tComms->in) == 0 && pipe(tComms->out) == 0))
+    // a second SETUP replaces the stream
+    endSession(pConn);
+
+    if(!kOutputShared && kOutputOwner != NULL)
     {
-      slog(LOG_INFO, "Error setting up hairtunes communications...some things probably wont work very well.\n");
+      slog(LOG_INFO, "Output busy with another stream\n");
+      refuseSetup(pConn);
+      return 0;
     }
-    
-    // Setup fork
-    char tPort[8] = "6000";  // get this from dup()'d stdout of child pid
 
-    int tPid = fork();
-    if(tPid == 0)
-    {
-      int tDataport=0;
-      char tCPortStr[8] = "59010";
-      char tTPortStr[8] = "59012";
-      int tSize = 0;
-
-      char *tFound  =getFromSetup(pConn->recv.data, "control_port", &tSize);
-      getTrimmed(tFound, tSize, 1, 0, tCPortStr);
-      tFound = getFromSetup(pConn->recv.data, "timing_port", &tSize);
-      getTrimmed(tFound, tSize, 1, 0, tTPortStr);
-
-      slog(LOG_DEBUG_VV, "converting %s and %s from str->int\n", tCPortStr, tTPortStr);
-      int tControlport = atoi(tCPortStr);
-      int tTimingport = atoi(tTPortStr);
-
-      slog(LOG_DEBUG_V, "Got %d for CPort and %d for TPort\n", tControlport, tTimingport);
-      char *tRtp = NULL;
-      char *tPipe = NULL;
-      char *tAoDriver = NULL;
-      char *tAoDeviceName = NULL;
-      char *tAoDeviceId = NULL;
-
-      // *************************************************
-      // ** Setting up Pipes, AKA no more debug/output  **
-      // *************************************************
-      dup2(tComms->in[0],0);   // Input to child
-      closePipe(&(tComms->in[0]));
-      closePipe(&(tComms->in[1]));
-
-      dup2(tComms->out[1], 1); // Output from child
-      closePipe(&(tComms->out[1]));
-      closePipe(&(tComms->out[0]));
-
-      struct keyring *tKeys = pConn->keys;
-      pConn->keys = NULL;
-      pConn->hairtunes = NULL;
-
-      // Free up any recv buffers, etc..
-      if(pConn->clientSocket != -1)
+    // Take a port pair up front; without a pool the decoder probes for one
+    if(kPortPool != NULL)
+    {
+      if(pConn->rtpPort > 0)
       {
-        close(pConn->clientSocket);
-        pConn->clientSocket = -1;
+        releasePortPair(kPortPool, pConn->rtpPort);
       }
-      cleanupBuffers(pConn);
-      hairtunes_init(tKeys->aeskey, tKeys->aesiv, tKeys->fmt, tControlport, tTimingport,
-                      tDataport, tRtp, tPipe, tAoDriver, tAoDeviceName, tAoDeviceId,
-                      bufferStartFill);
+      pConn->rtpPort = takePortPair(kPortPool);
+      if(pConn->rtpPort == ERROR)
+      {
+        pConn->rtpPort = 0;
+        slog(LOG_INFO, "No free RTP ports left in range\n");
+        refuseSetup(pConn);
+        return 0;
+      }
+    }
 
-      // Quit when finished.
-      slog(LOG_DEBUG, "Returned from hairtunes init....returning -1, should close out this whole side of the fork\n");
-      return -1;
+    char tCPortStr[8] = "59010";
+    int tSize = 0;
+    int tTransportSize = 0;
+
+    // control_port is one of the Transport parameters
+    char *tTransport = rtspHeader(&(pConn->request), pConn->recv.data, "Transport", &tTransportSize);
+    char tTransportStr[tTransportSize + 1];
+    getTrimmed(tTransport, tTransportSize, TRUE, FALSE, tTransportStr);
+    char *tFound = getFromSetup(tTransportStr, "control_port", &tSize);
+    if(tFound != NULL && tSize < sizeof(tCPortStr))
+    {
+      getTrimmed(tFound, tSize, TRUE, FALSE, tCPortStr);
     }
-    else if(tPid >0)
+
+    slog(LOG_DEBUG_VV, "converting %s from str->int\n", tCPortStr);
+    struct hairtunes_setup tSetup;
+    memset(&tSetup, 0, sizeof(tSetup));
+    if(pConn->keys.set)
+    {
+      tSetup.aeskey = pConn->keys.aeskey;
+      tSetup.aesiv = pConn->keys.aesiv;
+      tSetup.fmtp = pConn->keys.fmt;
+    }
+    tSetup.control_port = atoi(tCPortStr);
+    tSetup.data_port = pConn->rtpPort;
+    tSetup.start_fill = bufferStartFill;
+    slog(LOG_DEBUG_V, "Got %d for CPort\n", tSetup.control_port);
+
+    // start from what the last session with this sender learned
+    getDriftKey(pConn, pConn->driftKey, sizeof(pConn->driftKey));
+    if(kDriftCache != NULL && lookupDrift(kDriftCache, pConn->driftKey, &tSetup.drift))
     {
-      // Ensure Connection has access to the pipe.
-      closePipe(&(tComms->in[0]));
-      closePipe(&(tComms->out[1]));
+      slog(LOG_DEBUG, "Seeding clock drift for %s: %.2f ppm\n", pConn->driftKey, tSetup.drift);
+      tSetup.drift_known = TRUE;
+    }
 
-      char tFromHairtunes[80];
-      int tRead = read(tComms->out[0], tFromHairtunes, 80);
-      if(tRead <= 0)
-      {
-        slog(LOG_INFO, "Error reading port from hairtunes function, assuming default port: %d\n", tPort);
-      }
-      else
-      {
-        int tSize = 0;
-        char *tPortStr = getFromHeader(tFromHairtunes, "port", &tSize);
-        if(tPortStr != NULL)
-        {
-          getTrimmed(tPortStr, tSize, TRUE, FALSE, tPort);
-        }
-        else
-        {
-          slog(LOG_INFO, "Read %d bytes, Error translating %s into a port\n", tRead, tFromHairtunes);
-        }
-      }
-      //  READ Ports from here?close(pConn->hairtunes_pipes[0]);
-      propogateCSeq(pConn);
-      int tSize = 0;
-      char *tTransport = getFromHeader(pConn->recv.data, "Transport", &tSize);
-      addToShairBuffer(&(pConn->resp), "Transport: ");
-      addNToShairBuffer(&(pConn->resp), tTransport, tSize);
-      // Append server port:
-      addToShairBuffer(&(pConn->resp), ";server_port=");
-      addToShairBuffer(&(pConn->resp), tPort);
-      addToShairBuffer(&(pConn->resp), "\r\nSession: DEADBEEF\r\n");
+    // the stream runs on threads of this process, no fork needed; the
+    // rest of the answer waits for it
+    if(!kOutputShared)
+    {
+      kOutputOwner = pConn;
     }
-    else
+    if(startSession(pConn, &tSetup))
     {
-      slog(LOG_INFO, "Error forking process....dere' be errors round here.\n");
-      return -1;
+      return 0;
     }
   }
-  else if(!strncmp(pConn->recv.data, "TEARDOWN", 8))
+  else if(rtspIsMethod(&(pConn->request), pConn->recv.data, "TEARDOWN"))
   {
     // Be smart?  Do more finish up stuff...
-    addToShairBuffer(&(pConn->resp), "Connection: close\r\n");
+    addStaticPart(pConn, "Connection: close\r\n");
     propogateCSeq(pConn);
-    close(pConn->hairtunes->in[1]);
-    slog(LOG_DEBUG, "Tearing down connection, closing pipes\n");
-    //close(pConn->hairtunes->out[0]);
+    slog(LOG_DEBUG, "Tearing down connection, stopping the stream\n");
+    endSession(pConn);
     tReturn = -1;  // Close client socket, but sends an ACK/OK packet first
   }
-  else if(!strncmp(pConn->recv.data, "FLUSH", 5))
+  else if(rtspIsMethod(&(pConn->request), pConn->recv.data, "FLUSH"))
   {
-    write(pConn->hairtunes->in[1], "flush\n", 6);
+    if(pConn->session != NULL)
+    {
+      hairtunes_flush(pConn->session);
+    }
     propogateCSeq(pConn);
   }
-  else if(!strncmp(pConn->recv.data, "SET_PARAMETER", 13))
+  else if(rtspIsMethod(&(pConn->request), pConn->recv.data, "SET_PARAMETER"))
   {
+    // sent over and over while the slider moves: read the number where
+    // it lies, and answer with the usual parts
     propogateCSeq(pConn);
-    int tSize = 0;
-    char *tVol = getFromHeader(pConn->recv.data, "volume", &tSize);
-    slog(LOG_DEBUG_VV, "About to write [vol: %.*s] data to hairtunes\n", tSize, tVol);
-
-    write(pConn->hairtunes->in[1], "vol: ", 5);
-    write(pConn->hairtunes->in[1], tVol, tSize);
-    write(pConn->hairtunes->in[1], "\n", 1);
-    slog(LOG_DEBUG_VV, "Finished writing data write data to hairtunes\n");
+    char *tVol = pConn->recv.data + pConn->request.bodyStart;
+    if(pConn->session != NULL && strncmp(tVol, "volume:", 7) == 0)
+    {
+      slog(LOG_DEBUG_VV, "Setting volume [%s]\n", tVol + 7);
+      hairtunes_volume(pConn->session, atof(tVol + 7));
+    }
   }
   else
   {
     slog(LOG_DEBUG, "\n\nUn-Handled recv: %s\n", pConn->recv.data);
     propogateCSeq(pConn);
   }
-  addToShairBuffer(&(pConn->resp), "\r\n");
+  addStaticPart(pConn, "\r\n");
   return tReturn;
 }
 
@@ -892,11 +1102,10 @@ static int parseMessage(struct connection *pConn, unsigned char *pIpBin, unsigne
 static void propogateCSeq(struct connection *pConn) //char *pRecvBuffer, struct shairbuffer *pConn->recp.data)
 {
   int tSize=0;
-  char *tRecPtr = getFromHeader(pConn->recv.data, "CSeq", &tSize);
-  addToShairBuffer(&(pConn->resp), "Audio-Jack-Status: connected; type=analog\r\n");
-  addToShairBuffer(&(pConn->resp), "CSeq: ");
-  addNToShairBuffer(&(pConn->resp), tRecPtr, tSize);
-  addToShairBuffer(&(pConn->resp), "\r\n");
+  char *tRecPtr = rtspHeader(&(pConn->request), pConn->recv.data, "CSeq", &tSize);
+  addStaticPart(pConn, "Audio-Jack-Status: connected; type=analog\r\nCSeq: ");
+  addPart(pConn, tRecPtr, tSize);
+  addStaticPart(pConn, "\r\n");
 }
 
 void cleanupBuffers(struct connection *pConn)
@@ -906,39 +1115,235 @@ void cleanupBuffers(struct connection *pConn)
     free(pConn->recv.data);
     pConn->recv.data = NULL;
   }
-  if(pConn->resp.data != NULL)
+}
+
+// Stops a stream, keeping what it learned about the sender's clock, and
+// gives back its ports.
+static void stopSession(hairtunes_session_t *pSession, char *pDriftKey, int pRtpPort)
+{
+  double tDrift = 0;
+  if(kDriftCache != NULL && hairtunes_get_drift(pSession, &tDrift))
+  {
+    storeDrift(kDriftCache, pDriftKey, tDrift);
+  }
+  hairtunes_stop(pSession);
+  if(pRtpPort > 0 && kPortPool != NULL)
   {
-    free(pConn->resp.data);
-    pConn->resp.data = NULL;
+    releasePortPair(kPortPool, pRtpPort);
   }
 }
 
-static void cleanup(struct connection *pConn)
+static void *sessionThread(void *pArg)
 {
-  cleanupBuffers(pConn);
-  if(pConn->hairtunes != NULL)
+  pthread_mutex_lock(&kSessionLock);
+  while(TRUE)
   {
+    while(kSessionHead == NULL)
+    {
+      pthread_cond_wait(&kSessionQueued, &kSessionLock);
+    }
+    struct sessionJob *tJob = kSessionHead;
+    kSessionHead = tJob->next;
+    if(kSessionHead == NULL)
+    {
+      kSessionTail = &kSessionHead;
+    }
+    pthread_mutex_unlock(&kSessionLock);
 
-    closePipe(&(pConn->hairtunes->in[0]));
-    closePipe(&(pConn->hairtunes->in[1]));
-    closePipe(&(pConn->hairtunes->out[0]));
-    closePipe(&(pConn->hairtunes->out[1]));
+    if(tJob->conn == NULL)
+    {
+      stopSession(tJob->session, tJob->driftKey, tJob->rtpPort);
+      free(tJob);
+      pthread_mutex_lock(&kSessionLock);
+      continue;
+    }
+    tJob->session = hairtunes_start(&(tJob->setup), &(tJob->ports));
+    pthread_mutex_lock(&kSessionLock);
+    tJob->next = kSessionStarted;
+    kSessionStarted = tJob;
+    if(write(kSessionWake[1], "", 1) < 0 && errno != EAGAIN)
+    {
+      perror("Error waking the event loop");
+    }
   }
-  if(pConn->keys != NULL)
+  return NULL;
+}
+
+// Without the thread, or the memory for a job, sessions are started and
+// stopped inline as a last resort.
+static void startSessionThread(struct eventLoop *pLoop)
+{
+  pthread_t tThread;
+  if(pipe(kSessionWake) < 0)
+  {
+    perror("Error creating the session thread's pipe");
+  }
+  else if(setNonBlocking(kSessionWake[0]) == ERROR || setNonBlocking(kSessionWake[1]) == ERROR ||
+          watchSocket(pLoop, kSessionWake[0], EVENT_READ, kSessionWake) == ERROR ||
+          pthread_create(&tThread, NULL, sessionThread, NULL) != 0)
+  {
+    close(kSessionWake[0]);
+    close(kSessionWake[1]);
+  }
+  else
   {
-    if(pConn->keys->aesiv != NULL)
+    pthread_detach(tThread);
+    kSessionThread = TRUE;
+    return;
+  }
+  slog(LOG_INFO, "Can't start the session thread, starting and stopping sessions inline\n");
+}
+
+static void queueSessionJob(struct sessionJob *pJob)
+{
+  pJob->next = NULL;
+  pthread_mutex_lock(&kSessionLock);
+  *kSessionTail = pJob;
+  kSessionTail = &(pJob->next);
+  pthread_cond_signal(&kSessionQueued);
+  pthread_mutex_unlock(&kSessionLock);
+}
+
+// Hands the stream, and the ports it was using, to the session thread.
+static void endSession(struct connection *pConn)
+{
+  struct sessionJob *tJob = NULL;
+  // stops run in order, so this one is done with the outputs before any
+  // stream set up after it opens them
+  if(kOutputOwner == pConn)
+  {
+    kOutputOwner = NULL;
+  }
+  if(pConn->session == NULL)
+  {
+    return;
+  }
+  if(kSessionThread)
+  {
+    tJob = malloc(sizeof(struct sessionJob));
+  }
+  if(tJob == NULL)
+  {
+    stopSession(pConn->session, pConn->driftKey, pConn->rtpPort);
+  }
+  else
+  {
+    tJob->conn = NULL;
+    tJob->session = pConn->session;
+    tJob->rtpPort = pConn->rtpPort;
+    strcpy(tJob->driftKey, pConn->driftKey);
+    queueSessionJob(tJob);
+  }
+  pConn->session = NULL;
+  pConn->rtpPort = 0;
+}
+
+// TRUE if the session is being started on the session thread, and the
+// connection is to wait for it. The setup points into the connection,
+// which stays put until then.
+static int startSession(struct connection *pConn, struct hairtunes_setup *pSetup)
+{
+  struct sessionJob *tJob = NULL;
+  if(kSessionThread)
+  {
+    tJob = malloc(sizeof(struct sessionJob));
+  }
+  if(tJob == NULL)
+  {
+    struct hairtunes_ports tPorts;
+    hairtunes_session_t *tSession = hairtunes_start(pSetup, &tPorts);
+    answerSetup(pConn, tSession, &tPorts);
+    return FALSE;
+  }
+  tJob->conn = pConn;
+  tJob->session = NULL;
+  tJob->setup = *pSetup;
+  queueSessionJob(tJob);
+  pConn->starting = TRUE;
+  return TRUE;
+}
+
+// A SETUP that can't have a stream now, but might later.
+static void refuseSetup(struct connection *pConn)
+{
+  clearResponse(pConn);
+  addStaticPart(pConn, "RTSP/1.0 453 Not Enough Bandwidth\r\n");
+  propogateCSeq(pConn);
+  addStaticPart(pConn, "\r\n");
+}
+
+// The rest of the answer to a SETUP, but for the blank line that ends it.
+static void answerSetup(struct connection *pConn, hairtunes_session_t *pSession,
+                        struct hairtunes_ports *pPorts)
+{
+  pConn->session = pSession;
+  if(pSession == NULL)
+  {
+    if(kOutputOwner == pConn)
     {
-      free(pConn->keys->aesiv);
+      kOutputOwner = NULL;
     }
-    if(pConn->keys->aeskey != NULL)
+    slog(LOG_INFO, "Decoder could not set up its session (%s)\n", strerror(pPorts->status));
+    clearResponse(pConn);
+    addStaticPart(pConn, "RTSP/1.0 500 Internal Server Error\r\n");
+    propogateCSeq(pConn);
+    return;
+  }
+  int tTransportSize = 0;
+  char *tTransport = rtspHeader(&(pConn->request), pConn->recv.data, "Transport", &tTransportSize);
+  propogateCSeq(pConn);
+  addStaticPart(pConn, "Transport: ");
+  addPart(pConn, tTransport, tTransportSize);
+  // Append server port:
+  char *tPort = arenaAlloc(&(pConn->scratch), 48);
+  if(tPort != NULL)
+  {
+    addPart(pConn, tPort, sprintf(tPort, ";server_port=%d\r\nSession: DEADBEEF\r\n", pPorts->data_port));
+  }
+}
+
+// Answers the SETUPs whose sessions the session thread has started, and
+// carries on with their connections.
+static void answerStarted(struct eventLoop *pLoop)
+{
+  char tDrain[64];
+  while(read(kSessionWake[0], tDrain, sizeof(tDrain)) > 0)
+  {
+  }
+  pthread_mutex_lock(&kSessionLock);
+  struct sessionJob *tJob = kSessionStarted;
+  kSessionStarted = NULL;
+  pthread_mutex_unlock(&kSessionLock);
+
+  while(tJob != NULL)
+  {
+    struct sessionJob *tNext = tJob->next;
+    struct connection *tConn = tJob->conn;
+    tConn->starting = FALSE;
+    answerSetup(tConn, tJob->session, &(tJob->ports));
+    addStaticPart(tConn, "\r\n");
+    free(tJob);
+    if(watchSocket(pLoop, tConn->clientSocket, EVENT_READ, tConn) == ERROR)
     {
-      free(pConn->keys->aeskey);
+      closeClient(pLoop, tConn);
     }
-    if(pConn->keys->fmt != NULL)
+    else
     {
-      free(pConn->keys->fmt);
+      serviceClient(pLoop, tConn, 0);
     }
-    pConn->keys = NULL;
+    tJob = tNext;
+  }
+}
+
+static void cleanup(struct connection *pConn)
+{
+  cleanupBuffers(pConn);
+  // the session takes its ports with it; these are left if there was none
+  endSession(pConn);
+  if(pConn->rtpPort > 0 && kPortPool != NULL)
+  {
+    releasePortPair(kPortPool, pConn->rtpPort);
+    pConn->rtpPort = 0;
   }
   if(pConn->clientSocket != -1)
   {
@@ -997,47 +1402,44 @@ static int getAvailChars(struct shairbuffer *pBuf)
   return (pBuf->maxsize / sizeof(char)) - pBuf->current;
 }
 
-static void addToShairBuffer(struct shairbuffer *pBuf, char *pNewBuf)
+static void clearResponse(struct connection *pConn)
 {
-  addNToShairBuffer(pBuf, pNewBuf, strlen(pNewBuf));
+  pConn->resp.count = 0;
+  pConn->resp.next = 0;
+  pConn->resp.length = 0;
 }
 
-static void addNToShairBuffer(struct shairbuffer *pBuf, char *pNewBuf, int pNofNewBuf)
+static void addPart(struct connection *pConn, const char *pText, int pLength)
 {
-  int tAvailChars = getAvailChars(pBuf);
-  if(pNofNewBuf > tAvailChars)
+  struct response *tResp = &(pConn->resp);
+  if(pLength <= 0)
   {
-    int tNewSize = pBuf->maxsize * 2 + MAX_SIZE + sizeof(char);
-    char *tTmpBuf = malloc(tNewSize);
-
-    tTmpBuf[0] = '\0';
-    memset(tTmpBuf, 0, tNewSize/sizeof(char));
-    memcpy(tTmpBuf, pBuf->data, pBuf->current);
-    free(pBuf->data);
-
-    pBuf->maxsize = tNewSize;
-    pBuf->data = tTmpBuf;
+    return; // an empty part would stall the writev loop
   }
-  memcpy(pBuf->data + pBuf->current, pNewBuf, pNofNewBuf);
-  pBuf->current += pNofNewBuf;
-  if(getAvailChars(pBuf) > 1)
+  if(tResp->count == RESPONSE_PARTS)
   {
-    pBuf->data[pBuf->current] = '\0';
+    slog(LOG_INFO, "Response needs more than %d parts\n", RESPONSE_PARTS);
+    return;
   }
+  tResp->parts[tResp->count].iov_base = (void *)pText;
+  tResp->parts[tResp->count].iov_len = pLength;
+  tResp->count++;
+  tResp->length += pLength;
 }
 
-static char *getTrimmedMalloc(char *pChar, int pSize, int pEndStr, int pAddNL)
+// Hands out pSize bytes of the connection's scratch memory, or NULL if
+// this request has used it all.
+static char *arenaAlloc(struct arena *pArena, int pSize)
 {
-  int tAdditionalSize = 0;
-  if(pEndStr)
-    tAdditionalSize++;
-  if(pAddNL)
-    tAdditionalSize++;
-  char *tTrimDest = malloc(sizeof(char) * (pSize + tAdditionalSize));
-  return getTrimmed(pChar, pSize, pEndStr, pAddNL, tTrimDest);
+  if(pSize < 0 || pSize > SCRATCH_SIZE - pArena->used)
+  {
+    slog(LOG_INFO, "Request needs more than %d bytes of scratch memory\n", SCRATCH_SIZE);
+    return NULL;
+  }
+  pArena->used += pSize;
+  return pArena->data + pArena->used - pSize;
 }
 
-// Must free returned ptr
 static char *getTrimmed(char *pChar, int pSize, int pEndStr, int pAddNL, char *pTrimDest)
 {
   int tSize = pSize;
@@ -1085,20 +1487,21 @@ static int isLogEnabledFor(int pLevel)
   return FALSE;
 }
 
-static void initConnection(struct connection *pConn, struct keyring *pKeys,
-                    struct comms *pComms, int pSocket, char *pPassword)
+static void initConnection(struct connection *pConn, int pSocket, char *pPassword)
 {
-  pConn->hairtunes = pComms;
-  if(pKeys != NULL)
-  {
-    pConn->keys = pKeys;
-    pConn->keys->aesiv = NULL;
-    pConn->keys->aeskey = NULL;
-    pConn->keys->fmt = NULL;
-  }
+  pConn->session = NULL;
+  pConn->driftKey[0] = '\0';
+  pConn->hwid = NULL;
+  pConn->closing = FALSE;
+  pConn->starting = FALSE;
+  pConn->keys.set = FALSE;
+  pConn->scratch.used = 0;
   pConn->recv.data = NULL;  // Pre-init buffer expected to be NULL
-  pConn->resp.data = NULL;  // Pre-init buffer expected to be NULL
+  pConn->recv.current = 0;
+  rtspReset(&(pConn->request));
+  clearResponse(pConn);
   pConn->clientSocket = pSocket;
+  pConn->rtpPort = 0;
   if(strlen(pPassword) >0)
   {
     pConn->password = pPassword;
@@ -1109,15 +1512,6 @@ static void initConnection(struct connection *pConn, struct keyring *pKeys,
   }
 }
 
-static void closePipe(int *pPipe)
-{
-  if(*pPipe != -1)
-  {
-    close(*pPipe);
-    *pPipe = -1;
-  }
-}
-
 static void initBuffer(struct shairbuffer *pBuf, int pNumChars)
 {
   if(pBuf->data != NULL)
@@ -1127,29 +1521,8 @@ static void initBuffer(struct shairbuffer *pBuf, int pNumChars)
     slog(LOG_DEBUG_VV, "Free didn't seem to seg fault....huzzah\n");
   }
   pBuf->current = 0;
-  pBuf->marker = 0;
   pBuf->maxsize = sizeof(char) * pNumChars;
   pBuf->data = malloc(pBuf->maxsize);
-  memset(pBuf->data, 0, pBuf->maxsize);
-}
-
-static void setKeys(struct keyring *pKeys, char *pIV, char* pAESKey, char *pFmtp)
-{
-  if(pKeys->aesiv != NULL)
-  {
-    free(pKeys->aesiv);
-  }
-  if(pKeys->aeskey != NULL)
-  {
-    free(pKeys->aeskey);
-  }
-  if(pKeys->fmt != NULL)
-  {
-    free(pKeys->fmt);
-  }
-  pKeys->aesiv = pIV;
-  pKeys->aeskey = pAESKey;
-  pKeys->fmt = pFmtp;
 }
 
 #define AIRPORT_PRIVATE_KEY \
@@ -1177,11 +1550,16 @@ static void setKeys(struct keyring *pKeys, char *pIV, char* pAESKey, char *pFmtp
 "2gG0N5hvJpzwwhbhXqFKA4zaaSrw622wDniAK5MlIE0tIAKKP4yxNGjoD2QYjhBGuhvkWKY=\n" \
 "-----END RSA PRIVATE KEY-----"
 
+// Read once, and kept: every connection signs and decrypts with it
 static RSA *loadKey(void)
 {
-  BIO *tBio = BIO_new_mem_buf(AIRPORT_PRIVATE_KEY, -1);
-  RSA *rsa = PEM_read_bio_RSAPrivateKey(tBio, NULL, NULL, NULL); //NULL, NULL, NULL);
-  BIO_free(tBio);
-  slog(RSA_LOG_LEVEL, "RSA Key: %d\n", RSA_check_key(rsa));
+  static RSA *rsa = NULL;
+  if(rsa == NULL)
+  {
+    BIO *tBio = BIO_new_mem_buf(AIRPORT_PRIVATE_KEY, -1);
+    rsa = PEM_read_bio_RSAPrivateKey(tBio, NULL, NULL, NULL); //NULL, NULL, NULL);
+    BIO_free(tBio);
+    slog(RSA_LOG_LEVEL, "RSA Key: %d\n", RSA_check_key(rsa));
+  }
   return rsa;
 }
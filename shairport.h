@@ -8,13 +8,20 @@
 #include <openssl/ssl.h>
 #include <openssl/err.h>
 #include "socketlib.h"
+#include "hairtunes.h"
+#include "rtsp.h"
 #include <regex.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <sys/wait.h>
 #include <regex.h>
 
 
 #define HWID_SIZE 6
+#define MAX_EVENTS 32   // socket events taken per wait
+#define FMTP_SIZE 256
+#define SCRATCH_SIZE 4096
+#define RESPONSE_PARTS 16
 #define SHAIRPORT_LOG 1
 #define LOG_INFO     1
 #define LOG_DEBUG    5
@@ -26,30 +33,52 @@ struct shairbuffer
   char *data;
   int   current;
   int   maxsize;
-  int   marker;
 };
 
 struct keyring
 {
-  char *aeskey;
-  char *aesiv;
-  char *fmt;
+  char aeskey[16];
+  char aesiv[16];
+  char fmt[FMTP_SIZE];
+  int  set;   // once an ANNOUNCE has given them
 };
 
-struct comms
+// Scratch memory for answering one request: handed out in order, and all
+// taken back when the next request starts.
+struct arena
 {
-  int  in[2];
-  int  out[2];
+  int  used;
+  char data[SCRATCH_SIZE];
+};
+
+// A response goes out in one writev, as parts that point at string
+// constants, the request, or the scratch arena; none of them move until
+// it has all gone.
+struct response
+{
+  struct iovec parts[RESPONSE_PARTS];
+  int count;
+  int next;     // first part not yet all sent
+  int length;
 };
 
 struct connection
 {
-  struct shairbuffer  recv;
-  struct shairbuffer  resp;
-  struct keyring      *keys; // Does not point to malloc'd memory.
-  struct comms        *hairtunes;
+  struct shairbuffer  recv;     // from the start of the request being read
+  struct rtspRequest  request;  // what is known of it so far
+  struct response     resp;
+  struct keyring      keys;
+  struct arena        scratch;
+  hairtunes_session_t *session;   // the stream SETUP started, NULL if none
+  char                driftKey[DRIFT_KEY_SIZE];
   int                 clientSocket;
   char                *password;
+  int                 rtpPort;  // pair taken from the port pool, 0 if none
+  unsigned char       ipBin[16];  // our address, as the client reached it
+  unsigned int        ipBinLen;
+  char                *hwid;
+  int                 closing;  // close once the response has gone
+  int                 starting; // SETUP waiting for the session thread
 };
 
 void sim(int pLevel, char *pValue1, char *pValue2);
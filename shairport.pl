@@ -61,6 +61,8 @@ my $daemon;
 my $libao_driver;
 my $libao_devicename;
 my $libao_deviceid;
+# extra hairtunes tuning options, name=value
+my @decoder_options;
 # suppose hairtunes is under same directory
 my $hairtunes_cli = $FindBin::Bin . '/hairtunes';
 # Integrate with Squeezebox Server
@@ -95,6 +97,7 @@ GetOptions("a|apname=s" => \$apname,
           "ao_driver=s" => \$libao_driver,
           "ao_devicename=s" => \$libao_devicename,
           "ao_deviceid=s" => \$libao_deviceid,
+          "O|decoder_option=s" => \@decoder_options,
           "v|verbose" => \$verbose,
           "w|writepid=s" => \$writepid,
           "s|squeezebox" => \$squeeze,
@@ -118,6 +121,7 @@ sub usage {
           "      --ao_driver=driver          Sets the ao driver (optional)\n",
           "      --ao_devicename=devicename  Sets the ao device name (optional)\n",
           "      --ao_deviceid=id            Sets the ao device id (optional)\n",
+          "  -O  --decoder_option=name=value Passes a tuning option to hairtunes (repeatable)\n",
           "  -s  --squeezebox                Enables local Squeezebox Server integration\n",
           "  -c  --cliport=port              Sets the SBS CLI port\n",
           "  -m  --mac=address               Sets the SB target device\n",
@@ -668,6 +672,10 @@ sub conn_handle_request {
             $dec_args{ao_driver} = $libao_driver if defined $libao_driver;
             $dec_args{ao_devicename} = $libao_devicename if defined $libao_devicename;
             $dec_args{ao_deviceid} = $libao_deviceid if defined $libao_deviceid;
+            foreach (@decoder_options) {
+                my ($name, $value) = split /=/, $_, 2;
+                $dec_args{$name} = $value if defined $value;
+            }
 
             my $dec = $hairtunes_cli . join(' ', '', map { sprintf "%s '%s'", $_, $dec_args{$_} } keys(%dec_args));
 
@@ -32,12 +32,19 @@
 #include <sys/types.h>
 #include <unistd.h>
 #include <errno.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <time.h>
+#include <fcntl.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#else
+#include <poll.h>
+#endif
 
 #include <openssl/sha.h>
 #include <openssl/hmac.h>
 #include <openssl/evp.h>
-#include <openssl/bio.h>
-#include <openssl/buffer.h>
 
 int common_setup(struct addrinfo *pAddrInfo)
 {  
@@ -142,6 +149,11 @@ int acceptClient(int pSock, struct addrinfo *server_addr)
   // close the listen socket.  Not expecting any more clients.
   if (tAccept < 0)
   {
+    // a non-blocking listen socket that has run out of clients
+    if(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+    {
+      return ERROR;
+    }
     perror("Error: Unable to accept connection to server socket");
     return ERROR;
   }
@@ -183,95 +195,401 @@ void delay(long pMillisecs, struct timeval *pRes)
   select(0,NULL,NULL,NULL,pRes);
 }
 
-static int getCorrectedEncodeSize(int pSize)
+int setNonBlocking(int pSock)
 {
-  if(pSize % 4 == 0)
+  int tFlags = fcntl(pSock, F_GETFL, 0);
+  if(tFlags < 0 || fcntl(pSock, F_SETFL, tFlags | O_NONBLOCK) < 0)
   {
-    return pSize;
+    perror("Error: Could not make socket non-blocking");
+    return ERROR;
   }
-  else if((pSize + 1) % 4 == 0)
+  return 0;
+}
+
+#ifdef __linux__
+struct eventLoop
+{
+  int epoll;
+};
+
+struct eventLoop *createEventLoop(void)
+{
+  struct eventLoop *tLoop = malloc(sizeof(struct eventLoop));
+  tLoop->epoll = epoll_create1(EPOLL_CLOEXEC);
+  if(tLoop->epoll < 0)
   {
-    return pSize+1;
+    perror("Error: Could not create event loop");
+    free(tLoop);
+    return NULL;
   }
-  else if((pSize + 2) % 4 == 0)
+  return tLoop;
+}
+
+int watchSocket(struct eventLoop *pLoop, int pSock, int pEvents, void *pData)
+{
+  struct epoll_event tEvent;
+  memset(&tEvent, 0, sizeof(tEvent));
+  tEvent.events = ((pEvents & EVENT_READ) ? EPOLLIN : 0) | ((pEvents & EVENT_WRITE) ? EPOLLOUT : 0);
+  tEvent.data.ptr = pData;
+  if(epoll_ctl(pLoop->epoll, EPOLL_CTL_MOD, pSock, &tEvent) < 0)
   {
-    return pSize+2;
+    if(errno != ENOENT || epoll_ctl(pLoop->epoll, EPOLL_CTL_ADD, pSock, &tEvent) < 0)
+    {
+      perror("Error: Could not watch socket");
+      return ERROR;
+    }
   }
-  else
+  return 0;
+}
+
+void forgetSocket(struct eventLoop *pLoop, int pSock)
+{
+  struct epoll_event tEvent;  // ignored, but older kernels want one
+  epoll_ctl(pLoop->epoll, EPOLL_CTL_DEL, pSock, &tEvent);
+}
+
+int waitEvents(struct eventLoop *pLoop, struct socketEvent *pReady, int pMax, int pTimeoutMs)
+{
+  struct epoll_event tEvents[pMax];
+  int tCount = epoll_wait(pLoop->epoll, tEvents, pMax, pTimeoutMs);
+  int tIdx = 0;
+  for(tIdx = 0; tIdx < tCount; tIdx++)
   {
-    // Invalid encoded data, no other cases are possible.
-    printf("Unrecoverable error....base64 values are incorrectly encoded\n");
-    return pSize;
+    pReady[tIdx].data = tEvents[tIdx].data.ptr;
+    pReady[tIdx].events = 0;
+    if(tEvents[tIdx].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+    {
+      pReady[tIdx].events |= EVENT_READ;  // a read will say what went wrong
+    }
+    if(tEvents[tIdx].events & EPOLLOUT)
+    {
+      pReady[tIdx].events |= EVENT_WRITE;
+    }
   }
+  return tCount < 0 ? ERROR : tCount;
 }
+#else
+// poll() for systems without epoll; rebuilt from this list each wait
+struct eventLoop
+{
+  struct pollfd *fds;
+  void **data;
+  int count;
+  int size;
+};
 
-// From http://www.ioncannon.net/programming/34/howto-base64-encode-with-cc-and-openssl/
+struct eventLoop *createEventLoop(void)
+{
+  return calloc(1, sizeof(struct eventLoop));
+}
 
-//int main(int argc, char **argv)
-//{
-//  char *output = decode_base64("WU9ZTyEA\n\0", strlen("WU9ZTyEA\n\0"));
-//  printf("Unbase64: *%s*\n", output);
-//  free(output);/
-//}
+int watchSocket(struct eventLoop *pLoop, int pSock, int pEvents, void *pData)
+{
+  int tIdx = 0;
+  while(tIdx < pLoop->count && pLoop->fds[tIdx].fd != pSock)
+  {
+    tIdx++;
+  }
+  if(tIdx == pLoop->count)
+  {
+    if(pLoop->count == pLoop->size)
+    {
+      pLoop->size = pLoop->size ? pLoop->size * 2 : 16;
+      pLoop->fds = realloc(pLoop->fds, pLoop->size * sizeof(struct pollfd));
+      pLoop->data = realloc(pLoop->data, pLoop->size * sizeof(void *));
+    }
+    pLoop->count++;
+  }
+  pLoop->fds[tIdx].fd = pSock;
+  pLoop->fds[tIdx].events = ((pEvents & EVENT_READ) ? POLLIN : 0) | ((pEvents & EVENT_WRITE) ? POLLOUT : 0);
+  pLoop->fds[tIdx].revents = 0;
+  pLoop->data[tIdx] = pData;
+  return 0;
+}
 
-char *decode_base64(unsigned char *pInput, int pLength, int *pActualLength)
+void forgetSocket(struct eventLoop *pLoop, int pSock)
 {
-  // Needs All NO_NL flags for proper RSA AES KEY Descrypt
-  BIO *b64, *bmem;
-  unsigned char *input = pInput;
-  int length = getCorrectedEncodeSize(pLength);
-  if(pLength != length)
+  int tIdx = 0;
+  for(tIdx = 0; tIdx < pLoop->count; tIdx++)
   {
-    input = malloc(length * sizeof(unsigned char));
-    memset(input, 0, length);
-    memcpy(input, pInput, pLength);
-    memset(input+pLength, '=', length-pLength);
-    printf("Fixed value: [%.*s]\n", length, input);
+    if(pLoop->fds[tIdx].fd == pSock)
+    {
+      pLoop->count--;
+      pLoop->fds[tIdx] = pLoop->fds[pLoop->count];
+      pLoop->data[tIdx] = pLoop->data[pLoop->count];
+      return;
+    }
   }
-  char *buffer = (char *)malloc(length);
-  memset(buffer, 0, length);
+}
 
-  b64 = BIO_new(BIO_f_base64());
-  BIO_set_flags(b64, BIO_FLAGS_BASE64_NO_NL);
+int waitEvents(struct eventLoop *pLoop, struct socketEvent *pReady, int pMax, int pTimeoutMs)
+{
+  int tCount = poll(pLoop->fds, pLoop->count, pTimeoutMs);
+  int tReady = 0;
+  int tIdx = 0;
+  if(tCount < 0)
+  {
+    return ERROR;
+  }
+  for(tIdx = 0; tIdx < pLoop->count && tReady < pMax; tIdx++)
+  {
+    short tEvents = pLoop->fds[tIdx].revents;
+    if(tEvents == 0)
+    {
+      continue;
+    }
+    pReady[tReady].data = pLoop->data[tIdx];
+    pReady[tReady].events = ((tEvents & (POLLIN | POLLHUP | POLLERR)) ? EVENT_READ : 0) |
+                            ((tEvents & POLLOUT) ? EVENT_WRITE : 0);
+    tReady++;
+  }
+  return tReady;
+}
+#endif
 
-  bmem = BIO_new_mem_buf(input, length);
-  BIO_set_flags(bmem, BIO_FLAGS_BASE64_NO_NL);
-  bmem = BIO_push(b64, bmem);
+struct portPool
+{
+  pthread_mutex_t lock;
+  int low;
+  int pairs;
+  int head;               // next free pair to hand out
+  int avail;
+  unsigned short free[];  // ring of free pair indexes
+};
+
+struct portPool *createPortPool(int pLow, int pHigh)
+{
+  int tPairs = (pHigh - pLow + 1) / 2;
+  if(tPairs < 1)
+  {
+    return NULL;
+  }
 
-  BIO_set_flags(bmem, BIO_FLAGS_BASE64_NO_NL);
+  size_t tSize = sizeof(struct portPool) + tPairs * sizeof(unsigned short);
+  struct portPool *tPool = malloc(tSize);
+  if(tPool == NULL)
+  {
+    perror("Error: Could not allocate port pool");
+    return NULL;
+  }
+  pthread_mutex_init(&tPool->lock, NULL);
 
-  *pActualLength = BIO_read(bmem, buffer, length);
+  tPool->low = pLow;
+  tPool->pairs = tPairs;
+  tPool->head = 0;
+  tPool->avail = tPairs;
+  int tIdx = 0;
+  for(tIdx = 0; tIdx < tPairs; tIdx++)
+  {
+    tPool->free[tIdx] = tIdx;
+  }
+  return tPool;
+}
 
-  BIO_free_all(bmem);
+int takePortPair(struct portPool *pPool)
+{
+  int tPort = ERROR;
+  pthread_mutex_lock(&pPool->lock);
+  if(pPool->avail > 0)
+  {
+    tPort = pPool->low + 2 * pPool->free[pPool->head];
+    pPool->head = (pPool->head + 1) % pPool->pairs;
+    pPool->avail--;
+  }
+  pthread_mutex_unlock(&pPool->lock);
+  return tPort;
+}
 
-  if(pLength != length)
+void releasePortPair(struct portPool *pPool, int pPort)
+{
+  int tPair = (pPort - pPool->low) / 2;
+  if(tPair < 0 || tPair >= pPool->pairs)
   {
-    free(input);
+    return;
   }
-  return buffer;
+  pthread_mutex_lock(&pPool->lock);
+  if(pPool->avail < pPool->pairs)
+  {
+    pPool->free[(pPool->head + pPool->avail) % pPool->pairs] = tPair;
+    pPool->avail++;
+  }
+  pthread_mutex_unlock(&pPool->lock);
 }
 
-char *encode_base64(unsigned char *input, int length)
+#define DRIFT_ENTRIES 32
+
+struct driftEntry
 {
-  BIO *bmem, *b64;
-  BUF_MEM *bptr;
+  char key[DRIFT_KEY_SIZE];
+  double ppm;
+  time_t updated;         // 0 if unused
+};
 
-  b64 = BIO_new(BIO_f_base64());
-  // This enables/disables nls
-  BIO_set_flags(b64, BIO_FLAGS_BASE64_NO_NL);
-  bmem = BIO_new(BIO_s_mem());
+struct driftCache
+{
+  pthread_mutex_t lock;
+  char file[256];         // empty if kept in memory only
+  struct driftEntry entries[DRIFT_ENTRIES];
+};
 
-  b64 = BIO_push(b64, bmem);
+static void loadDriftFile(struct driftCache *pCache)
+{
+  FILE *tFile = fopen(pCache->file, "r");
+  if(tFile == NULL)
+  {
+    return;
+  }
+  char tLine[DRIFT_KEY_SIZE + 64];
+  int tIdx = 0;
+  while(tIdx < DRIFT_ENTRIES && fgets(tLine, sizeof(tLine), tFile))
+  {
+    struct driftEntry *tEntry = &pCache->entries[tIdx];
+    long tUpdated = 0;
+    if(sscanf(tLine, "%ld %lf %95s", &tUpdated, &tEntry->ppm, tEntry->key) == 3 && tUpdated > 0)
+    {
+      tEntry->updated = tUpdated;
+      tIdx++;
+    }
+  }
+  fclose(tFile);
+}
 
-  BIO_write(b64, input, length);
-  (void)BIO_flush(b64);
-  BIO_get_mem_ptr(b64, &bptr);
+// called with the lock held; written aside and renamed so a reader never
+// sees half a file
+static void saveDriftFile(struct driftCache *pCache)
+{
+  char tTmp[sizeof(pCache->file) + 8];
+  snprintf(tTmp, sizeof(tTmp), "%s.tmp", pCache->file);
+  FILE *tFile = fopen(tTmp, "w");
+  if(tFile == NULL)
+  {
+    return;
+  }
+  int tIdx = 0;
+  for(tIdx = 0; tIdx < DRIFT_ENTRIES; tIdx++)
+  {
+    struct driftEntry *tEntry = &pCache->entries[tIdx];
+    if(tEntry->updated)
+    {
+      fprintf(tFile, "%ld %.3f %s\n", (long)tEntry->updated, tEntry->ppm, tEntry->key);
+    }
+  }
+  if(fclose(tFile) == 0)
+  {
+    rename(tTmp, pCache->file);
+  }
+}
 
-  char *buff = (char *)malloc(bptr->length);
-  memcpy(buff, bptr->data, bptr->length-1);
-  buff[bptr->length-1] = 0;
+struct driftCache *createDriftCache(char *pFile)
+{
+  struct driftCache *tCache = calloc(1, sizeof(struct driftCache));
+  if(tCache == NULL)
+  {
+    perror("Error: Could not allocate drift cache");
+    return NULL;
+  }
+  pthread_mutex_init(&tCache->lock, NULL);
 
-  BIO_free_all(b64);
+  if(pFile != NULL)
+  {
+    strncpy(tCache->file, pFile, sizeof(tCache->file) - 1);
+    loadDriftFile(tCache);
+  }
+  return tCache;
+}
 
-  return buff;
+int lookupDrift(struct driftCache *pCache, char *pKey, double *pPpm)
+{
+  int tFound = 0;
+  int tIdx = 0;
+  pthread_mutex_lock(&pCache->lock);
+  for(tIdx = 0; tIdx < DRIFT_ENTRIES; tIdx++)
+  {
+    struct driftEntry *tEntry = &pCache->entries[tIdx];
+    if(tEntry->updated && !strcmp(tEntry->key, pKey))
+    {
+      *pPpm = tEntry->ppm;
+      tFound = 1;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&pCache->lock);
+  return tFound;
+}
+
+void storeDrift(struct driftCache *pCache, char *pKey, double pPpm)
+{
+  struct driftEntry *tSlot = NULL;
+  int tIdx = 0;
+  pthread_mutex_lock(&pCache->lock);
+  // the entry for this key, else an empty one, else the stalest
+  for(tIdx = 0; tIdx < DRIFT_ENTRIES; tIdx++)
+  {
+    struct driftEntry *tEntry = &pCache->entries[tIdx];
+    if(tEntry->updated && !strcmp(tEntry->key, pKey))
+    {
+      tSlot = tEntry;
+      break;
+    }
+    if(tSlot == NULL || (tSlot->updated && tEntry->updated < tSlot->updated))
+    {
+      tSlot = tEntry;
+    }
+  }
+  strncpy(tSlot->key, pKey, DRIFT_KEY_SIZE - 1);
+  tSlot->key[DRIFT_KEY_SIZE - 1] = '\0';
+  tSlot->ppm = pPpm;
+  tSlot->updated = time(NULL);
+  if(pCache->file[0])
+  {
+    saveDriftFile(pCache);
+  }
+  pthread_mutex_unlock(&pCache->lock);
+}
+
+// Done a block at a time with EVP_DecodeBlock and EVP_EncodeBlock, which
+// write straight into the caller's buffer.
+int decodeBase64(const char *pInput, int pLength, unsigned char *pOutput)
+{
+  int tWhole = pLength - pLength % 4;
+  int tTail = pLength % 4;
+  int tLength = 0;
+  if(tTail == 1)
+  {
+    return ERROR;
+  }
+  if(tWhole > 0)
+  {
+    tLength = EVP_DecodeBlock(pOutput, (const unsigned char *)pInput, tWhole);
+    if(tLength < 0)
+    {
+      return ERROR;
+    }
+    // EVP_DecodeBlock counts the padding as zero bytes
+    int tIdx = tWhole;
+    while(tIdx > tWhole - 2 && pInput[tIdx - 1] == '=')
+    {
+      tLength--;
+      tIdx--;
+    }
+  }
+  if(tTail > 0)
+  {
+    // put back the padding iTunes leaves off
+    unsigned char tQuad[4] = { '=', '=', '=', '=' };
+    unsigned char tBytes[3];
+    memcpy(tQuad, pInput + tWhole, tTail);
+    if(EVP_DecodeBlock(tBytes, tQuad, 4) < 0)
+    {
+      return ERROR;
+    }
+    memcpy(pOutput + tLength, tBytes, tTail - 1);
+    tLength += tTail - 1;
+  }
+  return tLength;
+}
+
+int encodeBase64(const unsigned char *pInput, int pLength, char *pOutput)
+{
+  return EVP_EncodeBlock((unsigned char *)pOutput, pInput, pLength);
 }
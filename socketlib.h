@@ -28,12 +28,50 @@ int setup_server(struct addrinfo *server_address);
 int setupListenServer(struct addrinfo **pAddrInfo, int pPort);
 int acceptClient(int pSock, struct addrinfo *server_addr);
 void delay(long pMillisecs, struct timeval *pRes);
+int setNonBlocking(int pSock);
 int getAddr(char *pHostname, char *pService, int pFamily, int pSockType, struct addrinfo **pAddrInfo);
 
-// All calls to decode and encode need to be freed
-char *decode_base64(unsigned char *input, int length, int *tActualLength);
-// All calls to decode and encode need to be freed
-char *encode_base64(unsigned char *input, int length);
+// Readiness of many sockets from one thread: epoll where there is one,
+// poll() elsewhere. Each socket carries a pointer handed back with its
+// events.
+#define EVENT_READ  1   // also set on hangup and error
+#define EVENT_WRITE 2
+struct eventLoop;
+struct socketEvent
+{
+  void *data;
+  int   events;
+};
+struct eventLoop *createEventLoop(void);
+int watchSocket(struct eventLoop *pLoop, int pSock, int pEvents, void *pData);  // add, or change
+void forgetSocket(struct eventLoop *pLoop, int pSock);
+int waitEvents(struct eventLoop *pLoop, struct socketEvent *pReady, int pMax, int pTimeoutMs);
+
+// RTP port pairs (data, data+1) shared by every session, from any thread.
+// Pairs are handed out and returned in FIFO order, so a released pair is
+// reused as late as possible.
+struct portPool;
+struct portPool *createPortPool(int pLow, int pHigh);
+int takePortPair(struct portPool *pPool);   // data port, or ERROR when exhausted
+void releasePortPair(struct portPool *pPool, int pPort);
+
+// Clock drift learned per sender and output device, shared like the port
+// pool. With a file name the cache is loaded from it at start and
+// rewritten on every store.
+#define DRIFT_KEY_SIZE 96
+struct driftCache;
+struct driftCache *createDriftCache(char *pFile);
+int lookupDrift(struct driftCache *pCache, char *pKey, double *pPpm);   // 1 if found
+void storeDrift(struct driftCache *pCache, char *pKey, double pPpm);
+
+// Base64 without line breaks, into the caller's buffer: decoding needs
+// BASE64_DECODED_SIZE(length) bytes and returns how many it wrote, or
+// ERROR for input that isn't base64; encoding needs BASE64_ENCODED_SIZE
+// and returns the length of the string.
+#define BASE64_DECODED_SIZE(n) (((n) + 3) / 4 * 3)
+#define BASE64_ENCODED_SIZE(n) (((n) + 2) / 3 * 4 + 1)
+int decodeBase64(const char *pInput, int pLength, unsigned char *pOutput);
+int encodeBase64(const unsigned char *pInput, int pLength, char *pOutput);
 
 
 #endif
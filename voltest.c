@@ -0,0 +1,81 @@
+/*
+ * Volume scaling checks for HairTunes
+ * Copyright (c) ShairPort contributors 2012
+ * All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <stdio.h>
+
+#include "volume.h"
+
+// Ramps up to unity over full-scale input and checks that no sample
+// wraps around: a ramp may end on either frame of a pair, so it is run
+// at rates that give ramps of both odd and even length, and from several
+// starting gains.
+
+#define FRAMES 4096
+
+static int ramp_to_unity(int rate, double from) {
+    volume_t *v = volume_new(rate);
+    short buf[2*FRAMES];
+    int i, pass, bad = 0;
+
+    volume_set(v, from);
+    for (pass = 0; pass < 4; pass++) {
+        for (i = 0; i < 2*FRAMES; i++)
+            buf[i] = 32767;
+        volume_apply(v, buf, FRAMES);
+    }
+
+    volume_set(v, 1.0);
+    for (pass = 0; pass < 4; pass++) {
+        short in = pass & 1 ? -32767 : 32767;
+        for (i = 0; i < 2*FRAMES; i++)
+            buf[i] = in;
+        // an odd count, so the pairs don't line up the same way each time
+        volume_apply(v, buf, FRAMES - 1);
+        for (i = 0; i < 2*(FRAMES - 1); i++) {
+            if ((buf[i] < 0) != (in < 0)) {
+                if (!bad)
+                    fprintf(stderr, "rate %d from %.2f: sample %d went %d -> %d\n",
+                            rate, from, i, in, buf[i]);
+                bad++;
+            }
+        }
+    }
+    volume_free(v);
+    return bad;
+}
+
+int main(void) {
+    static const int rates[] = { 44100, 44150, 48000, 48050, 0 };
+    static const double from[] = { 0.0, 0.25, 0.5, 0.999, -1 };
+    int r, f, bad = 0;
+
+    for (r = 0; rates[r]; r++)
+        for (f = 0; from[f] >= 0; f++)
+            bad += ramp_to_unity(rates[r], from[f]);
+
+    printf("volume: %s\n", bad ? "FAILED" : "ok");
+    return bad != 0;
+}
@@ -0,0 +1,199 @@
+/*
+ * Volume scaling for HairTunes
+ * Copyright (c) ShairPort contributors 2012
+ * All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "volume.h"
+
+// Two frames at a time in 4-lane vectors: lanes 0 and 2 are the left
+// channel, 1 and 3 the right, and each lane runs its own xorshift32, so
+// neither the channels nor neighbouring samples share dither.
+//
+// The gain is 16.16 fixed point. The dither is the difference of two
+// uniform 16-bit values from one generator step: triangular, +-1 LSB of
+// the output, added before rounding.
+//
+// A new target gain is reached by a straight-line ramp, a step per frame,
+// over RAMP_MS; a target that moves mid-ramp starts a new ramp from
+// wherever the last one had got to.
+
+typedef int32_t v4si __attribute__((vector_size(16)));
+typedef uint32_t v4su __attribute__((vector_size(16)));
+typedef float v4sf __attribute__((vector_size(16)));
+
+// unity gain is passed through untouched; just below it, the worst case
+// of sample * gain + dither + rounding still fits 32 bits
+#define UNITY       0x10000
+#define MAX_GAIN    0xfffe
+
+#define RAMP_MS     20
+
+struct volume {
+    v4su rng;
+    int target;         // written by volume_set, atomically
+    int gain;           // where the audio thread has got to
+    int ramp_to;        // the target the current ramp heads for
+    double ramp_gain, ramp_step;
+    int ramp_frames;
+};
+
+volume_t *volume_new(int rate) {
+    volume_t *v = calloc(1, sizeof(volume_t));
+    v->rng = (v4su){ 0x9e3779b9, 0x7f4a7c15, 0x85ebca6b, 0xc2b2ae35 };
+    v->target = v->gain = v->ramp_to = UNITY;
+    v->ramp_frames = rate * RAMP_MS / 1000;
+    if (v->ramp_frames < 1)
+        v->ramp_frames = 1;
+    return v;
+}
+
+void volume_free(volume_t *v) {
+    free(v);
+}
+
+static int fix_gain(double gain) {
+    int g;
+
+    if (gain >= 1.0)
+        return UNITY;
+    if (gain <= 0)
+        return 0;
+    g = gain * UNITY;
+    return g > MAX_GAIN ? MAX_GAIN : g;
+}
+
+void volume_set(volume_t *v, double gain) {
+    __atomic_store_n(&v->target, fix_gain(gain), __ATOMIC_RELAXED);
+}
+
+// TPDF in 1/65536ths of an output LSB
+static inline v4si next_dither(volume_t *v) {
+    v4su x = v->rng;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    v->rng = x;
+
+    return (v4si)(x & 0xffff) - (v4si)(x >> 16);
+}
+
+static inline v4si scale(volume_t *v, v4si s, v4si g) {
+    return (s * g + next_dither(v) + 0x8000) >> 16;
+}
+
+// the gain for the next frame; step along the ramp if there is one.
+// the ramp may end on the first frame of a pair, which leaves the second
+// here with it already over, so that case has to be scaled too.
+static inline int next_gain(volume_t *v) {
+    if (v->gain != v->ramp_to) {
+        v->ramp_gain += v->ramp_step;
+        if ((v->ramp_step > 0 && v->ramp_gain >= v->ramp_to) ||
+            (v->ramp_step < 0 && v->ramp_gain <= v->ramp_to))
+            v->gain = v->ramp_to;
+        else
+            v->gain = v->ramp_gain;
+    }
+    // unity is only passed through untouched when steady
+    return v->gain == UNITY ? MAX_GAIN : v->gain;
+}
+
+// start a new ramp if volume_set has moved the target
+static void take_target(volume_t *v) {
+    int target = __atomic_load_n(&v->target, __ATOMIC_RELAXED);
+
+    if (target != v->ramp_to) {
+        v->ramp_to = target;
+        v->ramp_gain = v->gain;
+        v->ramp_step = (double)(target - v->gain) / v->ramp_frames;
+    }
+}
+
+void volume_apply(volume_t *v, short *buf, int frames) {
+    int g0, g1;
+    v4si g, s, r;
+    int i;
+
+    take_target(v);
+
+    for (i = 0; i < frames; i += 2, buf += 4) {
+        if (v->gain == v->ramp_to) {
+            // steady: the same gain in every lane, and nothing to do at unity
+            if (v->gain == UNITY)
+                return;
+            g0 = g1 = v->gain;
+        } else {
+            g0 = next_gain(v);
+            g1 = next_gain(v);
+        }
+        g = (v4si){ g0, g0, g1, g1 };
+
+        if (i + 1 < frames) {
+            s = (v4si){ buf[0], buf[1], buf[2], buf[3] };
+            r = scale(v, s, g);
+            buf[0] = r[0];
+            buf[1] = r[1];
+            buf[2] = r[2];
+            buf[3] = r[3];
+        } else {
+            s = (v4si){ buf[0], buf[1], 0, 0 };
+            r = scale(v, s, g);
+            buf[0] = r[0];
+            buf[1] = r[1];
+        }
+    }
+}
+
+void volume_ramp(volume_t *v, float *gain, int frames) {
+    int i, g;
+
+    take_target(v);
+    for (i = 0; i < frames; i++) {
+        g = v->gain == v->ramp_to ? v->gain : next_gain(v);
+        gain[i] = (float)g / UNITY;
+    }
+}
+
+void volume_quantize(volume_t *v, const float *in, short *out, int frames) {
+    const v4sf scale = { 32768.0f, 32768.0f, 32768.0f, 32768.0f };
+    const v4sf lsb = { 1.0f/UNITY, 1.0f/UNITY, 1.0f/UNITY, 1.0f/UNITY };
+    v4sf x;
+    v4si d;
+    int i, j, n = 2*frames;
+
+    for (i = 0; i < n; i += 4) {
+        for (j = 0; j < 4; j++)
+            x[j] = i + j < n ? in[i + j] : 0;
+        d = next_dither(v);
+        x = x * scale + (v4sf){ d[0], d[1], d[2], d[3] } * lsb;
+        for (j = 0; j < 4 && i + j < n; j++) {
+            float f = x[j] + 0.5f;
+            f = f < -32768.0f ? -32768.0f : f > 32767.0f ? 32767.0f : f;
+            out[i + j] = (int)(f + 32768.0f) - 32768;   // floor, not truncation
+        }
+    }
+}
@@ -0,0 +1,28 @@
+#ifndef _VOLUME_H_
+#define _VOLUME_H_
+
+// Output volume for interleaved stereo 16-bit frames. Anything below full
+// scale is TPDF dithered, with a dither generator of its own per channel.
+//
+// volume_set may be called from any thread, without locking, while another
+// is in volume_apply: it only publishes a new target, which volume_apply
+// then ramps to over a few milliseconds instead of stepping.
+
+typedef struct volume volume_t;
+
+volume_t *volume_new(int rate);
+void volume_free(volume_t *v);
+
+// linear gain, 0 to 1
+void volume_set(volume_t *v, double gain);
+
+// scale 'frames' frames in place
+void volume_apply(volume_t *v, short *buf, int frames);
+
+// for a float signal path: the gain to use for each of the next 'frames'
+// frames, as volume_apply would have, and then the way back to 16 bits
+// with the same dither. 'in' is full scale at +-1.0, and is clipped.
+void volume_ramp(volume_t *v, float *gain, int frames);
+void volume_quantize(volume_t *v, const float *in, short *out, int frames);
+
+#endif